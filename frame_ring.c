@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_ring.h"
+
+#define RING_ALIGN(x) (((x) + FRAME_RING_ALIGN - 1) & ~(size_t)(FRAME_RING_ALIGN - 1))
+
+#define SLOT_HEADER_SIZE RING_ALIGN(sizeof(FrameRingSlotHeader))
+
+static FrameRingSlotHeader *ring_slot(FrameRingHeader *h, uint64_t frame_number)
+{
+    return (FrameRingSlotHeader *)((uint8_t *)h + h->slot_offset +
+                                   ((frame_number - 1) % h->nb_slots) * h->slot_stride);
+}
+
+int frame_ring_create(FrameRing *ring, const char *name, int nb_slots, size_t slot_data_size)
+{
+    FrameRingHeader *h;
+    size_t stride, size;
+    int fd, ret;
+
+    memset(ring, 0, sizeof(*ring));
+    if (nb_slots < 2 || strlen(name) >= sizeof(ring->name))
+        return -EINVAL;
+
+    stride = SLOT_HEADER_SIZE + RING_ALIGN(slot_data_size);
+    size   = RING_ALIGN(sizeof(FrameRingHeader)) + nb_slots * stride;
+
+    // a ring left over by a pusher that crashed is replaced, not reused
+    shm_unlink(name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return -errno;
+    if (ftruncate(fd, size) < 0) {
+        ret = -errno;
+        close(fd);
+        shm_unlink(name);
+        return ret;
+    }
+    h = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ret = -errno;
+    close(fd);
+    if (h == MAP_FAILED) {
+        shm_unlink(name);
+        return ret;
+    }
+
+    // ftruncate gave zeroed pages, every slot starts out even and empty
+    h->version        = FRAME_RING_VERSION;
+    h->nb_slots       = nb_slots;
+    h->slot_offset    = RING_ALIGN(sizeof(FrameRingHeader));
+    h->slot_stride    = stride;
+    h->slot_data_size = RING_ALIGN(slot_data_size);
+    __atomic_store_n(&h->magic, FRAME_RING_MAGIC, __ATOMIC_RELEASE);
+
+    ring->header = h;
+    ring->size   = size;
+    ring->writer = 1;
+    strcpy(ring->name, name);
+    return 0;
+}
+
+void frame_ring_destroy(FrameRing *ring)
+{
+    if (!ring->header)
+        return;
+
+    __atomic_store_n(&ring->header->closed, 1, __ATOMIC_RELEASE);
+    shm_unlink(ring->name);
+    munmap(ring->header, ring->size);
+    ring->header = NULL;
+}
+
+uint8_t *frame_ring_write_begin(FrameRing *ring, FrameRingSlotHeader **slot)
+{
+    FrameRingHeader *h = ring->header;
+    FrameRingSlotHeader *s = ring_slot(h, h->latest + 1);
+
+    // odd before any byte of the slot changes
+    __atomic_store_n(&s->sequence, s->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    *slot = s;
+    return (uint8_t *)s + SLOT_HEADER_SIZE;
+}
+
+void frame_ring_write_end(FrameRing *ring, FrameRingSlotHeader *slot)
+{
+    FrameRingHeader *h = ring->header;
+
+    slot->frame_number = h->latest + 1;
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->latest, slot->frame_number, __ATOMIC_RELEASE);
+}
+
+void frame_ring_write_abort(FrameRingSlotHeader *slot)
+{
+    // latest is left alone, the slot only holds an old frame nobody looks up any more
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+int frame_ring_open(FrameRing *ring, const char *name)
+{
+    FrameRingHeader *h;
+    struct stat st;
+    int fd, ret;
+
+    memset(ring, 0, sizeof(*ring));
+    if (strlen(name) >= sizeof(ring->name))
+        return -EINVAL;
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return -errno;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(FrameRingHeader)) {
+        close(fd);
+        return -EAGAIN;
+    }
+    h = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ret = -errno;
+    close(fd);
+    if (h == MAP_FAILED)
+        return ret;
+
+    if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != FRAME_RING_MAGIC ||
+        h->version != FRAME_RING_VERSION ||
+        h->slot_offset + (uint64_t)h->nb_slots * h->slot_stride > (uint64_t)st.st_size) {
+        munmap(h, st.st_size);
+        return -EAGAIN;
+    }
+
+    ring->header = h;
+    ring->size   = st.st_size;
+    strcpy(ring->name, name);
+    return 0;
+}
+
+void frame_ring_close(FrameRing *ring)
+{
+    if (ring->header)
+        munmap(ring->header, ring->size);
+    ring->header = NULL;
+}
+
+int frame_ring_latest(FrameRing *ring, FrameRingFrame *frame)
+{
+    FrameRingHeader *h = ring->header;
+    int tries, i;
+
+    for (tries = 0; tries < 4; tries++) {
+        const FrameRingSlotHeader *s;
+        const uint8_t *data;
+        uint64_t latest;
+        uint32_t seq;
+
+        if (__atomic_load_n(&h->closed, __ATOMIC_ACQUIRE))
+            return -ESTALE;
+        latest = __atomic_load_n(&h->latest, __ATOMIC_ACQUIRE);
+        if (!latest)
+            return -EAGAIN;
+
+        s   = ring_slot(h, latest);
+        seq = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE);
+        if ((seq & 1) || s->frame_number != latest)
+            continue;   // lapped by the pusher, look again
+
+        data = (const uint8_t *)s + SLOT_HEADER_SIZE;
+        memset(frame, 0, sizeof(*frame));
+        for (i = 0; i < 4 && i < (int)s->nb_planes; i++) {
+            frame->data[i]     = data + s->offset[i];
+            frame->linesize[i] = s->linesize[i];
+        }
+        frame->width        = s->width;
+        frame->height       = s->height;
+        frame->format       = s->format;
+        frame->pts          = s->pts;
+        frame->frame_number = latest;
+        frame->slot         = s;
+        frame->sequence     = seq;
+
+        if (frame_ring_frame_valid(frame))
+            return 0;
+    }
+
+    return -EAGAIN;
+}
+
+int frame_ring_frame_valid(const FrameRingFrame *frame)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->slot->sequence, __ATOMIC_RELAXED) == frame->sequence;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * latest-frame ring in POSIX shared memory
+ *
+ * stream_push publishes the hooked frames of a stream into a shared memory
+ * object holding nb_slots frames. every slot starts with a header guarded by
+ * a sequence number (a seqlock): it is odd while the pusher writes the slot
+ * and changes every time the slot is rewritten. readers map the object and
+ * look at the newest frame in place, without a copy or a system call:
+ *
+ *     FrameRing ring;
+ *     FrameRingFrame frame;
+ *
+ *     if (frame_ring_open(&ring, "/stream_push_0_0") < 0)
+ *         return;
+ *     while (running) {
+ *         int ret = frame_ring_latest(&ring, &frame);
+ *         if (ret == -ESTALE) {
+ *             // the pusher went away or replaced the ring, map it again
+ *             frame_ring_close(&ring);
+ *             ...
+ *         } else if (ret == 0) {
+ *             analyse(frame.data, frame.linesize, frame.width, frame.height);
+ *             if (!frame_ring_frame_valid(&frame))
+ *                 ; // overwritten while we looked at it, drop the result
+ *         }
+ *     }
+ *     frame_ring_close(&ring);
+ *
+ * the pusher needs nb_slots - 1 more frames before it comes back to the slot
+ * a reader is looking at. this file and frame_ring.c do not depend on FFmpeg;
+ * format is an enum AVPixelFormat value and pts is in microseconds.
+ */
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_RING_MAGIC   0x474e5246  /* "FRNG" */
+#define FRAME_RING_VERSION 1
+#define FRAME_RING_ALIGN   64
+#define FRAME_RING_NOPTS   INT64_MIN
+
+typedef struct FrameRingSlotHeader {
+    uint32_t sequence;      /* odd while the pusher writes the slot */
+    uint32_t nb_planes;
+    uint64_t frame_number;  /* 1 for the first frame of the ring */
+    int64_t  pts;           /* microseconds, FRAME_RING_NOPTS when unknown */
+    int32_t  width;
+    int32_t  height;
+    int32_t  format;        /* enum AVPixelFormat */
+    int32_t  linesize[4];
+    uint32_t offset[4];     /* of every plane from the slot data */
+    uint32_t data_size;
+} FrameRingSlotHeader;
+
+typedef struct FrameRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_slots;
+    uint32_t slot_offset;   /* of the first slot header from the start of the object */
+    uint64_t slot_stride;   /* from one slot header to the next */
+    uint64_t slot_data_size;
+    uint64_t latest;        /* frame_number of the newest complete frame, 0 before the first */
+    uint32_t closed;        /* the pusher dropped or replaced the ring */
+    uint32_t reserved;
+} FrameRingHeader;
+
+typedef struct FrameRing {
+    FrameRingHeader *header;
+    size_t size;
+    char name[256];
+    int writer;
+} FrameRing;
+
+/* a frame still in the ring, valid as long as frame_ring_frame_valid() says so */
+typedef struct FrameRingFrame {
+    const uint8_t *data[4];
+    int linesize[4];
+    int width;
+    int height;
+    int format;
+    int64_t pts;
+    uint64_t frame_number;
+
+    const FrameRingSlotHeader *slot;
+    uint32_t sequence;
+} FrameRingFrame;
+
+/* all the functions return 0 or a negative errno value */
+
+int  frame_ring_create(FrameRing *ring, const char *name, int nb_slots, size_t slot_data_size);
+void frame_ring_destroy(FrameRing *ring);
+
+/*
+ * the pusher fills the slot data and the plane and picture fields of the
+ * slot header between both calls, a single thread at a time
+ */
+uint8_t *frame_ring_write_begin(FrameRing *ring, FrameRingSlotHeader **slot);
+void frame_ring_write_end(FrameRing *ring, FrameRingSlotHeader *slot);
+/* gives up the slot, readers never see what was partly written */
+void frame_ring_write_abort(FrameRingSlotHeader *slot);
+
+int  frame_ring_open(FrameRing *ring, const char *name);
+void frame_ring_close(FrameRing *ring);
+
+/* -EAGAIN when there is no complete frame yet, -ESTALE once the ring is closed */
+int  frame_ring_latest(FrameRing *ring, FrameRingFrame *frame);
+int  frame_ring_frame_valid(const FrameRingFrame *frame);
+
+#endif /* FRAME_RING_H */
@@ -0,0 +1,165 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include "packet_queue.h"
+
+int packet_queue_init(PacketQueue *q, int64_t max_bytes, int64_t max_duration)
+{
+    q->fifo = av_fifo_alloc(64 * sizeof(QueuedPacket));
+    if (!q->fifo)
+        return AVERROR(ENOMEM);
+    pthread_mutex_init(&q->lock, NULL);
+    q->max_bytes    = max_bytes;
+    q->max_duration = max_duration;
+    q->last_ts      = AV_NOPTS_VALUE;
+    return 0;
+}
+
+void packet_queue_free(PacketQueue *q)
+{
+    QueuedPacket e;
+
+    if (!q->fifo)
+        return;
+    while (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, &e, sizeof(e), NULL);
+        av_packet_unref(&e.pkt);
+    }
+    av_fifo_freep(&q->fifo);
+    pthread_mutex_destroy(&q->lock);
+}
+
+static int64_t packet_queue_duration(PacketQueue *q)
+{
+    QueuedPacket head;
+
+    if (!q->nb_packets || q->last_ts == AV_NOPTS_VALUE)
+        return 0;
+    av_fifo_generic_peek(q->fifo, &head, sizeof(head), NULL);
+    if (head.ts == AV_NOPTS_VALUE)
+        return 0;
+    return FFMAX(q->last_ts - head.ts, 0);
+}
+
+int packet_queue_put(PacketQueue *q, AVPacket *pkt, struct OutputStream *ost, int64_t ts)
+{
+    QueuedPacket e = { { 0 } };
+    int64_t duration;
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+
+    if (q->aborted || q->finished) {
+        ret = AVERROR_EXIT;
+        goto fail;
+    }
+
+    if (ts != AV_NOPTS_VALUE)
+        q->last_ts = ts;
+    duration = packet_queue_duration(q);
+    if (pkt && q->nb_packets &&
+        (q->bytes + pkt->size > q->max_bytes || duration > q->max_duration)) {
+        q->nb_dropped++;
+        ret = AVERROR(ENOBUFS);
+        goto fail;
+    }
+
+    if (av_fifo_space(q->fifo) < sizeof(e)) {
+        ret = av_fifo_realloc2(q->fifo, 2 * av_fifo_size(q->fifo));
+        if (ret < 0)
+            goto fail;
+    }
+
+    // make sure the data outlives the demuxer's internal buffers, a
+    // refcounted packet is moved into the queue as it is
+    if (pkt) {
+        if (!pkt->buf && (ret = av_packet_make_refcounted(pkt)) < 0)
+            goto fail;
+        av_packet_move_ref(&e.pkt, pkt);
+    }
+    e.detach = !pkt;
+    e.ost = ost;
+    e.ts  = ts;
+    e.put_time = av_gettime_relative();
+    av_fifo_generic_write(q->fifo, &e, sizeof(e), NULL);
+
+    q->nb_packets++;
+    q->bytes += e.pkt.size;
+    q->peak_packets  = FFMAX(q->peak_packets, q->nb_packets);
+    q->peak_bytes    = FFMAX(q->peak_bytes, q->bytes);
+    q->peak_duration = FFMAX(q->peak_duration, duration);
+
+    ret = !q->consumer_active;
+    q->consumer_active = 1;
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+
+fail:
+    pthread_mutex_unlock(&q->lock);
+    if (pkt)
+        av_packet_unref(pkt);
+    return ret;
+}
+
+int packet_queue_get(PacketQueue *q, QueuedPacket *e)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->nb_packets) {
+        av_fifo_generic_read(q->fifo, e, sizeof(*e), NULL);
+        q->nb_packets--;
+        q->bytes -= e->pkt.size;
+    } else if (q->finished) {
+        ret = AVERROR_EOF;
+    } else {
+        q->consumer_active = 0;
+        ret = AVERROR(EAGAIN);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+int packet_queue_finish(PacketQueue *q)
+{
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    ret = !q->consumer_active;
+    q->consumer_active = 1;
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+void packet_queue_abort(PacketQueue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->aborted = 1;
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+/*
+ * bounded queue of refcounted packets between the demuxer and the muxer
+ *
+ * the packets are stored by value in an AVFifoBuffer and handed over with
+ * av_packet_move_ref(), so a refcounted packet goes through the queue
+ * without an allocation once the fifo has grown to the depth the session
+ * needs. tests/packet_queue_test.c counts the allocations.
+ */
+
+#ifndef PACKET_QUEUE_H
+#define PACKET_QUEUE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/fifo.h>
+
+struct OutputStream;
+
+typedef struct QueuedPacket {
+    AVPacket pkt;
+    struct OutputStream *ost;
+    int64_t ts;              /* dts in AV_TIME_BASE units, for the duration limit */
+    int64_t put_time;        /* av_gettime_relative() when it was queued, for the egress latency */
+    int detach;              /* no packet: close the output file of ost, see detach_output_file() */
+} QueuedPacket;
+
+typedef struct PacketQueue {
+    AVFifoBuffer *fifo;
+    pthread_mutex_t lock;
+
+    int64_t max_bytes;
+    int64_t max_duration;    /* in AV_TIME_BASE units */
+
+    int nb_packets;
+    int64_t bytes;
+    int64_t last_ts;
+
+    int finished;            /* no more packets will be put */
+    int aborted;             /* the consumer went away, put discards everything */
+    int consumer_active;     /* the consumer is scheduled or running */
+
+    /* high-water marks and drops, for the stats */
+    int peak_packets;
+    int64_t peak_bytes;
+    int64_t peak_duration;
+    int64_t nb_dropped;
+} PacketQueue;
+
+int  packet_queue_init(PacketQueue *q, int64_t max_bytes, int64_t max_duration);
+void packet_queue_free(PacketQueue *q);
+
+/*
+ * never blocks: when the queue is over its byte or duration budget the packet
+ * is dropped and AVERROR(ENOBUFS) returned. returns 1 when the consumer is
+ * parked and has to be woken up by the caller, 0 otherwise.
+ * the packet reference is taken over in every case.
+ * a NULL pkt queues the detach marker of the output file of ost.
+ */
+int  packet_queue_put(PacketQueue *q, AVPacket *pkt, struct OutputStream *ost, int64_t ts);
+
+/*
+ * returns AVERROR(EAGAIN) when the queue is empty, in which case the consumer
+ * is marked parked until the next put, and AVERROR_EOF once the producer
+ * finished and everything has been consumed.
+ */
+int  packet_queue_get(PacketQueue *q, QueuedPacket *e);
+
+/* returns 1 when the consumer is parked and has to be woken up to see the end */
+int  packet_queue_finish(PacketQueue *q);
+void packet_queue_abort(PacketQueue *q);
+
+#endif /* PACKET_QUEUE_H */
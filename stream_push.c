@@ -24,23 +24,153 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stdatomic.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_SCENE_X86 1
+#else
+#define HAVE_SCENE_X86 0
+#endif
 
 #include <libavcodec/avcodec.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/audio_fifo.h>
+#include <libavutil/channel_layout.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/timestamp.h>
 #include <libavformat/avformat.h>
+#include "libavutil/time.h"
+#include "libavutil/avstring.h"
+#include "libavutil/bprint.h"
+#include "libavutil/cpu.h"
+#include "libavutil/pixdesc.h"
 #include "libavutil/thread.h"
 #include "libavutil/threadmessage.h"
 #include "libavutil/fifo.h"
 #include "libswscale/swscale.h"
+#include "libswresample/swresample.h"
 #include "libavfilter/avfilter.h"
 #include "libavfilter/buffersink.h"
 #include "libavfilter/buffersrc.h"
 
+#include "frame_ring.h"
+#include "packet_queue.h"
+#include "ts_converter.h"
+
 int with_decoding = 1;
 int with_hook_frame = 1;
-int with_encoding = 0;
+int with_encoding = 0;               /* video of the session output, renditions always encode */
+/* copy, auto (aac unless the source already is aac or mp3) or the name of an audio encoder */
+const char *audio_codec = "auto";
+
+/* one snapshot per snapshot_interval of stream time, 0 hooks every decoded frame */
+int64_t snapshot_interval = AV_TIME_BASE;
+int snapshot_align = 0;             /* put the interval boundaries on the wall clock */
+/* snapshot mode: when only the hook needs decoded video, decode keyframes only */
+int keyframe_snapshots = 0;
+/*
+ * a due snapshot is skipped when the luma of the frame differs from the last
+ * snapshot of the stream by less than this on average, 0-255, 0 takes them all
+ */
+double scene_threshold = 0;
+
+int nb_session_workers = 4;         /* size of the worker pool shared by all sessions */
+int nb_mux_workers = 2;             /* size of the pool writing the muxed packets out */
+int max_packets_per_session = 20000;
+int session_time_slice = 32;        /* packets a worker handles before it yields the session */
+int64_t input_timeout = 20 * AV_TIME_BASE;  /* a camera silent for that long ends its session */
+
+int64_t mux_queue_max_bytes    = 4 * 1024 * 1024;
+int64_t mux_queue_max_duration = 5 * AV_TIME_BASE;
+int64_t mux_write_timeout      = 10 * AV_TIME_BASE; /* a write blocked longer than this is aborted */
+
+/*
+ * low latency egress: packets already in dts order skip the interleaving
+ * queue, the muxer waits at most max_interleave_delta for a late stream and
+ * every packet is flushed to the socket as soon as it is muxed
+ */
+int low_latency = 0;
+int64_t max_interleave_delta = -1;  /* -1: the muxer's 10s, or 100ms in low latency mode */
+int flush_packets = -1;             /* -1: only in low latency mode */
+
+/*
+ * the muxer writes into a buffer of output_buffer_size bytes per output,
+ * sent to the connection in one write once it is full or once its oldest
+ * byte waited output_flush_interval
+ */
+int output_buffer_size = 64 * 1024;
+int64_t output_flush_interval = 20000;
+
+/*
+ * gop cache: every input stream keeps references to its packets since the
+ * last video keyframe, an output attached to a running session starts on
+ * them instead of waiting for the next keyframe
+ */
+int gop_cache = 0;
+int64_t gop_cache_max_bytes = 16 * 1024 * 1024;     /* per stream, a longer gop is not cached */
+
+/* unix socket taking commands while the sessions run, see control_command() */
+const char *control_path = NULL;
+
+/*
+ * filters between the decoder of every mapped video stream and what takes
+ * its frames, the snapshot hook and the encoders, e.g. "fps=5,scale=640:-2"
+ */
+const char *video_filters = NULL;
+int filter_threads = 0;             /* slice threads of every filter graph, 0 lets libavfilter pick */
+
+/* fast start: the probed codec parameters of every source are kept in this directory */
+const char *probe_cache_dir = NULL;
+
+/* transcode path: decoded frames are encoded by a pool of its own */
+int nb_encode_workers = 2;
+int64_t encode_queue_max_bytes = 64 * 1024 * 1024;
+int enc_thread_count = 0;           /* threads of every encoder, 0 lets libavcodec pick */
+const char *enc_thread_type = "frame+slice";
+
+/*
+ * extra encoded copies of every session's video, each pushed to the session
+ * output url + "_" + name: "name=720p:size=1280x720:b=2500k", keys other
+ * than name and size are encoder options
+ */
+typedef struct Rendition {
+    const char *name;
+    int width, height;          /* -1 keeps the aspect ratio */
+    AVDictionary *encoder_opts;
+    AVDictionary *opts;         /* holds the strings of the spec */
+} Rendition;
+
+static Rendition *renditions;
+static int nb_renditions;
+
+/*
+ * the input streams pushed to every output, in -map order: an input stream
+ * index, v, a, s or d for the first stream of a type, a:1 for the second
+ * one and a:eng for the first one in a language. a trailing ? lets a source
+ * without such a stream go on without it. the default is v and a?.
+ */
+typedef struct StreamSpec {
+    const char *arg;
+    int index;                  /* -1 to select by type */
+    enum AVMediaType type;
+    int nth;                    /* among the streams of type, and of language if set */
+    char language[8];
+    int optional;
+} StreamSpec;
+
+static StreamSpec *stream_specs;
+static int nb_stream_specs;
 
 
 
@@ -74,6 +204,7 @@ typedef struct InputStream {
     AVCodec *dec;
 
     AVStream *st;
+    TsConverter ts_us;       /* st->time_base to AV_TIME_BASE_Q */
     int64_t       start;     /* time when read started */
     /* predicted dts of the next packet read for this stream or (when there are
      * several frames in a packet) of the next frame in current packet (in AV_TIME_BASE units) */
@@ -104,15 +235,43 @@ typedef struct InputStream {
     int got_output;
     AVFrame* decoded_frame;
 
-    int decoding_needed;
-
-    /* decoded data from this stream goes into all those filters
-     * currently video and audio only */
-
-
+#define DECODING_FOR_OST    1
+#define DECODING_FOR_FILTER 2
+#define DECODING_FOR_HOOK   4
+    int decoding_needed;     /* non zero if the packets must be decoded, DECODING_FOR_* consumers */
+    int discard;             /* nobody consumes the stream, not even a stream copy */
+
+    int keyframes_only;             /* only keyframes are sent to the decoder */
+    int64_t last_snapshot_ts;       /* pts of the last keyframe sent to the decoder, AV_TIME_BASE units */
+    int64_t snapshot_ts_offset;     /* added to pts to place the interval boundaries, AV_NOPTS_VALUE until the first frame */
+    int64_t last_snapshot_slot;     /* interval the last hooked frame fell into */
+
+    AVBufferPool *hook_pool;        /* copies for the hook when a frame is not refcounted */
+    int hook_pool_size;
+    int nb_hooked_frames;
+    int nb_hook_copies;
+
+#define SCENE_SIG_W 64
+#define SCENE_SIG_H 36
+    uint8_t scene_sig[SCENE_SIG_W * SCENE_SIG_H];  /* luma of the last snapshot, see scene_changed() */
+    int has_scene_sig;
+    int nb_scene_skips;
+    int64_t scene_time;             /* wall time spent comparing, in microseconds */
+
+    int nb_decoded_packets;
+    int64_t decode_time;            /* wall time spent decoding, in microseconds */
+
+    AVPacket *gop_cache;            /* demux task only, see gop_cache_add() */
+    int nb_gop_cache;
+    unsigned int gop_cache_alloc;
+    int64_t gop_cache_bytes;
+
+    /* -vf: decoded video goes through this graph before the hook and the encoders */
+    AVFilterGraph *filter_graph;
+    AVFilterContext *filter_in;
+    AVFilterContext *filter_out;
     AVFrame* filter_frame;
-
-
+    int filter_width, filter_height, filter_format;  /* of the frames the graph was built for */
 
 } InputStream;
 
@@ -135,6 +294,12 @@ typedef struct OutputStream {
     AVRational mux_timebase;
     AVRational enc_timebase;
 
+    /* set up once the header is written, see init_ts_converters() */
+    TsConverter ts_from_source;  /* input stream time_base to mux_timebase */
+    TsConverter ts_us_to_mux;
+    TsConverter ts_mux_to_us;
+    TsConverter ts_mux_to_st;    /* mux_timebase to st->time_base, as the muxer chose it */
+
 
     AVCodecContext *enc_ctx;
     AVCodecParameters *ref_par; /* associated input codec parameters with encoders options applied */
@@ -147,1148 +312,5723 @@ typedef struct OutputStream {
     AVDictionary *encoder_opts;
 
     int encoding_needed;
- 
 
+    int waiting_for_keyframe;   /* drop video until the next keyframe, set after a queue overflow */
+    int detached;               /* its output file was detached, nothing is sent to it any more */
 
-} OutputStream;
+    int width, height;          /* of the encoded video, 0 keeps the decoder's, -1 the aspect ratio */
+    struct OutputEncoder *encoder;
 
+    /* only touched by the encode task once the session runs */
+    struct SwsContext *sws;     /* decoded frames in a format the encoder does not take */
+    AVFrame *enc_frame;
+    int64_t last_enc_pts;
+    int64_t nb_encoded_frames;
+    int64_t encode_time;
 
-InputStream **input_streams = NULL;
-OutputStream **output_streams = NULL;
-AVDictionary *format_opts;
-int nb_input_streams = 0;
-int nb_output_streams = 0;
+    /* audio is encoded on the demux task, in frames of the encoder's frame_size */
+    struct SwrContext *swr;
+    AVAudioFifo *audio_fifo;
+    int64_t audio_fifo_pts;     /* of the first sample in audio_fifo, in the encoder time base */
+ 
 
-AVFormatContext *ic; //input format context
-AVFormatContext *oc; //output format context
 
+} OutputStream;
 
-static int open_input_file(char* filename){
-    
-    int err, i, ret;
+#define MAX_OUTPUT_FILES 32      /* at once, a detached file leaves its slot to the next one */
+
+typedef struct OutputFile {
+    AVFormatContext *ctx;
+    int detached;            /* set by the demux task, nothing more is sent to the file */
+    int closed;              /* the mux task wrote the trailer after it was detached */
+    int released;            /* the mux task is past its detach marker, nothing queued refers to it */
+    int reaped;              /* its output streams are freed, the slot takes the next attached file */
+    int64_t nb_packets;
+    int64_t ts_offset;       /* subtracted from every timestamp, AV_TIME_BASE units */
+    int64_t last_dts;        /* of the last packet written, AV_TIME_BASE units */
+    int interleaving;        /* packets may be waiting in the muxer's interleaving queue */
+
+    AVIOContext *io;         /* the connection behind ctx->pb, NULL when the muxer writes to it directly */
+    int64_t pending_since;   /* av_gettime_relative() when the buffer last went from empty to not */
+    int64_t io_open_time;
+    int64_t nb_writes;       /* writes to the connection and their bytes */
+    int64_t write_bytes;
+} OutputFile;
+
+
+// frames waiting for the hook threads or an encoder, bounded in bytes, the
+// oldest frame is dropped when a new one does not fit. the hook threads block
+// in frame_queue_get(), scheduler tasks use frame_queue_try_get() and are
+// woken like the consumers of a PacketQueue
+typedef struct FrameQueue {
+    AVFifoBuffer *fifo;         /* AVFrame pointers */
+    AVFifoBuffer *free_frames;  /* empty AVFrame shells handed back by the consumer */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    int64_t bytes;
+    int64_t max_bytes;
+    int finished;
+    int consumer_active;        /* the consumer task is scheduled or running */
+
+    int64_t nb_frames;
+    int64_t nb_dropped;
+    int64_t peak_bytes;
+} FrameQueue;
+
+#define FRAME_QUEUE_MAX_FREE_FRAMES 16
+
+/* memory pinned by a queued frame, its buffers may be shared with the decoder */
+static int64_t frame_queue_frame_size(const AVFrame *frame)
+{
+    int64_t size = 0;
+    int i;
 
+    for (i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        size += frame->buf[i]->size;
+    return size;
+}
 
+static int frame_queue_init(FrameQueue *q, int64_t max_bytes)
+{
+    q->fifo        = av_fifo_alloc(8 * sizeof(AVFrame*));
+    q->free_frames = av_fifo_alloc(FRAME_QUEUE_MAX_FREE_FRAMES * sizeof(AVFrame*));
+    if (!q->fifo || !q->free_frames) {
+        av_fifo_freep(&q->fifo);
+        av_fifo_freep(&q->free_frames);
+        return AVERROR(ENOMEM);
+    }
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    q->max_bytes = max_bytes;
+    return 0;
+}
 
-    //allocate and init format context
-    ic = avformat_alloc_context();
-    ic->video_codec_id     = AV_CODEC_ID_NONE;
-    ic->audio_codec_id     =  AV_CODEC_ID_NONE;
-    ic->subtitle_codec_id  = AV_CODEC_ID_NONE;
-    ic->data_codec_id      = AV_CODEC_ID_NONE;
-    ic->flags |= AVFMT_FLAG_NONBLOCK;
+static void frame_queue_free(FrameQueue *q)
+{
+    AVFrame *frame;
 
+    if (!q->fifo)
+        return;
+    while (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, &frame, sizeof(frame), NULL);
+        av_frame_free(&frame);
+    }
+    while (av_fifo_size(q->free_frames)) {
+        av_fifo_generic_read(q->free_frames, &frame, sizeof(frame), NULL);
+        av_frame_free(&frame);
+    }
+    av_fifo_freep(&q->fifo);
+    av_fifo_freep(&q->free_frames);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+}
 
+/* an empty frame to put a reference in, recycled when possible */
+static AVFrame *frame_queue_get_shell(FrameQueue *q)
+{
+    AVFrame *frame = NULL;
 
-    //open input file or url
-    av_dict_set(&format_opts, "buffer_size", "1024000", 0);
-    av_dict_set(&format_opts, "stimeout", "20000000", 0);
-    av_dict_set(&format_opts, "max_delay", "500000", 0);
-    av_dict_set(&format_opts, "rtsp_transport", "tcp", 0);
-    err = avformat_open_input(&ic, filename, NULL, &format_opts);
+    pthread_mutex_lock(&q->lock);
+    if (av_fifo_size(q->free_frames))
+        av_fifo_generic_read(q->free_frames, &frame, sizeof(frame), NULL);
+    pthread_mutex_unlock(&q->lock);
 
+    return frame ? frame : av_frame_alloc();
+}
 
-    //retrieve more stream info
-    ret = avformat_find_stream_info(ic, NULL);
+static void frame_queue_recycle(FrameQueue *q, AVFrame *frame)
+{
+    av_frame_unref(frame);
 
+    pthread_mutex_lock(&q->lock);
+    if (av_fifo_space(q->free_frames) >= sizeof(frame)) {
+        av_fifo_generic_write(q->free_frames, &frame, sizeof(frame), NULL);
+        frame = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
 
+    av_frame_free(&frame);
+}
 
+/*
+ * takes over the frame in every case, never blocks. returns 1 when a task
+ * consumer is parked and has to be woken up by the caller.
+ */
+static int frame_queue_put(FrameQueue *q, AVFrame *frame)
+{
+    int64_t size = frame_queue_frame_size(frame);
+    AVFrame *old;
+    int ret = 0;
 
-    for (i = 0; i < ic->nb_streams; i++) {
-        GROW_ARRAY(input_streams, nb_input_streams);
+    pthread_mutex_lock(&q->lock);
 
-        AVStream *st = ic->streams[i];
-        AVCodecParameters *par = st->codecpar;
-        InputStream *ist = av_mallocz(sizeof(*ist));
+    if (q->finished) {
+        ret = AVERROR_EOF;
+        goto fail;
+    }
 
-        input_streams[i] = ist;
-        ist->st = st;        
-        st->discard  = 0;
-        ist->nb_samples = 0;
-        ist->min_pts = INT64_MAX;
-        ist->max_pts = INT64_MIN;
-        ist->next_pts = AV_NOPTS_VALUE;
-        ist->next_dts = AV_NOPTS_VALUE;
-        ist->saw_first_ts=0;
-        ist->decoding_needed = 0;
+    while (av_fifo_size(q->fifo) && q->bytes + size > q->max_bytes) {
+        av_fifo_generic_read(q->fifo, &old, sizeof(old), NULL);
+        q->bytes -= frame_queue_frame_size(old);
+        q->nb_dropped++;
+        av_frame_unref(old);
+        if (av_fifo_space(q->free_frames) >= sizeof(old))
+            av_fifo_generic_write(q->free_frames, &old, sizeof(old), NULL);
+        else
+            av_frame_free(&old);
+    }
 
+    if (av_fifo_space(q->fifo) < sizeof(frame)) {
+        ret = av_fifo_realloc2(q->fifo, 2 * av_fifo_size(q->fifo));
+        if (ret < 0)
+            goto fail;
+    }
+    av_fifo_generic_write(q->fifo, &frame, sizeof(frame), NULL);
+    q->bytes += size;
+    q->peak_bytes = FFMAX(q->peak_bytes, q->bytes);
+    q->nb_frames++;
+
+    ret = !q->consumer_active;
+    q->consumer_active = 1;
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
 
-        ist->dec = avcodec_find_decoder(st->codecpar->codec_id);
-        ist->dec_ctx = avcodec_alloc_context3(ist->dec);
-        ret = avcodec_parameters_to_context(ist->dec_ctx, par);
-        ist->dec_ctx->framerate = st->avg_frame_rate;
-        ret = avcodec_parameters_from_context(par, ist->dec_ctx);
+fail:
+    pthread_mutex_unlock(&q->lock);
+    av_frame_free(&frame);
+    return ret;
+}
 
+/* blocks until a frame is available, AVERROR_EOF once finished and drained */
+static int frame_queue_get(FrameQueue *q, AVFrame **frame)
+{
+    int ret = 0;
 
-        if (with_decoding){
-            AVCodec *codec = ist->dec;
-            
-            ist->dec_ctx->opaque                = ist;
-            ist->dec_ctx->thread_safe_callbacks = 1;
-            ist->dec_ctx->pkt_timebase = ist->st->time_base;
+    pthread_mutex_lock(&q->lock);
+    while (!av_fifo_size(q->fifo) && !q->finished)
+        pthread_cond_wait(&q->cond, &q->lock);
+    if (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, frame, sizeof(*frame), NULL);
+        q->bytes -= frame_queue_frame_size(*frame);
+    } else {
+        ret = AVERROR_EOF;
+    }
+    pthread_mutex_unlock(&q->lock);
 
-            ist->got_output = 0;
+    return ret;
+}
 
-            avcodec_open2(ist->dec_ctx, codec, NULL);
-        }
+/* same as packet_queue_get(): AVERROR(EAGAIN) parks the consumer until the next put */
+static int frame_queue_try_get(FrameQueue *q, AVFrame **frame)
+{
+    int ret = 0;
 
+    pthread_mutex_lock(&q->lock);
+    if (av_fifo_size(q->fifo)) {
+        av_fifo_generic_read(q->fifo, frame, sizeof(*frame), NULL);
+        q->bytes -= frame_queue_frame_size(*frame);
+    } else if (q->finished) {
+        ret = AVERROR_EOF;
+    } else {
+        q->consumer_active = 0;
+        ret = AVERROR(EAGAIN);
     }
+    pthread_mutex_unlock(&q->lock);
+
+    return ret;
+}
+
+/* returns 1 when a task consumer is parked and has to be woken up to see the end */
+static int frame_queue_finish(FrameQueue *q)
+{
+    int ret;
 
-    av_dump_format(ic, 1, filename, 0);
+    pthread_mutex_lock(&q->lock);
+    q->finished = 1;
+    ret = !q->consumer_active;
+    q->consumer_active = 1;
+    pthread_cond_broadcast(&q->cond);
+    pthread_mutex_unlock(&q->lock);
 
     return ret;
+}
 
 
+enum SessionState {
+    SESSION_STATE_OPENING,   /* input/output not opened yet */
+    SESSION_STATE_RUNNING,
+    SESSION_STATE_FINISHED,
+};
+
+#define TASK_PARKED 1        /* returned by SessionTask.run: do not requeue, someone will wake the task */
+
+struct StreamSession;
+
+// one pipeline stage of a session, run on the worker pool of a scheduler
+typedef struct SessionTask {
+    struct StreamSession *session;
+    /* returns 0 to be requeued, TASK_PARKED to wait for a wake up, < 0 when done */
+    int (*run)(struct StreamSession *s, void *opaque);
+    void *opaque;
+    int64_t resume_time;     /* av_gettime() before which the task should not run again */
+    struct SessionTask *next; /* link in the scheduler run queue */
+} SessionTask;
+
+// the encode stage of one encoded output stream: its frame queue and the task draining it
+typedef struct OutputEncoder {
+    SessionTask task;
+    FrameQueue queue;
+    struct OutputStream *ost;   /* NULL until the session is opened */
+} OutputEncoder;
+
+// an output the control thread hands to the demux task of a session
+typedef struct ControlRequest {
+    enum { CONTROL_ATTACH, CONTROL_DETACH } type;
+    char *url;
+    AVIOContext *pb;         /* attach: connected by the control thread already */
+    struct ControlRequest *next;
+} ControlRequest;
+
+// one rtsp source pushed to one rtmp destination, everything that used to be
+// process global lives here so that many sessions can share one process
+typedef struct StreamSession {
+    int index;
+    char *input_url;
+    char *output_url;
+    const char *output_format;
+
+    AVFormatContext *ic; //input format context
+    OutputFile **output_files; /* the output url first, then one per rendition */
+    int nb_output_files;
+    AVDictionary *format_opts;
+
+    InputStream **input_streams;
+    OutputStream **output_streams;
+    int nb_input_streams;
+    int nb_output_streams;
+    int *stream_map;         /* input stream of every output stream of a file, from the -map specs */
+    int nb_stream_map;
+
+    enum SessionState state;
+    int64_t nb_packets;      /* packets read from the input so far */
+    int64_t last_ts;
+    int64_t gop_start_ts;    /* dts of the keyframe the gop cache starts on, AV_NOPTS_VALUE if none */
+
+    /* ingest and egress run as separate tasks connected by mux_queue */
+    SessionTask demux_task;
+    SessionTask mux_task;
+    PacketQueue mux_queue;
+    /* encoded streams get their frames through an encode task each, in parallel */
+    OutputEncoder *encoders;
+    int nb_encoders;
+    int nb_live_tasks;       /* protected by mux_queue.lock, the last task to finish closes the session */
+    int nb_mux_producers;    /* same lock, the demuxer and the encoders still feeding the mux queue */
+    int64_t nb_dropped;      /* packets dropped while waiting for a keyframe after an overflow */
+
+    volatile int abort_request;
+    int64_t io_start_time;   /* av_gettime_relative() when the blocking muxer call started, 0 if none */
+
+    volatile int64_t snapshot_interval;  /* -snapshot_interval at first, the control socket may change it */
+
+    /* outputs to attach or detach, queued by the control thread for the demux task */
+    pthread_mutex_t control_lock;   /* also held while output_files changes, for the stats */
+    struct ControlRequest *requests;
+    int closing;                    /* set with the last drain of requests, none is queued after it */
+    int nb_failed_outputs;          /* given up by the mux task after a write error */
+    int nb_failed_outputs_seen;     /* by the demux task, see detach_failed_outputs() */
+
+    int probe_cache_hit;     /* the input was opened with a minimal probe and the cached parameters */
+    int64_t open_time;       /* av_gettime_relative() when the session started connecting */
+    int64_t first_packet_time;
+    int64_t nb_muxed;        /* from the mux queue to the muxer, and the time it took */
+    int64_t egress_latency;
+    int64_t max_egress_latency;
+
+    /* the input socket the reactor watches while the demux task is parked, -1 if unknown */
+    int input_fd;
+    int reactor_parked;      /* protected by the reactor lock, like the links */
+    int64_t park_time;
+    int64_t last_input_time; /* av_gettime_relative() of the last packet read */
+    int64_t nb_parks;
+    struct StreamSession *reactor_prev, *reactor_next;
+    int input_network_read;  /* set by input_read_interrupt_cb() when a read goes to the socket */
+    int input_held;          /* the last packet came from what libavformat holds, more may follow */
+} StreamSession;
+
+
+// fixed size pool of workers multiplexing one kind of task of all sessions
+typedef struct SessionScheduler {
+    const char *name;
+    pthread_t *workers;
+    int nb_workers;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    SessionTask *run_head;
+    SessionTask *run_tail;
+    int nb_unfinished;      /* tasks queued, running or parked */
+} SessionScheduler;
+
+static SessionScheduler demux_scheduler = { "demux" };
+static SessionScheduler mux_scheduler   = { "mux" };
+static SessionScheduler encode_scheduler = { "encode" };
+
+static void scheduler_enqueue(SessionScheduler *sch, SessionTask *task)
+{
+    task->next = NULL;
+    if (sch->run_tail)
+        sch->run_tail->next = task;
+    else
+        sch->run_head = task;
+    sch->run_tail = task;
+    pthread_cond_signal(&sch->cond);
 }
 
-static int init_output_stream_encode(OutputStream *ost)
+/* hand a parked task back to the workers */
+static void scheduler_wake(SessionScheduler *sch, SessionTask *task)
 {
-    InputStream *ist = input_streams[ost->source_index];
-    AVCodecContext *enc_ctx = ost->enc_ctx;
-    AVCodecContext *dec_ctx = NULL;
-    int j, ret;
+    pthread_mutex_lock(&sch->lock);
+    task->resume_time = 0;
+    scheduler_enqueue(sch, task);
+    pthread_mutex_unlock(&sch->lock);
+}
 
-    // Muxers use AV_PKT_DATA_DISPLAYMATRIX to signal rotation. On the other
-    // hand, the legacy API makes demuxers set "rotate" metadata entries,
-    // which have to be filtered out to prevent leaking them to output files.
-    av_dict_set(&ost->st->metadata, "rotate", NULL, 0);
+/* lets stop on the control socket end a session blocked reading its camera */
+static int input_interrupt_cb(void *ctx)
+{
+    StreamSession *s = ctx;
 
-    if (ist) {
-        ost->st->disposition          = ist->st->disposition;
+    return s->abort_request;
+}
 
-        dec_ctx = ist->dec_ctx;
+/*
+ * the callback of the input itself: every transfer and every wait on the
+ * camera socket goes through it, a read that never calls it was served
+ * from what libavformat already holds
+ */
+static int input_read_interrupt_cb(void *ctx)
+{
+    StreamSession *s = ctx;
 
-        enc_ctx->chroma_sample_location = dec_ctx->chroma_sample_location;
-    } 
+    s->input_network_read = 1;
+    return input_interrupt_cb(ctx);
+}
 
-    if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+static int output_interrupt_cb(void *ctx)
+{
+    StreamSession *s = ctx;
+    int64_t start = s->io_start_time;
 
-        if (ist && !ost->frame_rate.num)
-            ost->frame_rate = ist->framerate;
-        if (ist && !ost->frame_rate.num)
-            ost->frame_rate = ist->st->r_frame_rate;
-        if (ist && !ost->frame_rate.num) {
-            ost->frame_rate = (AVRational){25, 1};
-            av_log(NULL, AV_LOG_WARNING,
-                   "No information "
-                   "about the input framerate is available. Falling "
-                   "back to a default value of 25fps for output stream #%d:%d. Use the -r option "
-                   "if you want a different framerate.\n",
-                   ost->file_index, ost->index);
-        }
-//    
-        // reduce frame rate for mpeg4 to be within the spec limits
-        if (enc_ctx->codec_id == AV_CODEC_ID_MPEG4) {
-            av_reduce(&ost->frame_rate.num, &ost->frame_rate.den,
-                      ost->frame_rate.num, ost->frame_rate.den, 65535);
-        }
-    }
+    if (s->abort_request)
+        return 1;
+    return start && av_gettime_relative() - start > mux_write_timeout;
+}
 
-    switch (enc_ctx->codec_type) {
-    case AVMEDIA_TYPE_AUDIO:
-        if (dec_ctx)
-            enc_ctx->bits_per_raw_sample = FFMIN(dec_ctx->bits_per_raw_sample,
-                                                 av_get_bytes_per_sample(enc_ctx->sample_fmt) << 3);
-        enc_ctx->time_base = av_make_q(1, enc_ctx->sample_rate);
-        break;
 
-    case AVMEDIA_TYPE_VIDEO:
-        enc_ctx->time_base = av_inv_q(ost->frame_rate);
+/*
+ * input reactor: a session that caught up with its camera parks its demux
+ * task instead of blocking a worker in the read, one epoll thread watches
+ * the input sockets of all sessions and hands a task back to the demux
+ * workers once its camera sent something. the rtsp demuxer keeps its
+ * sockets to itself, the one connected to the host of the url is looked up
+ * among the sockets the open of the input created. inputs whose socket is
+ * not found, or not told apart from the one of another session opening the
+ * same camera at the same time, are read the old way.
+ */
+#define REACTOR_RECHECK AV_TIME_BASE   /* a parked task runs at least this often, to see aborts and timeouts */
 
-        enc_ctx->framerate = ost->frame_rate;
+typedef struct InputReactor {
+    int epfd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    StreamSession *parked;      /* linked through reactor_next */
+    int *claimed;               /* sockets taken by a session already */
+    int nb_claimed;
+    volatile int quit;
+} InputReactor;
 
-        ost->st->avg_frame_rate = ost->frame_rate;
+static InputReactor reactor = { .epfd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
 
+static int sockaddr_matches(const struct sockaddr *sa, const struct addrinfo *ai, int port)
+{
+    for (; ai; ai = ai->ai_next) {
+        if (ai->ai_family != sa->sa_family)
+            continue;
+        if (sa->sa_family == AF_INET) {
+            const struct sockaddr_in *a = (const void *)sa, *b = (const void *)ai->ai_addr;
+            if (ntohs(a->sin_port) == port && a->sin_addr.s_addr == b->sin_addr.s_addr)
+                return 1;
+        } else if (sa->sa_family == AF_INET6) {
+            const struct sockaddr_in6 *a = (const void *)sa, *b = (const void *)ai->ai_addr;
+            if (ntohs(a->sin6_port) == port && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)))
+                return 1;
+        }
+    }
+    return 0;
+}
 
-     
-        break;
+/* the sockets of the process by inode, fd numbers are reused as soon as they are closed */
+typedef struct SocketSet {
+    ino_t *inodes;
+    int nb_inodes;
+} SocketSet;
 
-    }
+static void socket_set_scan(SocketSet *set)
+{
+    struct dirent *e;
+    DIR *dir;
 
-    ost->mux_timebase = enc_ctx->time_base;
+    memset(set, 0, sizeof(*set));
+    if (!(dir = opendir("/proc/self/fd")))
+        return;
+    while ((e = readdir(dir))) {
+        struct stat st;
+        int n = atoi(e->d_name);
 
-    return 0;
+        if (n <= 2 || fstat(n, &st) < 0 || !S_ISSOCK(st.st_mode))
+            continue;
+        if (!(set->nb_inodes % 64)) {
+            ino_t *inodes = av_realloc_array(set->inodes, set->nb_inodes + 64, sizeof(*inodes));
+            if (!inodes)
+                break;
+            set->inodes = inodes;
+        }
+        set->inodes[set->nb_inodes++] = st.st_ino;
+    }
+    closedir(dir);
 }
 
-
-static OutputStream *new_output_stream(AVFormatContext *oc, enum AVMediaType type, int source_index)
+static int socket_set_has(const SocketSet *set, ino_t inode)
 {
-    OutputStream *ost;
-    AVStream *st = avformat_new_stream(oc, NULL);
-    int idx      = oc->nb_streams - 1, ret = 0; 
     int i;
 
-    GROW_ARRAY(output_streams, nb_output_streams);
-    ost = av_mallocz(sizeof(*ost));
-    output_streams[nb_output_streams - 1] = ost;
+    for (i = 0; i < set->nb_inodes; i++)
+        if (set->inodes[i] == inode)
+            return 1;
+    return 0;
+}
 
-    ost->file_index = 0;
-    ost->index      = idx;
-    ost->st         = st;
-    st->codecpar->codec_type = type;
-    ost->enc_ctx = avcodec_alloc_context3(ost->enc);
-    ost->enc_ctx->codec_type = type;
-    ost->ref_par = avcodec_parameters_alloc();
-    ost->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+/*
+ * the socket connected to the host and port of the input url that is not in
+ * before, the sockets of the process when the open started. a session
+ * opening the same camera meanwhile may have added one too: with two
+ * candidates neither is taken, the session is polled.
+ */
+static int find_input_socket(StreamSession *s, const SocketSet *before)
+{
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM }, *ai;
+    char proto[32], host[256];
+    struct dirent *e;
+    DIR *dir;
+    int port, fd = -1, nb_found = 0;
+
+    av_url_split(proto, sizeof(proto), NULL, 0, host, sizeof(host), &port, NULL, 0, s->input_url);
+    if (port < 0)
+        port = !strcmp(proto, "rtsp") ? 554 : !strcmp(proto, "rtmp") ? 1935 :
+               !strcmp(proto, "http") ? 80 : -1;
+    if (port < 0 || !host[0] || getaddrinfo(host, NULL, &hints, &ai))
+        return -1;
+    if (!(dir = opendir("/proc/self/fd"))) {
+        freeaddrinfo(ai);
+        return -1;
+    }
 
-    ost->source_index = source_index;
+    while ((e = readdir(dir))) {
+        struct sockaddr_storage peer;
+        socklen_t len = sizeof(peer);
+        struct stat st;
+        int n = atoi(e->d_name);
 
-    ost->last_mux_dts = AV_NOPTS_VALUE;
+        if (n <= 2 || fstat(n, &st) < 0 || !S_ISSOCK(st.st_mode) ||
+            socket_set_has(before, st.st_ino) ||
+            getpeername(n, (struct sockaddr *)&peer, &len) < 0 ||
+            !sockaddr_matches((struct sockaddr *)&peer, ai, port))
+            continue;
+        fd = n;
+        nb_found++;
+    }
 
-    ost->enc_ctx->codec_type = type;
+    closedir(dir);
+    freeaddrinfo(ai);
+    if (nb_found > 1)
+        av_log(NULL, AV_LOG_VERBOSE, "[session %d] %d new sockets to %s:%d, another session opened it too\n",
+               s->index, nb_found, host, port);
+    return nb_found == 1 ? fd : -1;
+}
 
-    ost->encoding_needed = 0;
+/*
+ * called right after avformat_open_input(), before the first packet is read.
+ * the name lookup and the scan happen outside the reactor lock, parking and
+ * waking other sessions does not wait for them.
+ */
+static void reactor_add(StreamSession *s, const SocketSet *before)
+{
+    struct epoll_event ev = { 0, { .ptr = s } };
+    int *claimed, i, fd;
+
+    if (reactor.epfd < 0)
+        return;
+
+    fd = find_input_socket(s, before);
+    if (fd >= 0) {
+        pthread_mutex_lock(&reactor.lock);
+        for (i = 0; i < reactor.nb_claimed && reactor.claimed[i] != fd; i++)
+            ;
+        claimed = i < reactor.nb_claimed ? NULL :
+                  av_realloc_array(reactor.claimed, reactor.nb_claimed + 1, sizeof(*claimed));
+        if (claimed)
+            reactor.claimed = claimed;
+        // armed by reactor_park(), one event at a time
+        if (claimed && !epoll_ctl(reactor.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+            claimed[reactor.nb_claimed++] = fd;
+            s->input_fd = fd;
+        }
+        pthread_mutex_unlock(&reactor.lock);
+    }
 
+    if (s->input_fd >= 0)
+        av_log(NULL, AV_LOG_VERBOSE, "[session %d] the reactor watches socket %d of %s\n",
+               s->index, s->input_fd, s->input_url);
+    else
+        av_log(NULL, AV_LOG_VERBOSE, "[session %d] no socket found for %s, it is polled\n",
+               s->index, s->input_url);
+}
 
+static void reactor_unlink(StreamSession *s)
+{
+    if (s->reactor_prev)
+        s->reactor_prev->reactor_next = s->reactor_next;
+    else
+        reactor.parked = s->reactor_next;
+    if (s->reactor_next)
+        s->reactor_next->reactor_prev = s->reactor_prev;
+    s->reactor_prev = s->reactor_next = NULL;
+    s->reactor_parked = 0;
+}
 
+/* before the demuxer closes the socket, a number the next connection may get again */
+static void reactor_remove(StreamSession *s)
+{
+    int i;
 
+    if (s->input_fd < 0)
+        return;
 
-    if(with_encoding){
+    pthread_mutex_lock(&reactor.lock);
+    if (s->reactor_parked)
+        reactor_unlink(s);
+    epoll_ctl(reactor.epfd, EPOLL_CTL_DEL, s->input_fd, NULL);
+    for (i = 0; i < reactor.nb_claimed; i++) {
+        if (reactor.claimed[i] == s->input_fd) {
+            reactor.claimed[i] = reactor.claimed[--reactor.nb_claimed];
+            break;
+        }
+    }
+    s->input_fd = -1;
+    pthread_mutex_unlock(&reactor.lock);
+}
 
-        ost->encoding_needed = 1;
+/*
+ * the demux task returns TASK_PARKED right after this, without touching the
+ * session any more: the reactor may hand it to another worker before it did
+ */
+static void reactor_park(StreamSession *s)
+{
+    struct epoll_event ev = { EPOLLIN | EPOLLONESHOT, { .ptr = s } };
+
+    pthread_mutex_lock(&reactor.lock);
+    s->reactor_parked = 1;
+    s->park_time      = av_gettime_relative();
+    s->nb_parks++;
+    s->reactor_prev   = NULL;
+    s->reactor_next   = reactor.parked;
+    if (reactor.parked)
+        reactor.parked->reactor_prev = s;
+    reactor.parked = s;
+    epoll_ctl(reactor.epfd, EPOLL_CTL_MOD, s->input_fd, &ev);
+    pthread_mutex_unlock(&reactor.lock);
+}
 
-        ost->st->codecpar->codec_id = av_guess_codec(oc->oformat, NULL, oc->url,
-                                                         NULL, ost->st->codecpar->codec_type);
-        ost->enc = avcodec_find_encoder(ost->st->codecpar->codec_id);
+/* whether a read would find something, errors and hangups are for the demuxer to report */
+static int input_readable(StreamSession *s)
+{
+    struct pollfd p = { s->input_fd, POLLIN };
 
+    return poll(&p, 1, 0) != 0;
+}
 
-        AVCodec      *codec = ost->enc;
-        AVCodecContext *dec = NULL;
-        InputStream *ist;
+/*
+ * whether libavformat may still have packets without reading the socket:
+ * the stream info read-ahead, the rest of an rtp packet, the avio buffer
+ * of http and rtmp inputs
+ */
+static int input_buffered(StreamSession *s)
+{
+    AVIOContext *pb = s->ic->pb;
 
-        ret = init_output_stream_encode(ost);
-        if (ret < 0)
-            return ret;
+    return s->input_held || (pb && pb->buf_ptr < pb->buf_end);
+}
 
-        ist = input_streams[ost->source_index];
+static void *reactor_thread_proc(void *arg)
+{
+    struct epoll_event events[64];
+    int64_t last_check = av_gettime_relative();
 
-        if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
-            !codec->defaults &&
-            !av_dict_get(ost->encoder_opts, "b", NULL, 0) &&
-            !av_dict_get(ost->encoder_opts, "ab", NULL, 0))
-            av_dict_set(&ost->encoder_opts, "b", "128000", 0);
+    while (!reactor.quit) {
+        int i, n = epoll_wait(reactor.epfd, events, FF_ARRAY_ELEMS(events), 100);
+        int64_t now = av_gettime_relative();
 
-        // if(ost->enc->type == AVMEDIA_TYPE_VIDEO){
-        //     enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
-        // }
-
-
-
-        ret = avcodec_open2(ost->enc_ctx, codec, &ost->encoder_opts) ;
-        ret = avcodec_parameters_from_context(ost->st->codecpar, ost->enc_ctx);
-        ret = avcodec_copy_context(ost->st->codec, ost->enc_ctx);
-    
-
-
-        // copy timebase while removing common factors
-        if (ost->st->time_base.num <= 0 || ost->st->time_base.den <= 0)
-            ost->st->time_base = av_add_q(ost->enc_ctx->time_base, (AVRational){0, 1});
-
-        // copy estimated duration as a hint to the muxer
-        if (ost->st->duration <= 0 && ist && ist->st->duration > 0)
-            ost->st->duration = av_rescale_q(ist->st->duration, ist->st->time_base, ost->st->time_base);
+        pthread_mutex_lock(&reactor.lock);
+        // an event may be for a session that was removed since, it is not parked then
+        for (i = 0; i < n; i++) {
+            StreamSession *s = events[i].data.ptr;
 
-        ost->st->codec->codec= ost->enc_ctx->codec;
+            if (s->reactor_parked) {
+                reactor_unlink(s);
+                scheduler_wake(&demux_scheduler, &s->demux_task);
+            }
+        }
+        if (now - last_check >= REACTOR_RECHECK / 4) {
+            StreamSession *s, *next;
+
+            for (s = reactor.parked; s; s = next) {
+                next = s->reactor_next;
+                if (s->abort_request || now - s->park_time >= REACTOR_RECHECK) {
+                    reactor_unlink(s);
+                    scheduler_wake(&demux_scheduler, &s->demux_task);
+                }
+            }
+            last_check = now;
+        }
+        pthread_mutex_unlock(&reactor.lock);
     }
 
-    return ost;
+    return NULL;
 }
 
+static int reactor_start(void)
+{
+    int ret;
 
-
-
-
-
-
-static int open_output_file(const char *filename,const char* format){
-
-    int i, j, err;
-   
-    InputStream  *ist;
-
-
-    int format_flags = 0;
-    err = avformat_alloc_output_context2(&oc, NULL, format, filename);
-
-    OutputStream *ost;
-    AVCodecContext *enc;
-
-    ost = new_output_stream(oc, AVMEDIA_TYPE_VIDEO, 0);
-
-
-   
-
-    ost = new_output_stream(oc, AVMEDIA_TYPE_AUDIO, 1);
-
-
-
-
-    avio_open2(&oc->pb, filename, AVIO_FLAG_WRITE,NULL,
-                              NULL);
-   
-
+    reactor.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor.epfd < 0)
+        return AVERROR(errno);
+    if ((ret = pthread_create(&reactor.thread, NULL, reactor_thread_proc, NULL))) {
+        close(reactor.epfd);
+        reactor.epfd = -1;
+        return AVERROR(ret);
+    }
     return 0;
 }
 
-
-static void write_packet(AVPacket *pkt, OutputStream *ost, int unqueue)
+/* once the demux workers are gone, nothing is parked any more */
+static void reactor_stop(void)
 {
-    AVFormatContext *s = oc;
-    AVStream *st = ost->st;
-    int ret;
-    av_packet_rescale_ts(pkt, ost->mux_timebase, ost->st->time_base);
-   
-    ost->last_mux_dts = pkt->dts;
+    if (reactor.epfd < 0)
+        return;
+    reactor.quit = 1;
+    pthread_join(reactor.thread, NULL);
+    close(reactor.epfd);
+    reactor.epfd = -1;
+    av_freep(&reactor.claimed);
+    reactor.nb_claimed = 0;
+}
 
-    pkt->stream_index = ost->index;
 
+/*
+ * probe cache: what a full avformat_find_stream_info() found out about a
+ * source, codec parameters and extradata, so that the next connect to the
+ * same url only has to read the first packet. one file per url, written
+ * next to the old one and renamed over it.
+ */
+#define PROBE_CACHE_MAGIC   MKTAG('S', 'P', 'P', 'C')
+#define PROBE_CACHE_VERSION 1
+#define PROBE_CACHE_MAX_STREAMS 64
+
+typedef struct ProbeCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nb_streams;
+    uint32_t url_size;          /* the url follows, then every stream with its extradata */
+} ProbeCacheHeader;
+
+typedef struct ProbeCacheStream {
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t format;
+    int32_t profile;
+    int32_t level;
+    int32_t width, height;
+    AVRational sample_aspect_ratio;
+    int32_t field_order;
+    int32_t color_range, color_primaries, color_trc, color_space, chroma_location;
+    int32_t video_delay;
+    uint64_t channel_layout;
+    int32_t channels;
+    int32_t sample_rate;
+    int32_t frame_size;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    AVRational avg_frame_rate;
+    AVRational r_frame_rate;
+    int32_t extradata_size;
+} ProbeCacheStream;
+
+typedef struct ProbeCache {
+    ProbeCacheStream *streams;
+    uint8_t **extradata;
+    int nb_streams;
+} ProbeCache;
+
+static void probe_cache_path(char *buf, int size, const char *url)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;     // fnv-1a, the url itself is checked on load
 
-    av_log(NULL,AV_LOG_INFO,"dts:%d,pts:%d\n",pkt->dts,pkt->pts);
+    for (; *url; url++)
+        h = (h ^ (uint8_t)*url) * 0x100000001b3ULL;
+    snprintf(buf, size, "%s/%016"PRIx64".probe", probe_cache_dir, h);
+}
 
+static void probe_cache_free(ProbeCache *c)
+{
+    int i;
 
-    ret = av_interleaved_write_frame(s, pkt);
- 
-    av_packet_unref(pkt);
+    for (i = 0; i < c->nb_streams && c->extradata; i++)
+        av_freep(&c->extradata[i]);
+    av_freep(&c->extradata);
+    av_freep(&c->streams);
+    c->nb_streams = 0;
 }
 
-
-static void do_streamcopy(InputStream *ist, OutputStream *ost, const AVPacket *pkt)
+static int probe_cache_load(ProbeCache *c, const char *url)
 {
-
-    AVPacket opkt = { 0 };
-    av_init_packet(&opkt);
-    if (pkt->pts != AV_NOPTS_VALUE)
-        opkt.pts = av_rescale_q(pkt->pts, ist->st->time_base, ost->mux_timebase);
-    else
-        opkt.pts = AV_NOPTS_VALUE;
-    if (pkt->dts == AV_NOPTS_VALUE)
-        opkt.dts = av_rescale_q(ist->dts, AV_TIME_BASE_Q, ost->mux_timebase);
-    else
-        opkt.dts = av_rescale_q(pkt->dts, ist->st->time_base, ost->mux_timebase);
-    opkt.duration = av_rescale_q(pkt->duration, ist->st->time_base, ost->mux_timebase);
-    opkt.flags    = pkt->flags;
-    if (pkt->buf) {
-        opkt.buf = av_buffer_ref(pkt->buf);
+    char path[1024];
+    ProbeCacheHeader h;
+    char *cached_url = NULL;
+    FILE *f;
+    int i, ret = AVERROR_INVALIDDATA;
+
+    memset(c, 0, sizeof(*c));
+    probe_cache_path(path, sizeof(path), url);
+    f = fopen(path, "rb");
+    if (!f)
+        return AVERROR(ENOENT);
+
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != PROBE_CACHE_MAGIC ||
+        h.version != PROBE_CACHE_VERSION || !h.nb_streams || h.nb_streams > PROBE_CACHE_MAX_STREAMS ||
+        h.url_size != strlen(url))
+        goto end;
+    if (!(cached_url = av_malloc(h.url_size))) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    if (fread(cached_url, 1, h.url_size, f) != h.url_size || memcmp(cached_url, url, h.url_size))
+        goto end;
+
+    c->streams   = av_mallocz_array(h.nb_streams, sizeof(*c->streams));
+    c->extradata = av_mallocz_array(h.nb_streams, sizeof(*c->extradata));
+    if (!c->streams || !c->extradata) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    c->nb_streams = h.nb_streams;
+    for (i = 0; i < c->nb_streams; i++) {
+        ProbeCacheStream *cs = &c->streams[i];
+
+        if (fread(cs, sizeof(*cs), 1, f) != 1 ||
+            cs->extradata_size < 0 || cs->extradata_size > 1 << 20)
+            goto end;
+        if (!cs->extradata_size)
+            continue;
+        if (!(c->extradata[i] = av_mallocz(cs->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE))) {
+            ret = AVERROR(ENOMEM);
+            goto end;
+        }
+        if (fread(c->extradata[i], 1, cs->extradata_size, f) != cs->extradata_size)
+            goto end;
     }
-    opkt.data = pkt->data;
-    opkt.size = pkt->size;
-    av_copy_packet_side_data(&opkt, pkt);
-    write_packet(&opkt, ost, 0);
+    ret = 0;
 
+end:
+    fclose(f);
+    av_free(cached_url);
+    if (ret < 0)
+        probe_cache_free(c);
+    return ret;
 }
 
-static int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt)
+static int probe_cache_save(StreamSession *s)
 {
-    int ret;
-
-    *got_frame = 0;
-
-    if (pkt) {
-        ret = avcodec_send_packet(avctx, pkt);
-        // In particular, we don't expect AVERROR(EAGAIN), because we read all
-        // decoded frames with avcodec_receive_frame() until done.
-        if (ret < 0 && ret != AVERROR_EOF)
-            return ret;
+    AVFormatContext *ic = s->ic;
+    ProbeCacheHeader h = { PROBE_CACHE_MAGIC, PROBE_CACHE_VERSION, ic->nb_streams, strlen(s->input_url) };
+    char path[1024], tmp[1100];
+    FILE *f;
+    int i, ok;
+
+    probe_cache_path(path, sizeof(path), s->input_url);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, s->index);
+    f = fopen(tmp, "wb");
+    if (!f)
+        return AVERROR(errno);
+
+    ok = fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(s->input_url, 1, h.url_size, f) == h.url_size;
+    for (i = 0; ok && i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        AVCodecParameters *par = st->codecpar;
+        ProbeCacheStream cs;
+
+        memset(&cs, 0, sizeof(cs));
+        cs.codec_type            = par->codec_type;
+        cs.codec_id              = par->codec_id;
+        cs.codec_tag             = par->codec_tag;
+        cs.format                = par->format;
+        cs.profile               = par->profile;
+        cs.level                 = par->level;
+        cs.width                 = par->width;
+        cs.height                = par->height;
+        cs.sample_aspect_ratio   = par->sample_aspect_ratio;
+        cs.field_order           = par->field_order;
+        cs.color_range           = par->color_range;
+        cs.color_primaries       = par->color_primaries;
+        cs.color_trc             = par->color_trc;
+        cs.color_space           = par->color_space;
+        cs.chroma_location       = par->chroma_location;
+        cs.video_delay           = par->video_delay;
+        cs.channel_layout        = par->channel_layout;
+        cs.channels              = par->channels;
+        cs.sample_rate           = par->sample_rate;
+        cs.frame_size            = par->frame_size;
+        cs.bits_per_coded_sample = par->bits_per_coded_sample;
+        cs.bits_per_raw_sample   = par->bits_per_raw_sample;
+        cs.avg_frame_rate        = st->avg_frame_rate;
+        cs.r_frame_rate          = st->r_frame_rate;
+        cs.extradata_size        = par->extradata_size;
+
+        ok = fwrite(&cs, sizeof(cs), 1, f) == 1 &&
+             fwrite(par->extradata, 1, par->extradata_size, f) == par->extradata_size;
     }
 
-    ret = avcodec_receive_frame(avctx, frame);
-    if (ret < 0 && ret != AVERROR(EAGAIN))
-        return ret;
-    if (ret >= 0)
-        *got_frame = 1;
-
+    if (fclose(f) || !ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return AVERROR(EIO);
+    }
     return 0;
 }
 
-
-
-#pragma pack(push, 1)
-
-typedef unsigned char  U8;
-typedef unsigned short U16;
-typedef unsigned int   U32;
-
-typedef struct tagBITMAPFILEHEADER
+/* whether a stream is known well enough to be decoded, copied and cached */
+static int probe_par_complete(const AVCodecParameters *par)
 {
+    return par->codec_id != AV_CODEC_ID_NONE &&
+           (par->codec_type != AVMEDIA_TYPE_VIDEO || (par->width && par->format >= 0)) &&
+           (par->codec_type != AVMEDIA_TYPE_AUDIO || (par->sample_rate && par->channels));
+}
 
- U16 bfType;
- U32 bfSize;
- U16 bfReserved1;
- U16 bfReserved2;
- U32 bfOffBits;
-} BITMAPFILEHEADER;
-
-typedef struct tagBITMAPINFOHEADER
+static int probe_complete(AVFormatContext *ic)
 {
- U32 biSize;
- U32 biWidth;
- U32 biHeight;
- U16 biPlanes;
- U16 biBitCount;
- U32 biCompression;
- U32 biSizeImage;
- U32 biXPelsPerMeter;
- U32 biYPelsPerMeter;
- U32 biClrUsed;
- U32 biClrImportant;
-} BITMAPINFOHEADER;
+    int i;
 
-typedef struct tagRGBQUAD
-{
- U8 rgbBlue;
- U8 rgbGreen;
- U8 rgbRed;
- U8 rgbReserved;
-} RGBQUAD;
+    for (i = 0; i < ic->nb_streams; i++)
+        if (!probe_par_complete(ic->streams[i]->codecpar))
+            return 0;
+    return ic->nb_streams > 0;
+}
 
-typedef struct tagBITMAPINFO
+/*
+ * fill in what a minimal probe left out. returns 0 without touching anything
+ * when the source no longer looks like the cached one, or the cache would
+ * still leave a stream incomplete, 1 once it is filled.
+ */
+static int probe_cache_apply(const ProbeCache *c, AVFormatContext *ic)
 {
- BITMAPINFOHEADER bmiHeader;
- RGBQUAD bmiColors[1];
-} BITMAPINFO;
+    AVCodecParameters *pars[PROBE_CACHE_MAX_STREAMS] = { NULL };
+    int i, ret = 0;
 
+    if (c->nb_streams != ic->nb_streams)
+        return 0;
 
-typedef struct tagBITMAP
-{
- BITMAPFILEHEADER bfHeader;
- BITMAPINFO biInfo;
-}BITMAPFILE;
+    for (i = 0; i < c->nb_streams; i++) {
+        const ProbeCacheStream *cs = &c->streams[i];
+        AVCodecParameters *par = ic->streams[i]->codecpar;
+
+        if (cs->codec_type != par->codec_type || cs->codec_id != par->codec_id)
+            return 0;
+        // a reconfigured camera announces other parameter sets in its sdp
+        if (par->extradata_size && (par->extradata_size != cs->extradata_size ||
+                                    memcmp(par->extradata, c->extradata[i], par->extradata_size)))
+            return 0;
+        if ((par->width && (par->width != cs->width || par->height != cs->height)) ||
+            (par->sample_rate && par->sample_rate != cs->sample_rate) ||
+            (par->channels && par->channels != cs->channels))
+            return 0;
+    }
 
-#pragma pack(pop)
+    // filled in on copies, the streams only get them once all of them are complete
+#define PROBE_CACHE_FILL(field, unset) if (par->field == (unset)) par->field = cs->field
+    for (i = 0; i < c->nb_streams; i++) {
+        const ProbeCacheStream *cs = &c->streams[i];
+        AVCodecParameters *par;
 
+        if (!(pars[i] = avcodec_parameters_alloc()) ||
+            (ret = avcodec_parameters_copy(pars[i], ic->streams[i]->codecpar)) < 0) {
+            ret = ret < 0 ? ret : AVERROR(ENOMEM);
+            goto end;
+        }
+        par = pars[i];
 
+        if (!par->extradata_size && cs->extradata_size) {
+            par->extradata = av_mallocz(cs->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+            if (!par->extradata) {
+                ret = AVERROR(ENOMEM);
+                goto end;
+            }
+            memcpy(par->extradata, c->extradata[i], cs->extradata_size);
+            par->extradata_size = cs->extradata_size;
+        }
+        PROBE_CACHE_FILL(codec_tag, 0);
+        PROBE_CACHE_FILL(format, -1);
+        PROBE_CACHE_FILL(profile, FF_PROFILE_UNKNOWN);
+        PROBE_CACHE_FILL(level, FF_LEVEL_UNKNOWN);
+        PROBE_CACHE_FILL(width, 0);
+        PROBE_CACHE_FILL(height, 0);
+        PROBE_CACHE_FILL(sample_aspect_ratio.num, 0);
+        PROBE_CACHE_FILL(sample_aspect_ratio.den, 1);
+        PROBE_CACHE_FILL(field_order, AV_FIELD_UNKNOWN);
+        PROBE_CACHE_FILL(color_range, AVCOL_RANGE_UNSPECIFIED);
+        PROBE_CACHE_FILL(color_primaries, AVCOL_PRI_UNSPECIFIED);
+        PROBE_CACHE_FILL(color_trc, AVCOL_TRC_UNSPECIFIED);
+        PROBE_CACHE_FILL(color_space, AVCOL_SPC_UNSPECIFIED);
+        PROBE_CACHE_FILL(chroma_location, AVCHROMA_LOC_UNSPECIFIED);
+        PROBE_CACHE_FILL(video_delay, 0);
+        PROBE_CACHE_FILL(channel_layout, 0);
+        PROBE_CACHE_FILL(channels, 0);
+        PROBE_CACHE_FILL(sample_rate, 0);
+        PROBE_CACHE_FILL(frame_size, 0);
+        PROBE_CACHE_FILL(bits_per_coded_sample, 0);
+        PROBE_CACHE_FILL(bits_per_raw_sample, 0);
+        if (!probe_par_complete(par))
+            goto end;
+    }
+#undef PROBE_CACHE_FILL
 
-//Éú³ÉBMPÍ¼Æ¬(ÎÞÑÕÉ«±íµÄÎ»Í¼):ÔÚRGB(A)Î»Í¼Êý¾ÝµÄ»ù´¡ÉÏ¼ÓÉÏÎÄ¼þÐÅÏ¢Í·ºÍÎ»Í¼ÐÅÏ¢Í·  
-static int GenBmpFile(U8 *pData, U8 bitCountPerPix, U32 width, U32 height, const char *filename)
-{
-    FILE *fp = fopen(filename, "wb");
-    if(!fp)
-    {
-        printf("fopen failed : %s, %d\n", __FILE__, __LINE__);
-        return 0;
+    for (i = 0; i < c->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+
+        FFSWAP(AVCodecParameters *, st->codecpar, pars[i]);
+        if (!st->avg_frame_rate.num)
+            st->avg_frame_rate = c->streams[i].avg_frame_rate;
+        if (!st->r_frame_rate.num)
+            st->r_frame_rate = c->streams[i].r_frame_rate;
     }
+    ret = 1;
 
-    U32 bmppitch = ((width*bitCountPerPix + 31) >> 5) << 2;
-    U32 filesize = bmppitch*height;
-
-    BITMAPFILE bmpfile;
-
-    bmpfile.bfHeader.bfType = 0x4D42;
-    bmpfile.bfHeader.bfSize = filesize + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-    bmpfile.bfHeader.bfReserved1 = 0;
-    bmpfile.bfHeader.bfReserved2 = 0;
-    bmpfile.bfHeader.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER);
-
-    bmpfile.biInfo.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-    bmpfile.biInfo.bmiHeader.biWidth = width;
-    bmpfile.biInfo.bmiHeader.biHeight = height;
-    bmpfile.biInfo.bmiHeader.biPlanes = 1;
-    bmpfile.biInfo.bmiHeader.biBitCount = bitCountPerPix;
-    bmpfile.biInfo.bmiHeader.biCompression = 0;
-    bmpfile.biInfo.bmiHeader.biSizeImage = 0;
-    bmpfile.biInfo.bmiHeader.biXPelsPerMeter = 0;
-    bmpfile.biInfo.bmiHeader.biYPelsPerMeter = 0;
-    bmpfile.biInfo.bmiHeader.biClrUsed = 0;
-    bmpfile.biInfo.bmiHeader.biClrImportant = 0;
-
-    fwrite(&(bmpfile.bfHeader), sizeof(BITMAPFILEHEADER), 1, fp);
-    fwrite(&(bmpfile.biInfo.bmiHeader), sizeof(BITMAPINFOHEADER), 1, fp);
-
-    U8 *pEachLinBuf = (U8*)malloc(bmppitch);
-    memset(pEachLinBuf, 0, bmppitch);
-    U8 BytePerPix = bitCountPerPix >> 3;
-    U32 pitch = width * BytePerPix;
-    if(pEachLinBuf)
-    {
-        int h,w;
-        for(h = height-1; h >= 0; h--)
-        {
-            for(w = 0; w < width; w++)
-            {
-                //copy by a pixel  
-                pEachLinBuf[w*BytePerPix+0] = pData[h*pitch + w*BytePerPix + 0];
-                pEachLinBuf[w*BytePerPix+1] = pData[h*pitch + w*BytePerPix + 1];
-                pEachLinBuf[w*BytePerPix+2] = pData[h*pitch + w*BytePerPix + 2];
-            }
-            fwrite(pEachLinBuf, bmppitch, 1, fp);
+end:
+    for (i = 0; i < c->nb_streams; i++)
+        avcodec_parameters_free(&pars[i]);
+    return ret;
+}
 
+static int open_input_file(StreamSession *s){
 
-        }
-        free(pEachLinBuf);
-    }
+    int err, i, ret;
+    AVFormatContext *ic;
+    SocketSet sockets = { NULL, 0 };
 
-    fclose(fp);
 
-    return 1;
-}
 
-//»ñÈ¡BMPÎÄ¼þµÄÎ»Í¼Êý¾Ý(ÎÞÑÕÉ«±íµÄÎ»Í¼):¶ªµôBMPÎÄ¼þµÄÎÄ¼þÐÅÏ¢Í·ºÍÎ»Í¼ÐÅÏ¢Í·£¬»ñÈ¡ÆäRGB(A)Î»Í¼Êý¾Ý  
-static U8* GetBmpData(U8 *bitCountPerPix, U32 *width, U32 *height, const char* filename)
-{
-    FILE *pf = fopen(filename, "rb");
-    if(!pf)
-    {
-        printf("fopen failed : %s, %d\n", __FILE__, __LINE__);
-        return NULL;
-    }
+    //allocate and init format context
+    ic = avformat_alloc_context();
+    if (!ic)
+        return AVERROR(ENOMEM);
+    ic->video_codec_id     = AV_CODEC_ID_NONE;
+    ic->audio_codec_id     =  AV_CODEC_ID_NONE;
+    ic->subtitle_codec_id  = AV_CODEC_ID_NONE;
+    ic->data_codec_id      = AV_CODEC_ID_NONE;
+    ic->flags |= AVFMT_FLAG_NONBLOCK;
+    ic->interrupt_callback.callback = input_read_interrupt_cb;
+    ic->interrupt_callback.opaque   = s;
 
-    BITMAPFILE bmpfile;
-    fread(&(bmpfile.bfHeader), sizeof(BITMAPFILEHEADER), 1, pf);
-    fread(&(bmpfile.biInfo.bmiHeader), sizeof(BITMAPINFOHEADER), 1, pf);
 
 
-    if(bitCountPerPix)
-    {
-        *bitCountPerPix = bmpfile.biInfo.bmiHeader.biBitCount;
-    }
-    if(width)
-    {
-        *width = bmpfile.biInfo.bmiHeader.biWidth;
-    }
-    if(height)
-    {
-        *height = bmpfile.biInfo.bmiHeader.biHeight;
+    //open input file or url
+    av_dict_set(&s->format_opts, "buffer_size", "1024000", 0);
+    av_dict_set_int(&s->format_opts, "stimeout", input_timeout, 0);
+    av_dict_set(&s->format_opts, "max_delay", "500000", 0);
+    av_dict_set(&s->format_opts, "rtsp_transport", "tcp", 0);
+    if (reactor.epfd >= 0)
+        socket_set_scan(&sockets);
+    err = avformat_open_input(&ic, s->input_url, NULL, &s->format_opts);
+    av_dict_free(&s->format_opts);
+    if (err < 0) {
+        av_freep(&sockets.inodes);
+        av_log(NULL, AV_LOG_ERROR, "[session %d] could not open %s: %s\n",
+               s->index, s->input_url, av_err2str(err));
+        return err;
     }
+    s->ic = ic;
+    reactor_add(s, &sockets);
+    av_freep(&sockets.inodes);
 
-    U32 bmppicth = (((*width)*(*bitCountPerPix) + 31) >> 5) << 2;
-    U8 *pdata = (U8*)malloc((*height)*bmppicth);
-
-    U8 *pEachLinBuf = (U8*)malloc(bmppicth);
-    memset(pEachLinBuf, 0, bmppicth);
-    U8 BytePerPix = (*bitCountPerPix) >> 3;
-    U32 pitch = (*width) * BytePerPix;
 
-    if(pdata && pEachLinBuf)
-    {
-        int w, h;
-        for(h = (*height) - 1; h >= 0; h--)
-        {
-            fread(pEachLinBuf, bmppicth, 1, pf);
-            for(w = 0; w < (*width); w++)
-            {
-                pdata[h*pitch + w*BytePerPix + 0] = pEachLinBuf[w*BytePerPix+0];
-                pdata[h*pitch + w*BytePerPix + 1] = pEachLinBuf[w*BytePerPix+1];
-                pdata[h*pitch + w*BytePerPix + 2] = pEachLinBuf[w*BytePerPix+2];
+    //retrieve more stream info
+    if (probe_cache_dir) {
+        ProbeCache cache;
+
+        if (probe_cache_load(&cache, s->input_url) >= 0) {
+            int64_t probesize            = ic->probesize;
+            int64_t max_analyze_duration = ic->max_analyze_duration;
+
+            // the streams are known already, read just enough to start
+            ic->probesize            = 32;
+            ic->max_analyze_duration = 1;
+            ret = avformat_find_stream_info(ic, NULL);
+            if (ret >= 0)
+                ret = probe_cache_apply(&cache, ic);
+            s->probe_cache_hit = ret > 0;
+            probe_cache_free(&cache);
+
+            if (!s->probe_cache_hit) {
+                av_log(NULL, AV_LOG_WARNING, "[session %d] %s changed since it was cached, probing it again\n",
+                       s->index, s->input_url);
+                ic->probesize            = probesize;
+                ic->max_analyze_duration = max_analyze_duration;
             }
         }
-        free(pEachLinBuf);
     }
-    fclose(pf);
-
-    return pdata;
-}
-
-//ÊÍ·ÅGetBmpData·ÖÅäµÄ¿Õ¼ä  
-static void FreeBmpData(U8 *pdata)
-{
-    if(pdata)
-    {
-        free(pdata);
-        pdata = NULL;
+    if (!s->probe_cache_hit) {
+        ret = avformat_find_stream_info(ic, NULL);
+        if (ret >= 0 && probe_cache_dir && probe_complete(ic) && probe_cache_save(s) < 0)
+            av_log(NULL, AV_LOG_WARNING, "[session %d] could not write the probe cache of %s to %s\n",
+                   s->index, s->input_url, probe_cache_dir);
     }
-}
 
-typedef struct _LI_RGB
-{
-    U8 b;
-    U8 g;
-    U8 r;
-}LI_RGB;
 
-static void saveFrameToBmp(uint8_t* pdst,int width,int height,char* name)
-{
 
 
-    LI_RGB* pdata = (LI_RGB*)malloc(sizeof(LI_RGB)*width*height);
-    LI_RGB* orig = pdata;
-    memset(pdata,0,sizeof(LI_RGB)*width*height);
-    for (int i = 0; i < width*height; i++)
-    {
+    for (i = 0; i < ic->nb_streams; i++) {
+        GROW_ARRAY(s->input_streams, s->nb_input_streams);
 
-        (*pdata).b = *(pdst++);
-        (*pdata).g = *(pdst++);
-        (*pdata).r = *(pdst++);
-        pdata++;
-    }
-    GenBmpFile((U8*)orig,24,width,height,name);
-    FreeBmpData(orig);
-    //free(pdata);
-}
+        AVStream *st = ic->streams[i];
+        AVCodecParameters *par = st->codecpar;
+        InputStream *ist = av_mallocz(sizeof(*ist));
+        if (!ist)
+            return AVERROR(ENOMEM);
 
+        s->input_streams[i] = ist;
+        ist->st = st;
+        ts_converter_init(&ist->ts_us, st->time_base, AV_TIME_BASE_Q);
+        ist->discard = 1;
+        ist->nb_samples = 0;
+        ist->min_pts = INT64_MAX;
+        ist->max_pts = INT64_MIN;
+        ist->next_pts = AV_NOPTS_VALUE;
+        ist->next_dts = AV_NOPTS_VALUE;
+        ist->saw_first_ts=0;
+        ist->decoding_needed = 0;
+        ist->last_snapshot_ts = AV_NOPTS_VALUE;
+        ist->snapshot_ts_offset = AV_NOPTS_VALUE;
 
-static struct SwsContext *img_convert_ctx = NULL;
-static AVThreadMessageQueue *hook_thread_queue;
-static pthread_t hook_thread;
-static int hook_thread_queue_size=1000;
 
+        ist->dec = avcodec_find_decoder(st->codecpar->codec_id);
+        ist->dec_ctx = avcodec_alloc_context3(ist->dec);
+        ret = avcodec_parameters_to_context(ist->dec_ctx, par);
+        ist->dec_ctx->framerate = st->avg_frame_rate;
+        ret = avcodec_parameters_from_context(par, ist->dec_ctx);
 
-static void *hook_thread_proc(void *arg)
-{
+    }
 
-    AVFrame* frame=NULL;
-        static unsigned sws_flags = SWS_BICUBIC;
-        int ret = 0;
-    av_log(NULL,AV_LOG_ERROR,"start the hook thread\n");
-    while(1){
+    av_dump_format(ic, 1, s->input_url, 0);
 
-        ret = av_thread_message_queue_recv(hook_thread_queue, &frame,0);
+    return ret;
 
-        if(ret<0){
-            av_log(NULL, AV_LOG_ERROR, "thread recv error %s\n", strerror(ret));
-            continue;
-        }
 
-        av_log(NULL,AV_LOG_FATAL," hook a frame \n");
+}
 
-        img_convert_ctx = sws_getCachedContext(img_convert_ctx,
-                    frame->width, frame->height, frame->format, frame->width, frame->height,
-                    AV_PIX_FMT_BGR24, sws_flags, NULL, NULL, NULL);
-  
+/*
+ * called once the outputs exist: every input stream collects its consumers,
+ * decoders are opened only for streams somebody needs frames from and the
+ * demuxer is told to skip the streams nobody needs at all
+ */
+static int init_input_streams(StreamSession *s)
+{
+    int i, ret;
 
+    for (i = 0; i < s->nb_output_streams; i++) {
+        OutputStream *ost = s->output_streams[i];
+        InputStream *ist;
 
-        if (img_convert_ctx != NULL && frame->format == AV_PIX_FMT_YUVJ420P) {
+        if (ost->source_index >= s->nb_input_streams)
+            continue;
+        ist = s->input_streams[ost->source_index];
+        ist->discard = 0;
+        if (ost->encoding_needed && with_decoding)
+            ist->decoding_needed |= DECODING_FOR_OST;
+    }
 
-         
-          
-            uint8_t *dst_data[4];  
-            int dst_linesize[4];  
+    for (i = 0; i < s->nb_input_streams; i++) {
+        InputStream *ist = s->input_streams[i];
+        AVCodecParameters *par = ist->st->codecpar;
 
+        // unmapped streams are not even decoded for the hook
+        if (with_hook_frame && with_decoding && par->codec_type == AVMEDIA_TYPE_VIDEO && !ist->discard)
+            ist->decoding_needed |= DECODING_FOR_HOOK;
+        if (ist->decoding_needed && ist->filter_graph)
+            ist->decoding_needed |= DECODING_FOR_FILTER;
 
-            int src_w = frame->width;
-            int src_h = frame->height;
+        if (ist->decoding_needed)
+            ist->discard = 0;
+        ist->st->discard = ist->discard ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
 
-            ret = av_image_alloc(dst_data, dst_linesize,src_w, src_h, AV_PIX_FMT_BGR24, 1);  
-            if (ret< 0) {  
-                printf( "Could not allocate destination image\n");  
-                
-            }else{
-                sws_scale(img_convert_ctx, (const uint8_t * const *)frame->data, frame->linesize,
-                      0, frame->height, dst_data, dst_linesize);
-                saveFrameToBmp(dst_data[0],frame->width,frame->height,"test.bmp");
+        if (ist->decoding_needed){
+            AVCodec *codec = ist->dec;
 
+            if (!codec) {
+                av_log(NULL, AV_LOG_ERROR, "[session %d] no decoder for stream #%d (%s)\n",
+                       s->index, i, avcodec_get_name(par->codec_id));
+                return AVERROR_DECODER_NOT_FOUND;
             }
+            
+            ist->dec_ctx->opaque                = ist;
+            ist->dec_ctx->thread_safe_callbacks = 1;
+            ist->dec_ctx->pkt_timebase = ist->st->time_base;
 
+            ist->got_output = 0;
 
+            // the decoder only exists for the snapshot hook, every other
+            // frame would be thrown away after a full decode
+            if (keyframe_snapshots && ist->decoding_needed == DECODING_FOR_HOOK) {
+                ist->keyframes_only = 1;
+                ist->dec_ctx->skip_frame = AVDISCARD_NONKEY;
+                // keyframes come out in decode order, no need to wait for reordering
+                ist->dec_ctx->flags |= AV_CODEC_FLAG_LOW_DELAY;
+                // frame threads would hold each keyframe back by thread_count packets
+                ist->dec_ctx->thread_type = FF_THREAD_SLICE;
+            }
 
-
-
-        } else {
-            av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
-
+            ret = avcodec_open2(ist->dec_ctx, codec, NULL);
+            if (ret < 0) {
+                av_log(NULL, AV_LOG_ERROR, "[session %d] could not open decoder for stream #%d: %s\n",
+                       s->index, i, av_err2str(ret));
+                return ret;
+            }
         }
 
-        av_frame_free(&frame);
-
-
+        av_log(NULL, AV_LOG_VERBOSE, "[session %d] stream #%d: %s%s%s%s\n", s->index, i,
+               ist->discard ? "discarded" : "demuxed",
+               ist->decoding_needed & DECODING_FOR_OST    ? ", decoded for encoder" : "",
+               ist->decoding_needed & DECODING_FOR_FILTER ? ", decoded for filters" : "",
+               ist->decoding_needed & DECODING_FOR_HOOK   ? ", decoded for hook"    : "");
+    }
 
+    return 0;
+}
 
+static int init_output_stream_encode(StreamSession *s, OutputStream *ost)
+{
+    InputStream *ist = s->input_streams[ost->source_index];
+    AVCodecContext *enc_ctx = ost->enc_ctx;
+    AVCodecContext *dec_ctx = NULL;
+    int j, ret;
+
+    // Muxers use AV_PKT_DATA_DISPLAYMATRIX to signal rotation. On the other
+    // hand, the legacy API makes demuxers set "rotate" metadata entries,
+    // which have to be filtered out to prevent leaking them to output files.
+    av_dict_set(&ost->st->metadata, "rotate", NULL, 0);
+
+    if (ist) {
+        ost->st->disposition          = ist->st->disposition;
+
+        dec_ctx = ist->dec_ctx;
+
+        enc_ctx->chroma_sample_location = dec_ctx->chroma_sample_location;
+    } 
+
+    if (enc_ctx->codec_type == AVMEDIA_TYPE_VIDEO) {
+
+        if (ist && ist->filter_graph && !ost->frame_rate.num)
+            ost->frame_rate = av_buffersink_get_frame_rate(ist->filter_out);
+        if (ist && !ost->frame_rate.num)
+            ost->frame_rate = ist->framerate;
+        if (ist && !ost->frame_rate.num)
+            ost->frame_rate = ist->st->r_frame_rate;
+        if (ist && !ost->frame_rate.num) {
+            ost->frame_rate = (AVRational){25, 1};
+            av_log(NULL, AV_LOG_WARNING,
+                   "No information "
+                   "about the input framerate is available. Falling "
+                   "back to a default value of 25fps for output stream #%d:%d. Use the -r option "
+                   "if you want a different framerate.\n",
+                   ost->file_index, ost->index);
+        }
+//    
+        // reduce frame rate for mpeg4 to be within the spec limits
+        if (enc_ctx->codec_id == AV_CODEC_ID_MPEG4) {
+            av_reduce(&ost->frame_rate.num, &ost->frame_rate.den,
+                      ost->frame_rate.num, ost->frame_rate.den, 65535);
+        }
     }
-    av_log(NULL,AV_LOG_ERROR,"end the thread\n");
-    return NULL;
 
-}
+    switch (enc_ctx->codec_type) {
+    case AVMEDIA_TYPE_AUDIO:
+        if (dec_ctx) {
+            enc_ctx->sample_rate    = dec_ctx->sample_rate;
+            enc_ctx->channel_layout = dec_ctx->channel_layout ? dec_ctx->channel_layout :
+                                      av_get_default_channel_layout(dec_ctx->channels);
+        }
+        if (!enc_ctx->channel_layout)
+            enc_ctx->channel_layout = AV_CH_LAYOUT_MONO;
+        enc_ctx->channels = av_get_channel_layout_nb_channels(enc_ctx->channel_layout);
+        if (enc_ctx->sample_rate <= 0)
+            enc_ctx->sample_rate = 44100;
+        // 8kHz g.711 goes to the closest rate the encoder takes, swresample does the rest
+        if (ost->enc->supported_samplerates) {
+            int best = ost->enc->supported_samplerates[0];
+            for (j = 1; ost->enc->supported_samplerates[j]; j++)
+                if (FFABS(ost->enc->supported_samplerates[j] - enc_ctx->sample_rate) <
+                    FFABS(best - enc_ctx->sample_rate))
+                    best = ost->enc->supported_samplerates[j];
+            enc_ctx->sample_rate = best;
+        }
+        enc_ctx->sample_fmt = ost->enc->sample_fmts ? ost->enc->sample_fmts[0] : AV_SAMPLE_FMT_FLTP;
+        if (dec_ctx)
+            enc_ctx->bits_per_raw_sample = FFMIN(dec_ctx->bits_per_raw_sample,
+                                                 av_get_bytes_per_sample(enc_ctx->sample_fmt) << 3);
+        enc_ctx->time_base = av_make_q(1, enc_ctx->sample_rate);
+        break;
 
-static int init_hook_threads(void)
-{
+    case AVMEDIA_TYPE_VIDEO:
+        // frames keep the timestamps of the camera, rounding them to 1/fps
+        // would collide on the jittery clocks of rtsp sources
+        enc_ctx->time_base = ist ? ist->st->time_base : av_inv_q(ost->frame_rate);
 
-    int ret = av_thread_message_queue_alloc(&hook_thread_queue,
-                                        hook_thread_queue_size, sizeof(AVFrame));
-    if (ret < 0)
-        return ret;
+        enc_ctx->framerate = ost->frame_rate;
+
+        ost->st->avg_frame_rate = ost->frame_rate;
+
+        if (dec_ctx) {
+            // frames come out of the filters when there are some, not out of the decoder
+            int width  = ist->filter_graph ? av_buffersink_get_w(ist->filter_out) : dec_ctx->width;
+            int height = ist->filter_graph ? av_buffersink_get_h(ist->filter_out) : dec_ctx->height;
+
+            enc_ctx->width               = ost->width  > 0 ? ost->width  : width;
+            enc_ctx->height              = ost->height > 0 ? ost->height : height;
+            // the other side of a -1 follows the aspect ratio, even for 4:2:0
+            if (ost->width < 0 && height)
+                enc_ctx->width  = FFMAX(2, av_rescale(enc_ctx->height, width, height) & ~1);
+            if (ost->height < 0 && width)
+                enc_ctx->height = FFMAX(2, av_rescale(enc_ctx->width, height, width) & ~1);
+            enc_ctx->sample_aspect_ratio = ist->filter_graph ? av_buffersink_get_sample_aspect_ratio(ist->filter_out) :
+                                                               dec_ctx->sample_aspect_ratio;
+            enc_ctx->pix_fmt             = ist->filter_graph ? av_buffersink_get_format(ist->filter_out) :
+                                                               dec_ctx->pix_fmt;
+            enc_ctx->color_range         = dec_ctx->color_range;
+        }
+        if (enc_ctx->pix_fmt == AV_PIX_FMT_NONE)
+            enc_ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        if (ost->enc->pix_fmts)
+            enc_ctx->pix_fmt = avcodec_find_best_pix_fmt_of_list(ost->enc->pix_fmts, enc_ctx->pix_fmt, 0, NULL);
+        ost->st->sample_aspect_ratio = enc_ctx->sample_aspect_ratio;
+
+        enc_ctx->thread_count = enc_thread_count;
+        if (!strcmp(enc_thread_type, "frame"))
+            enc_ctx->thread_type = FF_THREAD_FRAME;
+        else if (!strcmp(enc_thread_type, "slice"))
+            enc_ctx->thread_type = FF_THREAD_SLICE;
+        else
+            enc_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+        break;
 
-    if ((ret = pthread_create(&hook_thread, NULL, hook_thread_proc, NULL))) {
-        av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
-        av_thread_message_queue_free(&hook_thread_queue);
-        return AVERROR(ret);
     }
 
+    ost->mux_timebase = enc_ctx->time_base;
+
     return 0;
 }
 
 
+/* whether the audio of ist is transcoded rather than copied, see audio_codec */
+static int audio_encoding_needed(const InputStream *ist)
+{
+    enum AVCodecID id = ist->st->codecpar->codec_id;
 
+    if (ist->st->codecpar->codec_type != AVMEDIA_TYPE_AUDIO || !strcmp(audio_codec, "copy"))
+        return 0;
+    // g.711, adpcm and pcm of ip cameras are valid flv but most players refuse them
+    if (!strcmp(audio_codec, "auto"))
+        return id != AV_CODEC_ID_AAC && id != AV_CODEC_ID_MP3;
+    return 1;
+}
 
+/* r is the rendition the stream belongs to, NULL for the session output */
+static OutputStream *new_output_stream(StreamSession *s, int file_index, enum AVMediaType type, int source_index,
+                                       const Rendition *r)
+{
+    AVFormatContext *oc = s->output_files[file_index]->ctx;
+    OutputStream *ost;
+    AVStream *st = avformat_new_stream(oc, NULL);
+    int idx      = oc->nb_streams - 1, ret = 0; 
+    int i;
 
-static int hook_the_frame(InputStream *ist, AVFrame *decoded_frame){
+    GROW_ARRAY(s->output_streams, s->nb_output_streams);
+    ost = av_mallocz(sizeof(*ost));
+    if (!ost)
+        return NULL;
+    s->output_streams[s->nb_output_streams - 1] = ost;
 
-    int ret = 0;
-    AVFrame *frame = decoded_frame;
-  
+    ost->file_index = file_index;
+    ost->index      = idx;
+    ost->st         = st;
+    st->codecpar->codec_type = type;
+    ost->enc_ctx = avcodec_alloc_context3(ost->enc);
+    ost->enc_ctx->codec_type = type;
+    ost->ref_par = avcodec_parameters_alloc();
+    ost->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
-    unsigned flags = AV_THREAD_MESSAGE_NONBLOCK ;
+    ost->source_index = source_index;
 
+    ost->last_mux_dts = AV_NOPTS_VALUE;
 
-    static int bb=0;
-    bb++;
-    int speed= 2;
+    ost->enc_ctx->codec_type = type;
 
+    ost->encoding_needed = 0;
 
 
-    if( bb % speed ==0){
 
 
-        AVFrame *clone = av_frame_alloc();
-        int i;
-        if (!clone)
-            return AVERROR(ENOMEM);
-        clone->format = frame->format;
-        clone->width  = FFALIGN(frame->width, 16);
-        clone->height = FFALIGN(frame->height, 16);
-        ret = av_frame_get_buffer(clone, 32);
-        if (ret < 0) {
-            av_frame_free(&clone);
-            return ret;
-        }
 
-        ret = av_frame_copy(clone, frame);
-        if (ret < 0) {
-            av_frame_free(&clone);
-            return ret;
+    // copy or transcode is decided per stream: video follows -encode in the
+    // session output, renditions always encode it and attached outputs copy it,
+    // audio follows -acodec whatever happens to the video
+    if (type == AVMEDIA_TYPE_VIDEO)
+        ost->encoding_needed = (with_encoding && !file_index) || r;
+    else if (type == AVMEDIA_TYPE_AUDIO && source_index < s->nb_input_streams)
+        ost->encoding_needed = audio_encoding_needed(s->input_streams[source_index]);
+
+    if (ost->encoding_needed) {
+
+        // video gets an encode task of its own, audio is light enough for the demux task
+        if (type == AVMEDIA_TYPE_VIDEO) {
+            for (i = 0; i < s->nb_encoders; i++)
+                if (!s->encoders[i].ost) {
+                    ost->encoder = &s->encoders[i];
+                    break;
+                }
+            if (!ost->encoder) {
+                av_log(NULL, AV_LOG_ERROR, "[session %d] only one video stream per output can be encoded\n",
+                       s->index);
+                return NULL;
+            }
+            if (r) {
+                ost->width  = r->width;
+                ost->height = r->height;
+                av_dict_copy(&ost->encoder_opts, r->encoder_opts, 0);
+            }
+
+            ost->st->codecpar->codec_id = av_guess_codec(oc->oformat, NULL, oc->url,
+                                                         NULL, ost->st->codecpar->codec_type);
+            ost->enc = avcodec_find_encoder(ost->st->codecpar->codec_id);
+        } else if (!strcmp(audio_codec, "auto")) {
+            ost->enc = avcodec_find_encoder(AV_CODEC_ID_AAC);
+        } else {
+            ost->enc = avcodec_find_encoder_by_name(audio_codec);
+        }
+        if (!ost->enc || ost->enc->type != type) {
+            av_log(NULL, AV_LOG_ERROR, "[session %d] no %s encoder\n", s->index,
+                   type == AVMEDIA_TYPE_VIDEO ? avcodec_get_name(ost->st->codecpar->codec_id) :
+                   !strcmp(audio_codec, "auto") ? "aac" : audio_codec);
+            return NULL;
         }
+        ost->st->codecpar->codec_id = ost->enc->id;
+        ost->last_enc_pts   = AV_NOPTS_VALUE;
+        ost->audio_fifo_pts = AV_NOPTS_VALUE;
 
-        frame = clone;
 
-        ret = av_thread_message_queue_send(hook_thread_queue, &clone, flags);
-        if (ret < 0) {
+        AVCodec      *codec = ost->enc;
+        AVCodecContext *dec = NULL;
+        InputStream *ist;
+
+        ret = init_output_stream_encode(s, ost);
+        if (ret < 0)
+            return NULL;
+
+        ist = s->input_streams[ost->source_index];
+
+        if (ost->enc->type == AVMEDIA_TYPE_AUDIO &&
+            !codec->defaults &&
+            !av_dict_get(ost->encoder_opts, "b", NULL, 0) &&
+            !av_dict_get(ost->encoder_opts, "ab", NULL, 0))
+            av_dict_set(&ost->encoder_opts, "b", "128000", 0);
+
+        // if(ost->enc->type == AVMEDIA_TYPE_VIDEO){
+        //     enc_ctx->pix_fmt = AV_PIX_FMT_YUVJ420P;
+        // }
+
 
-            av_frame_free(&clone);
-            av_thread_message_queue_set_err_recv(hook_thread_queue, ret);
 
+        ret = avcodec_open2(ost->enc_ctx, codec, &ost->encoder_opts) ;
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "[session %d] could not open %s encoder: %s\n",
+                   s->index, codec->name, av_err2str(ret));
+            return NULL;
         }
+        ret = avcodec_parameters_from_context(ost->st->codecpar, ost->enc_ctx);
+        ret = avcodec_copy_context(ost->st->codec, ost->enc_ctx);
+    
 
-    }
 
-    return ret;
+        // copy timebase while removing common factors
+        if (ost->st->time_base.num <= 0 || ost->st->time_base.den <= 0)
+            ost->st->time_base = av_add_q(ost->enc_ctx->time_base, (AVRational){0, 1});
+
+        // copy estimated duration as a hint to the muxer
+        if (ost->st->duration <= 0 && ist && ist->st->duration > 0)
+            ost->st->duration = av_rescale_q(ist->st->duration, ist->st->time_base, ost->st->time_base);
+
+        ost->st->codec->codec= ost->enc_ctx->codec;
+        if (ost->encoder)
+            ost->encoder->ost = ost;
+    }
 
+    return ost;
 }
 
 
-static int send_frame_to_encoding(OutputStream *ost,
-                         AVFrame *in_picture, AVPacket* rpkt){
 
-    AVPacket pkt;
-    AVCodecContext *enc = ost->enc_ctx;
 
-    int ret = avcodec_send_frame(enc, in_picture);
-    if (ret < 0)
-        return -1;
 
-    while (1) {
-        ret = avcodec_receive_packet(enc, &pkt);
-        if (ret == AVERROR(EAGAIN))
-            break;
 
-        pkt.pts = rpkt->dts;
 
-        av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+/* muxer side of the output buffer: everything it got so far goes out in one write */
+static int output_io_write(void *opaque, uint8_t *buf, int size)
+{
+    OutputFile *of = opaque;
 
-        int frame_size = pkt.size;
-        write_packet(&pkt,ost,0);
-    }
-    return 0;
+    avio_write(of->io, buf, size);
+    of->nb_writes++;
+    of->write_bytes  += size;
+    of->pending_since = 0;
+    return of->io->error < 0 ? of->io->error : size;
 }
 
-
-static int decode_video(InputStream *ist, AVPacket *pkt, int *got_output, int64_t *duration_pts, int eof,
-                        int *decode_failed)
+/*
+ * put the output buffer between the muxer and the connection in ctx->pb.
+ * the connection then takes every write as is instead of copying it into
+ * a buffer of its own. seekable outputs, local files, are left alone, the
+ * flv muxer goes back to fill in the duration.
+ */
+static int output_io_wrap(OutputFile *of)
 {
-    AVFrame *decoded_frame;
-    int i, ret = 0, err = 0;
-    int64_t best_effort_timestamp;
-    int64_t dts = AV_NOPTS_VALUE;
-    AVPacket avpkt;
+    AVIOContext *io = of->ctx->pb;
+    int size = output_buffer_size;
+    uint8_t *buf;
 
-    // With fate-indeo3-2, we're getting 0-sized packets before EOF for some
-    // reason. This seems like a semi-critical bug. Don't trigger EOF, and
-    // skip the packet.
-    if (!eof && pkt && pkt->size == 0)
+    if (io->seekable || size <= 0)
         return 0;
-
-    if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
+    // a datagram is one write, never larger than a packet
+    if (io->max_packet_size)
+        size = FFMIN(size, io->max_packet_size);
+    if (!(buf = av_malloc(size)))
         return AVERROR(ENOMEM);
-    if (!ist->filter_frame && !(ist->filter_frame = av_frame_alloc()))
+    of->ctx->pb = avio_alloc_context(buf, size, 1, of, NULL, output_io_write, NULL);
+    if (!of->ctx->pb) {
+        of->ctx->pb = io;
+        av_free(buf);
         return AVERROR(ENOMEM);
+    }
+    of->ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    // left at -1 the muxer would flush every packet of a stream that cannot seek
+    if (of->ctx->flush_packets < 0)
+        of->ctx->flush_packets = 0;
+    io->direct = 1;
+    of->io = io;
+    of->io_open_time = av_gettime_relative();
+    return 0;
+}
 
-    decoded_frame = ist->decoded_frame;
-    if (ist->dts != AV_NOPTS_VALUE)
-        dts = av_rescale_q(ist->dts, AV_TIME_BASE_Q, ist->st->time_base);
-    if (pkt) {
-        avpkt = *pkt;
-        avpkt.dts = dts; // ffmpeg.c probably shouldn't do this
+static void output_io_close(StreamSession *s, OutputFile *of)
+{
+    AVFormatContext *oc = of->ctx;
+    int64_t elapsed;
+
+    if (oc->oformat->flags & AVFMT_NOFILE)
+        return;
+    if (!of->io) {
+        avio_closep(&oc->pb);
+        return;
     }
 
+    if (oc->pb) {
+        avio_flush(oc->pb);
+        av_freep(&oc->pb->buffer);
+        avio_context_free(&oc->pb);
+    }
+    avio_closep(&of->io);
 
+    elapsed = av_gettime_relative() - of->io_open_time;
+    if (of->nb_writes)
+        av_log(NULL, AV_LOG_INFO, "[session %d] %s: %"PRId64" writes, %"PRId64" bytes per write, "
+               "%.1f writes/s\n", s->index, oc->url, of->nb_writes, of->write_bytes / of->nb_writes,
+               elapsed > 0 ? of->nb_writes * (double)AV_TIME_BASE / elapsed : 0.0);
+}
 
-    ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt ? &avpkt : NULL);
+/*
+ * the session output when r is NULL, the output of rendition r else. an
+ * output attached through the control socket comes with its url and the
+ * avio context the control thread connected, the session owns pb from then on.
+ */
+static int open_output_file(StreamSession *s, const Rendition *r, const char *attach_url, AVIOContext *pb,
+                            int *pfile_index){
 
-    if (ret < 0)
-        *decode_failed = 1;
+    int i, j, err, file_index;
+   
+    InputStream  *ist;
+    AVFormatContext *oc = NULL;
+    OutputFile *of, *old;
+    char *url = attach_url ? av_strdup(attach_url) :
+                r ? av_asprintf("%s_%s", s->output_url, r->name) : av_strdup(s->output_url);
+
+    if (!url)
+        return AVERROR(ENOMEM);
 
+    int format_flags = 0;
+    err = avformat_alloc_output_context2(&oc, NULL, s->output_format, url);
+    if (err < 0) {
+        av_log(NULL, AV_LOG_ERROR, "[session %d] could not create %s muxer: %s\n",
+               s->index, s->output_format, av_err2str(err));
+        av_free(url);
+        return err;
+    }
+    of = av_mallocz(sizeof(*of));
+    if (!of) {
+        avformat_free_context(oc);
+        av_free(url);
+        return AVERROR(ENOMEM);
+    }
+    of->ctx      = oc;
+    of->last_dts = AV_NOPTS_VALUE;
+    oc->pb       = pb;
+    // never reallocated, the mux task looks files up while the demux task
+    // attaches. the slot of a detached file is taken again once it is reaped.
+    pthread_mutex_lock(&s->control_lock);
+    for (file_index = 0; file_index < s->nb_output_files; file_index++)
+        if (s->output_files[file_index]->reaped)
+            break;
+    old = file_index < s->nb_output_files ? s->output_files[file_index] : NULL;
+    if (file_index < MAX_OUTPUT_FILES) {
+        s->output_files[file_index] = of;
+        if (!old)
+            s->nb_output_files++;
+    }
+    pthread_mutex_unlock(&s->control_lock);
+    if (file_index == MAX_OUTPUT_FILES) {
+        avformat_free_context(oc);
+        av_free(of);
+        av_free(url);
+        return AVERROR(ENOSPC);
+    }
+    if (old) {
+        avformat_free_context(old->ctx);
+        av_free(old);
+    }
+    if (pfile_index)
+        *pfile_index = file_index;
+
+    // the flv muxer holds a packet up to 10s waiting for the other stream,
+    // forever in effect when the camera has a silent or missing audio track
+    if (max_interleave_delta >= 0)
+        oc->max_interleave_delta = max_interleave_delta;
+    else if (low_latency)
+        oc->max_interleave_delta = AV_TIME_BASE / 10;
+    if (flush_packets > 0 || (flush_packets < 0 && low_latency)) {
+        oc->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+        oc->flush_packets = 1;
+    } else if (!flush_packets) {
+        oc->flush_packets = 0;
+    }
 
+    OutputStream *ost;
+    AVCodecContext *enc;
 
-    if (*got_output && ret >= 0) {
-        if (ist->dec_ctx->width  != decoded_frame->width ||
-            ist->dec_ctx->height != decoded_frame->height ||
-            ist->dec_ctx->pix_fmt != decoded_frame->format) {
-            av_log(NULL, AV_LOG_DEBUG, "Frame parameters mismatch context %d,%d,%d != %d,%d,%d\n",
-                decoded_frame->width,
-                decoded_frame->height,
-                decoded_frame->format,
-                ist->dec_ctx->width,
-                ist->dec_ctx->height,
-                ist->dec_ctx->pix_fmt);
-        }
+    for (i = 0; i < s->nb_stream_map; i++) {
+        AVStream *st = s->ic->streams[s->stream_map[i]];
+
+        ost = new_output_stream(s, file_index, st->codecpar->codec_type, s->stream_map[i], r);
+        if (!ost)
+            goto fail;
     }
 
-    if (!*got_output || ret < 0)
-        return ret;
 
 
 
+    // a stuck rtmp server must not be able to hang the muxer forever
+    oc->interrupt_callback.callback = output_interrupt_cb;
+    oc->interrupt_callback.opaque   = s;
 
-    best_effort_timestamp= decoded_frame->best_effort_timestamp;
-    *duration_pts = decoded_frame->pkt_duration;
+    err = oc->pb ? 0 : avio_open2(&oc->pb, url, AVIO_FLAG_WRITE,&oc->interrupt_callback,
+                              NULL);
+    if (err >= 0)
+        err = output_io_wrap(of);
+    if (err < 0) {
+        av_log(NULL, AV_LOG_ERROR, "[session %d] could not open %s: %s\n",
+               s->index, url, av_err2str(err));
+        av_free(url);
+        return err;
+    }
+   
+    av_free(url);
+    return 0;
 
+fail:
+    av_free(url);
+    return AVERROR(EINVAL);
+}
 
+/* the input stream spec selects in ic, -1 if there is none */
+static int select_input_stream(AVFormatContext *ic, const StreamSpec *spec)
+{
+    int i, nth = spec->nth;
 
-    if(best_effort_timestamp != AV_NOPTS_VALUE) {
-        int64_t ts = av_rescale_q(decoded_frame->pts = best_effort_timestamp, ist->st->time_base, AV_TIME_BASE_Q);
+    if (spec->index >= 0)
+        return spec->index < ic->nb_streams ? spec->index : -1;
 
-        if (ts != AV_NOPTS_VALUE)
-            ist->next_pts = ist->pts = ts;
+    for (i = 0; i < ic->nb_streams; i++) {
+        AVStream *st = ic->streams[i];
+        AVDictionaryEntry *lang = av_dict_get(st->metadata, "language", NULL, 0);
+
+        if (st->codecpar->codec_type != spec->type ||
+            (spec->language[0] && (!lang || strcmp(lang->value, spec->language))))
+            continue;
+        if (!nth--)
+            return i;
     }
+    return -1;
+}
+
+/*
+ * once the input is probed: which of its streams every output gets. the
+ * others are discarded by init_input_streams() and never leave the demuxer.
+ */
+static int map_input_streams(StreamSession *s)
+{
+    int i, index;
 
+    for (i = 0; i < nb_stream_specs; i++) {
+        const StreamSpec *spec = &stream_specs[i];
 
-    //todo frame is decoded
-    //send_frame_to_filters(ist, decoded_frame);
+        index = select_input_stream(s->ic, spec);
+        if (index < 0) {
+            if (spec->optional) {
+                av_log(NULL, AV_LOG_VERBOSE, "[session %d] %s has no stream %s, going on without it\n",
+                       s->index, s->input_url, spec->arg);
+                continue;
+            }
+            av_log(NULL, AV_LOG_ERROR, "[session %d] %s has no stream %s\n",
+                   s->index, s->input_url, spec->arg);
+            return AVERROR_STREAM_NOT_FOUND;
+        }
 
-    if(with_hook_frame){
-        hook_the_frame(ist,decoded_frame);
+        GROW_ARRAY(s->stream_map, s->nb_stream_map);
+        if (!s->stream_map)
+            return AVERROR(ENOMEM);
+        s->stream_map[s->nb_stream_map - 1] = index;
     }
 
-    if(with_encoding){
-        send_frame_to_encoding(output_streams[0],decoded_frame,pkt);
+    if (!s->nb_stream_map) {
+        av_log(NULL, AV_LOG_ERROR, "[session %d] no stream of %s is mapped\n", s->index, s->input_url);
+        return AVERROR_STREAM_NOT_FOUND;
     }
+    return 0;
+}
 
-fail:
+static int open_output_files(StreamSession *s)
+{
+    int i, ret;
 
-    av_frame_unref(decoded_frame);
-    return err < 0 ? err : ret;
+    ret = open_output_file(s, NULL, NULL, NULL, NULL);
+    for (i = 0; i < nb_renditions && ret >= 0; i++)
+        ret = open_output_file(s, &renditions[i], NULL, NULL, NULL);
+    return ret;
 }
 
 
+/* ingest side: hand the packet over to the mux task of the session */
+static void write_packet(StreamSession *session, AVPacket *pkt, OutputStream *ost, int unqueue)
+{
+    AVStream *st = ost->st;
+    int64_t ts;
+    int ret;
 
+    // after an overflow, video restarts on a keyframe so the server never sees a broken gop
+    if (ost->waiting_for_keyframe) {
+        if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+            session->nb_dropped++;
+            av_packet_unref(pkt);
+            return;
+        }
+        ost->waiting_for_keyframe = 0;
+    }
 
-static int decode_audio(InputStream *ist, AVPacket *pkt, int *got_output,
-                        int *decode_failed)
+    ts = ts_convert(&ost->ts_mux_to_us, pkt->dts);
+    ret = packet_queue_put(&session->mux_queue, pkt, ost, ts);
+    if (ret > 0)
+        scheduler_wake(&mux_scheduler, &session->mux_task);
+    else if (ret == AVERROR(ENOBUFS) && st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        ost->waiting_for_keyframe = 1;
+}
+
+/* mux task: the detach marker of a file came out of the queue, after its last packets */
+static void close_output_file(StreamSession *s, OutputFile *of)
 {
-    AVFrame *decoded_frame;
-    AVCodecContext *avctx = ist->dec_ctx;
-    int ret, err = 0;
-    AVRational decoded_frame_tb;
+    int ret, closed = of->closed;
+
+    if (!closed) {
+        s->io_start_time = av_gettime_relative();
+        ret = av_write_trailer(of->ctx);
+        output_io_close(s, of);
+        s->io_start_time = 0;
+        av_log(NULL, ret < 0 ? AV_LOG_WARNING : AV_LOG_INFO, "[session %d] detached %s after %"PRId64" packets\n",
+               s->index, of->ctx->url, of->nb_packets);
+    }
+    pthread_mutex_lock(&s->control_lock);
+    of->closed   = 1;
+    of->released = 1;
+    pthread_mutex_unlock(&s->control_lock);
+}
 
-    if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
-        return AVERROR(ENOMEM);
-    if (!ist->filter_frame && !(ist->filter_frame = av_frame_alloc()))
+/*
+ * mux task: a write to of failed, the connection is dropped without a
+ * trailer. the demux task stops feeding the file, the session goes on.
+ */
+static void fail_output_file(StreamSession *s, OutputFile *of)
+{
+    s->io_start_time = av_gettime_relative();
+    output_io_close(s, of);
+    s->io_start_time = 0;
+    pthread_mutex_lock(&s->control_lock);
+    of->closed = 1;
+    s->nb_failed_outputs++;
+    pthread_mutex_unlock(&s->control_lock);
+}
+
+/* egress side: the only place that talks to the muxer once the header is written */
+static int mux_packet(StreamSession *session, AVPacket *pkt, OutputStream *ost)
+{
+    OutputFile *of = session->output_files[ost->file_index];
+    AVFormatContext *s = of->ctx;
+    int64_t dts;
+    int ret;
+
+    // encoders may still have had packets for a file detached meanwhile
+    if (of->closed) {
+        av_packet_unref(pkt);
+        return 0;
+    }
+
+    // an output attached to a running session starts from 0
+    if (of->ts_offset) {
+        int64_t offset = ts_convert(&ost->ts_us_to_mux, of->ts_offset);
+        if (pkt->pts != AV_NOPTS_VALUE)
+            pkt->pts -= offset;
+        if (pkt->dts != AV_NOPTS_VALUE)
+            pkt->dts -= offset;
+    }
+    dts = ts_convert(&ost->ts_mux_to_us, pkt->dts);
+    ts_convert_packet(&ost->ts_mux_to_st, pkt);
+   
+    ost->last_mux_dts = pkt->dts;
+
+    pkt->stream_index = ost->index;
+
+    if (!session->first_packet_time) {
+        session->first_packet_time = av_gettime_relative();
+        av_log(NULL, AV_LOG_INFO, "[session %d] first packet out %.3fs after connecting%s\n",
+               session->index, (session->first_packet_time - session->open_time) / 1000000.0,
+               session->probe_cache_hit ? " (probe cache)" : "");
+    }
+
+    session->io_start_time = av_gettime_relative();
+    // a packet that does not go back in time needs no interleaving, once the
+    // muxer has written out what it still holds from earlier packets
+    if (low_latency && dts != AV_NOPTS_VALUE &&
+        (of->last_dts == AV_NOPTS_VALUE || dts >= of->last_dts)) {
+        ret = of->interleaving ? av_interleaved_write_frame(s, NULL) : 0;
+        of->interleaving = 0;
+        if (ret >= 0)
+            ret = av_write_frame(s, pkt);
+    } else {
+        ret = av_interleaved_write_frame(s, pkt);
+        of->interleaving = 1;
+    }
+    // the buffer is flushed when full, or here once its oldest byte is old enough
+    if (ret >= 0 && of->io && s->pb->buf_ptr > s->pb->buffer) {
+        int64_t now = av_gettime_relative();
+
+        if (!of->pending_since)
+            of->pending_since = now;
+        if (now - of->pending_since >= output_flush_interval) {
+            avio_flush(s->pb);
+            ret = s->pb->error;
+        }
+    }
+    session->io_start_time = 0;
+    if (dts != AV_NOPTS_VALUE && (of->last_dts == AV_NOPTS_VALUE || dts > of->last_dts))
+        of->last_dts = dts;
+    of->nb_packets++;
+ 
+    av_packet_unref(pkt);
+    return ret;
+}
+
+
+/*
+ * with move set, ost takes pkt over as it is, data and side data included,
+ * and pkt is left blank. otherwise ost gets a new reference to it.
+ */
+static void do_streamcopy(StreamSession *s, InputStream *ist, OutputStream *ost, AVPacket *pkt, int move)
+{
+    AVPacket opkt;
+
+    if (move) {
+        av_packet_move_ref(&opkt, pkt);
+    } else {
+        av_init_packet(&opkt);
+        opkt.data = NULL;
+        opkt.size = 0;
+        if (av_packet_ref(&opkt, pkt) < 0)
+            return;
+    }
+
+    opkt.pts = ts_convert(&ost->ts_from_source, opkt.pts);
+    if (opkt.dts == AV_NOPTS_VALUE)
+        opkt.dts = ts_convert(&ost->ts_us_to_mux, ist->dts);
+    else
+        opkt.dts = ts_convert(&ost->ts_from_source, opkt.dts);
+    opkt.duration = ts_convert(&ost->ts_from_source, opkt.duration);
+    write_packet(s, &opkt, ost, 0);
+}
+
+static int64_t gop_cache_ts(const InputStream *ist, const AVPacket *pkt)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    return ts_convert(&ist->ts_us, ts);
+}
+
+/* drop the nb oldest packets of the gop cache of ist */
+static void gop_cache_trim(InputStream *ist, int nb)
+{
+    int i;
+
+    for (i = 0; i < nb; i++) {
+        ist->gop_cache_bytes -= ist->gop_cache[i].size;
+        av_packet_unref(&ist->gop_cache[i]);
+    }
+    ist->nb_gop_cache -= nb;
+    memmove(ist->gop_cache, ist->gop_cache + nb, ist->nb_gop_cache * sizeof(*ist->gop_cache));
+}
+
+static void gop_cache_reset(StreamSession *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_input_streams; i++)
+        gop_cache_trim(s->input_streams[i], s->input_streams[i]->nb_gop_cache);
+    s->gop_start_ts = AV_NOPTS_VALUE;
+}
+
+/*
+ * demux task only: keep a reference to every video packet since the last
+ * keyframe, and to the packets of the other streams since the same time
+ */
+static void gop_cache_add(StreamSession *s, InputStream *ist, const AVPacket *pkt)
+{
+    int64_t ts = gop_cache_ts(ist, pkt);
+    AVPacket *cache;
+    int i, j;
+
+    if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO &&
+        (pkt->flags & AV_PKT_FLAG_KEY) && ts != AV_NOPTS_VALUE) {
+        // a new gop, the previous one and the audio that went with it are dropped
+        s->gop_start_ts = ts;
+        gop_cache_trim(ist, ist->nb_gop_cache);
+        for (i = 0; i < s->nb_input_streams; i++) {
+            InputStream *other = s->input_streams[i];
+
+            for (j = 0; j < other->nb_gop_cache; j++) {
+                int64_t t = gop_cache_ts(other, &other->gop_cache[j]);
+                if (t == AV_NOPTS_VALUE || t >= ts)
+                    break;
+            }
+            gop_cache_trim(other, j);
+        }
+    }
+
+    // nothing to start an output on before the first keyframe
+    if (s->gop_start_ts == AV_NOPTS_VALUE)
+        return;
+    if (ist->gop_cache_bytes + pkt->size > gop_cache_max_bytes) {
+        av_log(NULL, AV_LOG_VERBOSE, "[session %d] gop larger than %"PRId64" bytes, not cached\n",
+               s->index, gop_cache_max_bytes);
+        gop_cache_reset(s);
+        return;
+    }
+
+    cache = av_fast_realloc(ist->gop_cache, &ist->gop_cache_alloc,
+                            (ist->nb_gop_cache + 1) * sizeof(*cache));
+    if (!cache) {
+        gop_cache_reset(s);
+        return;
+    }
+    ist->gop_cache = cache;
+    // a reference only, the demuxer's packets are refcounted
+    av_init_packet(&cache[ist->nb_gop_cache]);
+    if (av_packet_ref(&cache[ist->nb_gop_cache], pkt) < 0) {
+        gop_cache_reset(s);
+        return;
+    }
+    ist->nb_gop_cache++;
+    ist->gop_cache_bytes += pkt->size;
+}
+
+/*
+ * demux task only, right after an output file was attached to a running
+ * session: its copied streams get the cached gop first, in dts order, and
+ * its timestamps are rebased to start at 0. without a cached gop its video
+ * waits for the next keyframe.
+ */
+static int gop_cache_prime(StreamSession *s, int file_index)
+{
+    OutputFile *of = s->output_files[file_index];
+    int *pos = av_mallocz_array(FFMAX(s->nb_input_streams, 1), sizeof(*pos));
+    int i, nb = 0;
+
+    if (!pos)
         return AVERROR(ENOMEM);
 
-    decoded_frame = ist->decoded_frame;
+    if (s->gop_start_ts == AV_NOPTS_VALUE) {
+        of->ts_offset = s->last_ts;
+        for (i = 0; i < s->nb_output_streams; i++) {
+            OutputStream *ost = s->output_streams[i];
+            if (ost->file_index == file_index && ost->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+                ost->waiting_for_keyframe = 1;
+        }
+        av_free(pos);
+        return 0;
+    }
 
+    of->ts_offset = s->gop_start_ts;
+    for (;;) {
+        InputStream *next = NULL;
+        int64_t next_ts = INT64_MAX;
+        int next_index = 0;
+        AVPacket *pkt;
+
+        for (i = 0; i < s->nb_input_streams; i++) {
+            InputStream *ist = s->input_streams[i];
+            int64_t t;
+
+            if (pos[i] >= ist->nb_gop_cache)
+                continue;
+            t = gop_cache_ts(ist, &ist->gop_cache[pos[i]]);
+            if (t == AV_NOPTS_VALUE)
+                t = s->gop_start_ts;
+            if (!next || t < next_ts) {
+                next       = ist;
+                next_ts    = t;
+                next_index = i;
+            }
+        }
+        if (!next)
+            break;
 
-    ret = decode(avctx, decoded_frame, got_output, pkt);
+        pkt = &next->gop_cache[pos[next_index]++];
+        for (i = 0; i < s->nb_output_streams; i++) {
+            OutputStream *ost = s->output_streams[i];
+            if (ost->file_index == file_index && ost->source_index == next_index && !ost->encoding_needed)
+                do_streamcopy(s, next, ost, pkt, 0);
+        }
+        nb++;
+    }
+    av_free(pos);
 
-    if (ret < 0)
-        *decode_failed = 1;
+    av_log(NULL, AV_LOG_VERBOSE, "[session %d] %s starts on a cached gop of %d packets\n",
+           s->index, of->ctx->url, nb);
+    return 0;
+}
 
-    if (ret >= 0 && avctx->sample_rate <= 0) {
-        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", avctx->sample_rate);
-        ret = AVERROR_INVALIDDATA;
+static int decode(AVCodecContext *avctx, AVFrame *frame, int *got_frame, AVPacket *pkt)
+{
+    int ret;
+
+    *got_frame = 0;
+
+    if (pkt) {
+        ret = avcodec_send_packet(avctx, pkt);
+        // In particular, we don't expect AVERROR(EAGAIN), because we read all
+        // decoded frames with avcodec_receive_frame() until done.
+        if (ret < 0 && ret != AVERROR_EOF)
+            return ret;
     }
 
+    ret = avcodec_receive_frame(avctx, frame);
+    if (ret < 0 && ret != AVERROR(EAGAIN))
+        return ret;
+    if (ret >= 0)
+        *got_frame = 1;
+
+    return 0;
+}
+
 
-    if (!*got_output || ret < 0)
+
+#pragma pack(push, 1)
+
+typedef unsigned char  U8;
+typedef unsigned short U16;
+typedef unsigned int   U32;
+
+typedef struct tagBITMAPFILEHEADER
+{
+
+ U16 bfType;
+ U32 bfSize;
+ U16 bfReserved1;
+ U16 bfReserved2;
+ U32 bfOffBits;
+} BITMAPFILEHEADER;
+
+typedef struct tagBITMAPINFOHEADER
+{
+ U32 biSize;
+ U32 biWidth;
+ U32 biHeight;
+ U16 biPlanes;
+ U16 biBitCount;
+ U32 biCompression;
+ U32 biSizeImage;
+ U32 biXPelsPerMeter;
+ U32 biYPelsPerMeter;
+ U32 biClrUsed;
+ U32 biClrImportant;
+} BITMAPINFOHEADER;
+
+typedef struct tagRGBQUAD
+{
+ U8 rgbBlue;
+ U8 rgbGreen;
+ U8 rgbRed;
+ U8 rgbReserved;
+} RGBQUAD;
+
+typedef struct tagBITMAPINFO
+{
+ BITMAPINFOHEADER bmiHeader;
+ RGBQUAD bmiColors[1];
+} BITMAPINFO;
+
+
+typedef struct tagBITMAP
+{
+ BITMAPFILEHEADER bfHeader;
+ BITMAPINFO biInfo;
+}BITMAPFILE;
+
+#pragma pack(pop)
+
+
+
+#define BMP_HEADER_SIZE (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER))
+#define BMP_PIXEL_ALIGN 64
+
+/*
+ * a complete 24 bit bmp file in one buffer, reused from one snapshot to the
+ * next: the header is only rebuilt when the size changes and the scaler
+ * writes the bottom-up rows in place through a negative stride
+ */
+typedef struct BmpWriter {
+    uint8_t *buf;
+    int header_offset;   /* the header is placed so that the pixels start aligned */
+    int width, height;
+    int pitch;           /* bytes per row, padded to 4 */
+    int file_size;
+} BmpWriter;
+
+static int bmp_writer_prepare(BmpWriter *w, int width, int height)
+{
+    BITMAPFILEHEADER fh = { 0 };
+    BITMAPINFOHEADER ih = { 0 };
+    int pitch = FFALIGN(width * 3, 4);
+
+    if (width <= 0 || height <= 0 || pitch > (INT_MAX - BMP_PIXEL_ALIGN) / height)
+        return AVERROR(EINVAL);
+
+    if (w->buf && w->width == width && w->height == height)
+        return 0;
+
+    av_freep(&w->buf);
+    w->buf = av_malloc(BMP_PIXEL_ALIGN + (size_t)pitch * height);
+    if (!w->buf)
+        return AVERROR(ENOMEM);
+
+    w->width         = width;
+    w->height        = height;
+    w->pitch         = pitch;
+    w->header_offset = BMP_PIXEL_ALIGN - BMP_HEADER_SIZE;
+    w->file_size     = BMP_HEADER_SIZE + pitch * height;
+
+    fh.bfType    = 0x4D42;
+    fh.bfSize    = w->file_size;
+    fh.bfOffBits = BMP_HEADER_SIZE;
+
+    ih.biSize     = sizeof(BITMAPINFOHEADER);
+    ih.biWidth    = width;
+    ih.biHeight   = height;     // positive: rows are stored bottom-up
+    ih.biPlanes   = 1;
+    ih.biBitCount = 24;
+
+    memcpy(w->buf + w->header_offset, &fh, sizeof(fh));
+    memcpy(w->buf + w->header_offset + sizeof(fh), &ih, sizeof(ih));
+
+    // the padding bytes at the end of each row are never touched by the scaler
+    if (pitch != width * 3)
+        memset(w->buf + BMP_PIXEL_ALIGN, 0, (size_t)pitch * height);
+
+    return 0;
+}
+
+/* destination for sws_scale: the top image row is the last row of the file */
+static void bmp_writer_get_dst(BmpWriter *w, uint8_t *dst[4], int dst_linesize[4])
+{
+    memset(dst, 0, 4 * sizeof(*dst));
+    memset(dst_linesize, 0, 4 * sizeof(*dst_linesize));
+    dst[0]          = w->buf + BMP_PIXEL_ALIGN + (size_t)(w->height - 1) * w->pitch;
+    dst_linesize[0] = -w->pitch;
+}
+
+/* the whole file in one go, no stdio buffering in between */
+static int write_file(const char *filename, const uint8_t *p, int left)
+{
+    int fd, ret = 0;
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "could not open %s: %s\n", filename, av_err2str(ret));
         return ret;
+    }
 
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ret = AVERROR(errno);
+            av_log(NULL, AV_LOG_ERROR, "could not write %s: %s\n", filename, av_err2str(ret));
+            break;
+        }
+        p    += n;
+        left -= n;
+    }
 
+    close(fd);
+    return ret;
+}
 
-    ist->next_pts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate;
-    ist->next_dts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
-                     avctx->sample_rate;
+static int bmp_writer_write(BmpWriter *w, const char *filename)
+{
+    return write_file(filename, w->buf + w->header_offset, w->file_size);
+}
 
+static void bmp_writer_free(BmpWriter *w)
+{
+    av_freep(&w->buf);
+    w->width = w->height = 0;
+}
 
-    if (decoded_frame->pts != AV_NOPTS_VALUE) {
-        decoded_frame_tb   = ist->st->time_base;
-    } else if (pkt && pkt->pts != AV_NOPTS_VALUE) {
-        decoded_frame->pts = pkt->pts;
-        decoded_frame_tb   = ist->st->time_base;
-    }else {
-        decoded_frame->pts = ist->dts;
-        decoded_frame_tb   = AV_TIME_BASE_Q;
+
+/* hooked frames carry the session and stream they come from in frame->opaque */
+#define HOOK_FRAME_OPAQUE(session, stream) ((void *)(intptr_t)(((session) << 16) | ((stream) & 0xffff)))
+#define HOOK_FRAME_SESSION(frame)          ((int)((intptr_t)(frame)->opaque >> 16))
+#define HOOK_FRAME_STREAM(frame)           ((int)((intptr_t)(frame)->opaque & 0xffff))
+
+const char *snapshot_format = "bmp";
+static const char default_snapshot_name[] = "test.%E";
+const char *snapshot_name   = default_snapshot_name;
+int snapshot_quality = -1;          /* jpeg qscale 2-31, webp quality 0-100, png compression 0-9 */
+
+int nb_hook_workers = 1;
+int hook_slices = 4;                        /* slices a large frame is converted in */
+int64_t hook_slice_min_pixels = 1920 * 1088; /* frames above this are sliced */
+
+#define SCALER_CACHE_SIZE 16
+#define MAX_HOOK_SLICES   16
+#define HOOK_SLICE_ALIGN  16    /* slice boundaries stay on whole chroma rows */
+
+typedef struct ScalerKey {
+    int src_w, src_h, src_format;
+    int dst_w, dst_h, dst_format;
+    int flags;
+    int slice;                  /* slices convert concurrently, each needs its own context */
+} ScalerKey;
+
+typedef struct ScalerCacheEntry {
+    ScalerKey key;
+    struct SwsContext *sws;
+    int64_t last_used;
+} ScalerCacheEntry;
+
+typedef struct ScalerSlice {
+    struct SwsContext *sws;
+    const uint8_t *src[4];
+    int src_linesize[4];
+    uint8_t *dst[4];
+    int dst_linesize[4];
+    int height;
+} ScalerSlice;
+
+/*
+ * converts frames for one hook worker. swscale contexts cannot be shared
+ * between threads, so every worker keeps the ones it has built, keyed by
+ * the conversion, instead of rebuilding a single context whenever two
+ * consecutive frames differ. frames larger than hook_slice_min_pixels are
+ * cut in horizontal slices converted by helper threads owned by the worker.
+ */
+typedef struct FrameScaler {
+    ScalerCacheEntry cache[SCALER_CACHE_SIZE];
+    int nb_cached;
+    int64_t clock;
+    int64_t nb_created;
+
+    ScalerSlice slices[MAX_HOOK_SLICES];
+    int nb_slices;
+
+    pthread_t *helpers;
+    int nb_helpers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    int generation;
+    int pending;
+    int exiting;
+    int helpers_started;
+} FrameScaler;
+
+typedef struct ScalerHelper {
+    FrameScaler *fs;
+    int index;
+} ScalerHelper;
+
+static struct SwsContext *frame_scaler_get_context(FrameScaler *fs, const ScalerKey *key)
+{
+    ScalerCacheEntry *e, *victim = NULL;
+    int i;
+
+    fs->clock++;
+    for (i = 0; i < fs->nb_cached; i++) {
+        e = &fs->cache[i];
+        if (!memcmp(&e->key, key, sizeof(*key))) {
+            e->last_used = fs->clock;
+            return e->sws;
+        }
+        if (!victim || e->last_used < victim->last_used)
+            victim = e;
     }
 
-    ist->nb_samples = decoded_frame->nb_samples;
-    // err = send_frame_to_filters(ist, decoded_frame);
+    if (fs->nb_cached < SCALER_CACHE_SIZE)
+        victim = &fs->cache[fs->nb_cached++];
+    else
+        sws_freeContext(victim->sws);
+
+    victim->key       = *key;
+    victim->last_used = fs->clock;
+    victim->sws       = sws_getContext(key->src_w, key->src_h, key->src_format,
+                                       key->dst_w, key->dst_h, key->dst_format,
+                                       key->flags, NULL, NULL, NULL);
+    fs->nb_created++;
+    if (!victim->sws) {
+        // keep the slot consistent, a NULL context is simply looked up again
+        memset(&victim->key, 0, sizeof(victim->key));
+        return NULL;
+    }
+    return victim->sws;
+}
+
+static void scaler_slice_run(ScalerSlice *sl)
+{
+    sws_scale(sl->sws, sl->src, sl->src_linesize, 0, sl->height, sl->dst, sl->dst_linesize);
+}
+
+static void *scaler_helper_proc(void *arg)
+{
+    ScalerHelper *h = arg;
+    FrameScaler *fs = h->fs;
+    int generation = 0;
+
+    pthread_mutex_lock(&fs->lock);
+    while (1) {
+        while (fs->generation == generation && !fs->exiting)
+            pthread_cond_wait(&fs->cond, &fs->lock);
+        if (fs->exiting)
+            break;
+        generation = fs->generation;
+        if (h->index >= fs->nb_slices)
+            continue;
+
+        pthread_mutex_unlock(&fs->lock);
+        scaler_slice_run(&fs->slices[h->index]);
+        pthread_mutex_lock(&fs->lock);
 
+        if (!--fs->pending)
+            pthread_cond_signal(&fs->done_cond);
+    }
+    pthread_mutex_unlock(&fs->lock);
+
+    av_free(h);
+    return NULL;
+}
 
+static void frame_scaler_init(FrameScaler *fs)
+{
+    memset(fs, 0, sizeof(*fs));
+    pthread_mutex_init(&fs->lock, NULL);
+    pthread_cond_init(&fs->cond, NULL);
+    pthread_cond_init(&fs->done_cond, NULL);
+}
 
+/* helpers are only started once the worker meets its first large frame */
+static void frame_scaler_start_helpers(FrameScaler *fs)
+{
+    int i, ret, nb = FFMIN(hook_slices, MAX_HOOK_SLICES) - 1;
 
+    fs->helpers_started = 1;
+    fs->helpers = av_mallocz_array(nb, sizeof(*fs->helpers));
+    if (!fs->helpers)
+        return;
 
-    av_frame_unref(decoded_frame);
-    return err < 0 ? err : ret;
+    for (i = 0; i < nb; i++) {
+        ScalerHelper *h = av_mallocz(sizeof(*h));
+        if (!h)
+            break;
+        h->fs    = fs;
+        h->index = i + 1;
+        if ((ret = pthread_create(&fs->helpers[i], NULL, scaler_helper_proc, h))) {
+            av_log(NULL, AV_LOG_WARNING, "could not start a slice thread: %s\n", strerror(ret));
+            av_free(h);
+            break;
+        }
+        fs->nb_helpers++;
+    }
+}
+
+static void frame_scaler_free(FrameScaler *fs)
+{
+    int i;
+
+    pthread_mutex_lock(&fs->lock);
+    fs->exiting = 1;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+    for (i = 0; i < fs->nb_helpers; i++)
+        pthread_join(fs->helpers[i], NULL);
+    av_freep(&fs->helpers);
+    fs->nb_helpers = 0;
+
+    for (i = 0; i < fs->nb_cached; i++)
+        sws_freeContext(fs->cache[i].sws);
+    fs->nb_cached = 0;
+
+    pthread_cond_destroy(&fs->done_cond);
+    pthread_cond_destroy(&fs->cond);
+    pthread_mutex_destroy(&fs->lock);
+}
+
+/* rows of plane p of a frame starting at luma row y */
+static void frame_scaler_offset_planes(const AVPixFmtDescriptor *desc, uint8_t *const data[4],
+                                       const int linesize[4], int y, uint8_t *out[4])
+{
+    int p;
+
+    for (p = 0; p < 4; p++) {
+        int shift = (p == 1 || p == 2) ? desc->log2_chroma_h : 0;
+        out[p] = data[p] ? data[p] + (ptrdiff_t)(y >> shift) * linesize[p] : NULL;
+    }
+}
+
+/*
+ * converts src into dst. only conversions that keep the height are sliced,
+ * a slice then maps to the same rows on both sides; downscaling for
+ * thumbnails is cheap enough to stay on one core.
+ */
+static int frame_scaler_scale(FrameScaler *fs, const AVFrame *src,
+                              uint8_t *dst_data[4], int dst_linesize[4],
+                              int dst_w, int dst_h, enum AVPixelFormat dst_format, int flags)
+{
+    const AVPixFmtDescriptor *src_desc = av_pix_fmt_desc_get(src->format);
+    const AVPixFmtDescriptor *dst_desc = av_pix_fmt_desc_get(dst_format);
+    int nb_slices = 1, slice_h = src->height;
+    ScalerKey key;
+    int i, y;
+
+    if (!src_desc || !dst_desc)
+        return AVERROR(EINVAL);
+
+    if (hook_slices > 1 && src->height == dst_h &&
+        (int64_t)src->width * src->height > hook_slice_min_pixels &&
+        !(src_desc->flags & AV_PIX_FMT_FLAG_PAL) && !(dst_desc->flags & AV_PIX_FMT_FLAG_PAL)) {
+        if (!fs->helpers_started)
+            frame_scaler_start_helpers(fs);
+        nb_slices = fs->nb_helpers + 1;
+        slice_h   = FFALIGN((src->height + nb_slices - 1) / nb_slices, HOOK_SLICE_ALIGN);
+        nb_slices = (src->height + slice_h - 1) / slice_h;
+    }
+
+    for (i = 0, y = 0; i < nb_slices; i++, y += slice_h) {
+        ScalerSlice *sl = &fs->slices[i];
+        uint8_t *src_planes[4];
+
+        sl->height = FFMIN(slice_h, src->height - y);
+
+        memset(&key, 0, sizeof(key));
+        key.src_w      = src->width;
+        key.src_h      = nb_slices > 1 ? sl->height : src->height;
+        key.src_format = src->format;
+        key.dst_w      = dst_w;
+        key.dst_h      = nb_slices > 1 ? sl->height : dst_h;
+        key.dst_format = dst_format;
+        key.flags      = flags;
+        key.slice      = i;
+        sl->sws = frame_scaler_get_context(fs, &key);
+        if (!sl->sws)
+            return AVERROR(EINVAL);
+
+        frame_scaler_offset_planes(src_desc, (uint8_t * const *)src->data, src->linesize, y, src_planes);
+        frame_scaler_offset_planes(dst_desc, dst_data, dst_linesize, y, sl->dst);
+        memcpy(sl->src, src_planes, sizeof(sl->src));
+        memcpy(sl->src_linesize, src->linesize, sizeof(sl->src_linesize));
+        memcpy(sl->dst_linesize, dst_linesize, sizeof(sl->dst_linesize));
+    }
+    if (nb_slices == 1) {
+        scaler_slice_run(&fs->slices[0]);
+        return 0;
+    }
+
+    pthread_mutex_lock(&fs->lock);
+    fs->nb_slices = nb_slices;
+    fs->pending   = nb_slices - 1;
+    fs->generation++;
+    pthread_cond_broadcast(&fs->cond);
+    pthread_mutex_unlock(&fs->lock);
+
+    scaler_slice_run(&fs->slices[0]);
+
+    pthread_mutex_lock(&fs->lock);
+    while (fs->pending)
+        pthread_cond_wait(&fs->done_cond, &fs->lock);
+    pthread_mutex_unlock(&fs->lock);
+
+    return 0;
+}
+
+
+/* numbers the snapshots across all hook workers */
+static atomic_int_least64_t snapshot_seq;
+
+/*
+ * one image produced from every hooked frame, -snapshot_output adds more:
+ * a full size jpeg and a thumbnail are scaled from the same source planes
+ */
+typedef struct SnapshotOutput {
+    const char *format;
+    const char *name;
+    int width, height;          /* 0 keeps the source size, -1 keeps the aspect ratio */
+    int sws_flags;
+    int quality;
+    enum AVPixelFormat pix_fmt; /* shm only, AV_PIX_FMT_NONE keeps the decoder's */
+    int nb_slots;               /* shm only */
+    AVDictionary *opts;         /* holds the strings of the spec */
+
+    /* summed over the hook workers at exit */
+    int64_t nb_snapshots;
+    int64_t nb_bytes;
+    int64_t encode_time;
+} SnapshotOutput;
+
+static SnapshotOutput *snapshot_outputs;
+static int nb_snapshot_outputs;
+static const char **snapshot_output_specs;  /* parsed once all the options are known */
+static int nb_snapshot_output_specs;
+
+static const struct {
+    const char *name;
+    int flags;
+} scale_algorithms[] = {
+    { "fast_bilinear", SWS_FAST_BILINEAR },
+    { "bilinear",      SWS_BILINEAR      },
+    { "bicubic",       SWS_BICUBIC       },
+    { "area",          SWS_AREA          },
+    { "point",         SWS_POINT         },
+    { "lanczos",       SWS_LANCZOS       },
+};
+
+static int parse_scale_algorithm(const char *name)
+{
+    int i;
+
+    for (i = 0; i < FF_ARRAY_ELEMS(scale_algorithms); i++)
+        if (!strcmp(name, scale_algorithms[i].name))
+            return scale_algorithms[i].flags;
+
+    av_log(NULL, AV_LOG_ERROR, "unknown scaling algorithm %s\n", name);
+    return AVERROR(EINVAL);
+}
+
+static int parse_snapshot_size(const char *arg, int *width, int *height)
+{
+    if (sscanf(arg, "%dx%d", width, height) != 2 ||
+        *width < -1 || *height < -1 || (*width < 0 && *height < 0)) {
+        av_log(NULL, AV_LOG_ERROR, "invalid snapshot size %s, expected WxH with -1 to keep the aspect ratio\n", arg);
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+const char *snapshot_scale = "bicubic";
+const char *snapshot_size;
+
+/* "format=jpeg:size=320x180:scale=area:quality=5:name=thumb_%N.%E" */
+static int add_snapshot_output(const char *spec)
+{
+    AVDictionaryEntry *e = NULL;
+    SnapshotOutput *o;
+    int ret;
+
+    GROW_ARRAY(snapshot_outputs, nb_snapshot_outputs);
+    o = &snapshot_outputs[nb_snapshot_outputs - 1];
+    o->format  = snapshot_format;
+    o->name    = snapshot_name;
+    o->quality = snapshot_quality;
+    o->pix_fmt  = AV_PIX_FMT_NONE;
+    o->nb_slots = 4;
+    ret = parse_scale_algorithm(snapshot_scale);
+    if (ret < 0)
+        goto fail;
+    o->sws_flags = ret;
+    if (snapshot_size && (ret = parse_snapshot_size(snapshot_size, &o->width, &o->height)) < 0)
+        goto fail;
+
+    if (spec && (ret = av_dict_parse_string(&o->opts, spec, "=", ":", 0)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "invalid snapshot output %s\n", spec);
+        goto fail;
+    }
+
+    while ((e = av_dict_get(o->opts, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        if (!strcmp(e->key, "format")) {
+            o->format = e->value;
+        } else if (!strcmp(e->key, "name")) {
+            o->name = e->value;
+        } else if (!strcmp(e->key, "quality")) {
+            o->quality = atoi(e->value);
+        } else if (!strcmp(e->key, "pix_fmt")) {
+            if ((o->pix_fmt = av_get_pix_fmt(e->value)) == AV_PIX_FMT_NONE) {
+                av_log(NULL, AV_LOG_ERROR, "unknown pixel format %s\n", e->value);
+                ret = AVERROR(EINVAL);
+                goto fail;
+            }
+        } else if (!strcmp(e->key, "slots")) {
+            o->nb_slots = av_clip(atoi(e->value), 2, 64);
+        } else if (!strcmp(e->key, "size")) {
+            if ((ret = parse_snapshot_size(e->value, &o->width, &o->height)) < 0)
+                goto fail;
+        } else if (!strcmp(e->key, "scale")) {
+            if ((ret = parse_scale_algorithm(e->value)) < 0)
+                goto fail;
+            o->sws_flags = ret;
+        } else {
+            av_log(NULL, AV_LOG_ERROR, "unknown snapshot output option %s\n", e->key);
+            ret = AVERROR(EINVAL);
+            goto fail;
+        }
+    }
+
+    // the default file name would give every stream one and the same ring
+    if (!strcmp(o->format, "shm") && o->name == default_snapshot_name)
+        o->name = "/stream_push_%S_%I";
+
+    return 0;
+
+fail:
+    av_dict_free(&o->opts);
+    nb_snapshot_outputs--;
+    return ret;
+}
+
+/* size of the image written for a frame, even where the other side follows the aspect ratio */
+static void snapshot_output_size(const SnapshotOutput *o, const AVFrame *frame, int *width, int *height)
+{
+    *width  = o->width  ? o->width  : frame->width;
+    *height = o->height ? o->height : frame->height;
+
+    if (o->width < 0)
+        *width  = FFMAX(2, av_rescale(*height, frame->width, frame->height) & ~1);
+    if (o->height < 0)
+        *height = FFMAX(2, av_rescale(*width, frame->height, frame->width) & ~1);
+}
+
+/*
+ * turns hooked frames into image files for one SnapshotOutput: bmp is
+ * written by BmpWriter from a BGR24 conversion, every other format goes
+ * through a libavcodec image encoder, fed with the decoder's own pixel
+ * format whenever it accepts it and no scaling is asked for
+ */
+typedef struct SnapshotWriter {
+    const SnapshotOutput *output;
+    const AVCodec *codec;       /* NULL for bmp */
+    const char *extension;
+    AVCodecContext *enc;
+    enum AVPixelFormat src_format;
+
+    FrameScaler *scaler;        /* the hook worker's, shared by its writers */
+    AVFrame *converted;         /* only used when the encoder cannot take the frame as is */
+    AVFrame *ref;               /* otherwise, so that pts and quality stay off the shared frame */
+    AVPacket pkt;
+    BmpWriter bmp;
+
+    int64_t nb_snapshots;
+    int64_t nb_bytes;
+    int64_t encode_time;
+} SnapshotWriter;
+
+static int snapshot_writer_init(SnapshotWriter *w, const SnapshotOutput *output, FrameScaler *scaler)
+{
+    const char *format = output->format;
+
+    memset(w, 0, sizeof(*w));
+    w->output = output;
+    w->scaler = scaler;
+    av_init_packet(&w->pkt);
+    w->src_format = AV_PIX_FMT_NONE;
+
+    if (!strcmp(format, "bmp")) {
+        w->extension = "bmp";
+        return 0;
+    } else if (!strcmp(format, "shm")) {
+        w->extension = "shm";
+        return 0;
+    } else if (!strcmp(format, "jpeg") || !strcmp(format, "jpg")) {
+        w->codec     = avcodec_find_encoder(AV_CODEC_ID_MJPEG);
+        w->extension = "jpg";
+    } else if (!strcmp(format, "png")) {
+        w->codec     = avcodec_find_encoder(AV_CODEC_ID_PNG);
+        w->extension = "png";
+    } else if (!strcmp(format, "webp")) {
+        w->codec     = avcodec_find_encoder_by_name("libwebp");
+        if (!w->codec)
+            w->codec = avcodec_find_encoder(AV_CODEC_ID_WEBP);
+        w->extension = "webp";
+    } else {
+        av_log(NULL, AV_LOG_ERROR, "unknown snapshot format %s\n", format);
+        return AVERROR(EINVAL);
+    }
+
+    if (!w->codec) {
+        av_log(NULL, AV_LOG_ERROR, "no encoder for snapshot format %s\n", format);
+        return AVERROR_ENCODER_NOT_FOUND;
+    }
+    w->converted = av_frame_alloc();
+    w->ref       = av_frame_alloc();
+    if (!w->converted || !w->ref)
+        return AVERROR(ENOMEM);
+
+    return 0;
+}
+
+static void snapshot_writer_free(SnapshotWriter *w)
+{
+    avcodec_free_context(&w->enc);
+    av_frame_free(&w->converted);
+    av_frame_free(&w->ref);
+    av_packet_unref(&w->pkt);
+    bmp_writer_free(&w->bmp);
+}
+
+/* (re)open the encoder for the size and pixel format of the incoming frames */
+static int snapshot_writer_open_encoder(SnapshotWriter *w, const AVFrame *frame, int width, int height)
+{
+    const AVCodec *codec = w->codec;
+    int quality = w->output->quality;
+    AVDictionary *opts = NULL;
+    enum AVPixelFormat pix_fmt = frame->format;
+    int ret;
+
+    avcodec_free_context(&w->enc);
+
+    // take the frame as it is when possible, convert to the least lossy format else
+    if (codec->pix_fmts)
+        pix_fmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, frame->format, 0, NULL);
+
+    w->enc = avcodec_alloc_context3(codec);
+    if (!w->enc)
+        return AVERROR(ENOMEM);
+    w->enc->width       = width;
+    w->enc->height      = height;
+    w->enc->pix_fmt     = pix_fmt;
+    w->enc->time_base   = (AVRational){ 1, 25 };
+    if (pix_fmt == frame->format)
+        w->enc->color_range = frame->color_range;
+    if (width == frame->width && height == frame->height)
+        w->enc->sample_aspect_ratio = frame->sample_aspect_ratio;
+
+    if (codec->id == AV_CODEC_ID_MJPEG) {
+        // limited range yuv straight from the camera decoder, no detour through a yuvj copy
+        w->enc->strict_std_compliance = FF_COMPLIANCE_UNOFFICIAL;
+        if (quality >= 0) {
+            w->enc->flags |= AV_CODEC_FLAG_QSCALE;
+            w->enc->global_quality = quality * FF_QP2LAMBDA;
+        }
+    } else if (codec->id == AV_CODEC_ID_PNG) {
+        if (quality >= 0)
+            w->enc->compression_level = quality;
+    } else if (quality >= 0) {
+        av_dict_set_int(&opts, "quality", quality, 0);
+    }
+
+    ret = avcodec_open2(w->enc, codec, &opts);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "could not open %s snapshot encoder for %dx%d %s: %s\n",
+               codec->name, width, height, av_get_pix_fmt_name(pix_fmt), av_err2str(ret));
+        avcodec_free_context(&w->enc);
+        return ret;
+    }
+
+    w->src_format = frame->format;
+    return 0;
+}
+
+static int snapshot_writer_encode(SnapshotWriter *w, AVFrame *frame, int width, int height,
+                                  const char *filename, int64_t *bytes)
+{
+    AVFrame *in;
+    int ret;
+
+    if (!w->enc || w->src_format != frame->format ||
+        w->enc->width != width || w->enc->height != height) {
+        ret = snapshot_writer_open_encoder(w, frame, width, height);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (w->enc->pix_fmt != frame->format || width != frame->width || height != frame->height) {
+        if (w->converted->width != width || w->converted->height != height ||
+            w->converted->format != w->enc->pix_fmt) {
+            av_frame_unref(w->converted);
+            w->converted->format = w->enc->pix_fmt;
+            w->converted->width  = width;
+            w->converted->height = height;
+            ret = av_frame_get_buffer(w->converted, 32);
+            if (ret < 0)
+                return ret;
+        }
+        ret = av_frame_make_writable(w->converted);
+        if (ret < 0)
+            return ret;
+        ret = frame_scaler_scale(w->scaler, frame, w->converted->data, w->converted->linesize,
+                                 width, height, w->enc->pix_fmt, w->output->sws_flags);
+        if (ret < 0)
+            return ret;
+        in = w->converted;
+    } else {
+        // the other writers of the frame still read its pts
+        ret = av_frame_ref(w->ref, frame);
+        if (ret < 0)
+            return ret;
+        in = w->ref;
+    }
+
+    in->pts = w->nb_snapshots;
+    if (w->enc->flags & AV_CODEC_FLAG_QSCALE)
+        in->quality = w->enc->global_quality;
+
+    ret = avcodec_send_frame(w->enc, in);
+    av_frame_unref(w->ref);
+    if (ret < 0)
+        return ret;
+
+    while ((ret = avcodec_receive_packet(w->enc, &w->pkt)) >= 0) {
+        ret = write_file(filename, w->pkt.data, w->pkt.size);
+        *bytes += w->pkt.size;
+        av_packet_unref(&w->pkt);
+        if (ret < 0)
+            return ret;
+    }
+
+    return ret == AVERROR(EAGAIN) ? 0 : ret;
+}
+
+static int snapshot_writer_write_bmp(SnapshotWriter *w, AVFrame *frame, int width, int height,
+                                     const char *filename, int64_t *bytes)
+{
+    uint8_t *dst_data[4];
+    int dst_linesize[4];
+    int ret;
+
+    ret = bmp_writer_prepare(&w->bmp, width, height);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "Could not allocate destination image\n");
+        return ret;
+    }
+
+    bmp_writer_get_dst(&w->bmp, dst_data, dst_linesize);
+    ret = frame_scaler_scale(w->scaler, frame, dst_data, dst_linesize,
+                             width, height, AV_PIX_FMT_BGR24, w->output->sws_flags);
+    if (ret < 0)
+        return ret;
+
+    ret = bmp_writer_write(&w->bmp, filename);
+    if (ret >= 0)
+        *bytes += w->bmp.file_size;
+    return ret;
+}
+
+/*
+ * expands the snapshot name pattern: %S session index, %I stream index,
+ * %T pts in milliseconds, %N snapshot sequence number, %W and %H the
+ * image size, %E file extension
+ */
+static void snapshot_filename(char *buf, int size, const char *pattern, const AVFrame *frame,
+                              int64_t seq, int width, int height, const char *ext)
+{
+    const char *p;
+
+    buf[0] = 0;
+    for (p = pattern; *p; p++) {
+        if (*p != '%' || !p[1]) {
+            av_strlcatf(buf, size, "%c", *p);
+            continue;
+        }
+        switch (*++p) {
+        case 'S': av_strlcatf(buf, size, "%d", HOOK_FRAME_SESSION(frame)); break;
+        case 'I': av_strlcatf(buf, size, "%d", HOOK_FRAME_STREAM(frame));  break;
+        case 'T': av_strlcatf(buf, size, "%"PRId64,
+                              frame->pts == AV_NOPTS_VALUE ? 0 : frame->pts / 1000); break;
+        case 'N': av_strlcatf(buf, size, "%"PRId64, seq); break;
+        case 'W': av_strlcatf(buf, size, "%d", width);  break;
+        case 'H': av_strlcatf(buf, size, "%d", height); break;
+        case 'E': av_strlcatf(buf, size, "%s", ext); break;
+        default:  av_strlcatf(buf, size, "%c", *p); break;
+        }
+    }
+}
+
+/*
+ * shared memory rings frames are published to, one per expanded name and
+ * so normally one per stream. hook workers publishing to the same ring take
+ * turns on its lock, readers never take it.
+ */
+typedef struct PublishedRing {
+    char name[256];
+    FrameRing ring;
+    pthread_mutex_t lock;
+} PublishedRing;
+
+static PublishedRing **published_rings;
+static int nb_published_rings;
+static pthread_mutex_t published_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static PublishedRing *get_published_ring(const char *name)
+{
+    PublishedRing *r = NULL;
+    int i;
+
+    pthread_mutex_lock(&published_rings_lock);
+    for (i = 0; i < nb_published_rings; i++)
+        if (!strcmp(published_rings[i]->name, name)) {
+            r = published_rings[i];
+            goto end;
+        }
+
+    r = av_mallocz(sizeof(*r));
+    if (!r)
+        goto end;
+    av_strlcpy(r->name, name, sizeof(r->name));
+    pthread_mutex_init(&r->lock, NULL);
+    GROW_ARRAY(published_rings, nb_published_rings);
+    published_rings[nb_published_rings - 1] = r;
+end:
+    pthread_mutex_unlock(&published_rings_lock);
+    return r;
+}
+
+static void free_published_rings(void)
+{
+    int i;
+
+    for (i = 0; i < nb_published_rings; i++) {
+        frame_ring_destroy(&published_rings[i]->ring);
+        pthread_mutex_destroy(&published_rings[i]->lock);
+        av_freep(&published_rings[i]);
+    }
+    av_freep(&published_rings);
+    nb_published_rings = 0;
+}
+
+/* copies or scales the frame straight into the next slot of the ring */
+static int snapshot_writer_publish(SnapshotWriter *w, AVFrame *frame, int width, int height,
+                                   const char *name, int64_t *bytes)
+{
+    const SnapshotOutput *o = w->output;
+    enum AVPixelFormat pix_fmt = o->pix_fmt != AV_PIX_FMT_NONE ? o->pix_fmt : frame->format;
+    FrameRingSlotHeader *slot;
+    PublishedRing *r;
+    uint8_t *data, *planes[4];
+    int linesizes[4];
+    int size, i, ret;
+
+    size = av_image_get_buffer_size(pix_fmt, width, height, 32);
+    if (size < 0)
+        return size;
+
+    r = get_published_ring(name);
+    if (!r)
+        return AVERROR(ENOMEM);
+
+    pthread_mutex_lock(&r->lock);
+
+    // readers holding the old ring see it closed and map the new one
+    if (!r->ring.header || r->ring.header->slot_data_size < size) {
+        if (r->ring.header)
+            av_log(NULL, AV_LOG_INFO, "frame ring %s grows to %d bytes per slot\n", name, size);
+        frame_ring_destroy(&r->ring);
+        ret = frame_ring_create(&r->ring, name, o->nb_slots, size);
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "could not create frame ring %s: %s\n", name, av_err2str(ret));
+            goto end;
+        }
+    }
+
+    data = frame_ring_write_begin(&r->ring, &slot);
+    av_image_fill_arrays(planes, linesizes, data, pix_fmt, width, height, 32);
+    if (pix_fmt == frame->format && width == frame->width && height == frame->height) {
+        av_image_copy(planes, linesizes, (const uint8_t **)frame->data, frame->linesize,
+                      pix_fmt, width, height);
+    } else {
+        ret = frame_scaler_scale(w->scaler, frame, planes, linesizes,
+                                 width, height, pix_fmt, o->sws_flags);
+        if (ret < 0) {
+            frame_ring_write_abort(slot);
+            goto end;
+        }
+    }
+
+    slot->nb_planes = av_pix_fmt_count_planes(pix_fmt);
+    for (i = 0; i < 4; i++) {
+        slot->linesize[i] = planes[i] ? linesizes[i] : 0;
+        slot->offset[i]   = planes[i] ? planes[i] - data : 0;
+    }
+    slot->width     = width;
+    slot->height    = height;
+    slot->format    = pix_fmt;
+    slot->pts       = frame->pts == AV_NOPTS_VALUE ? FRAME_RING_NOPTS : frame->pts;
+    slot->data_size = size;
+    frame_ring_write_end(&r->ring, slot);
+
+    *bytes += size;
+    ret = 0;
+end:
+    pthread_mutex_unlock(&r->lock);
+    return ret;
+}
+
+static int snapshot_writer_write(SnapshotWriter *w, AVFrame *frame, int64_t seq)
+{
+    char filename[1024];
+    int64_t bytes = 0, t;
+    int width, height;
+    int ret;
+
+    snapshot_output_size(w->output, frame, &width, &height);
+    // shared memory object names are a single component starting with a slash
+    if (!w->codec && !strcmp(w->extension, "shm") && w->output->name[0] != '/')
+        snprintf(filename, sizeof(filename), "/");
+    else
+        filename[0] = 0;
+    snapshot_filename(filename + strlen(filename), sizeof(filename) - strlen(filename),
+                      w->output->name, frame, seq, width, height, w->extension);
+
+    t = av_gettime_relative();
+    if (w->codec)
+        ret = snapshot_writer_encode(w, frame, width, height, filename, &bytes);
+    else if (!strcmp(w->extension, "shm"))
+        ret = snapshot_writer_publish(w, frame, width, height, filename, &bytes);
+    else
+        ret = snapshot_writer_write_bmp(w, frame, width, height, filename, &bytes);
+    t = av_gettime_relative() - t;
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "snapshot %s from %dx%d %s failed: %s\n", filename,
+               frame->width, frame->height, av_get_pix_fmt_name(frame->format), av_err2str(ret));
+        return ret;
+    }
+
+    w->nb_snapshots++;
+    w->nb_bytes    += bytes;
+    w->encode_time += t;
+    av_log(NULL, AV_LOG_VERBOSE, "snapshot %s: %dx%d from %dx%d %s, %"PRId64" bytes in %.2f ms\n",
+           filename, width, height, frame->width, frame->height,
+           av_get_pix_fmt_name(frame->format), bytes, t / 1000.0);
+
+    return 0;
+}
+
+
+/* hook workers all take frames from the same queue, each with its own writers */
+typedef struct HookWorker {
+    int index;
+    pthread_t thread;
+    FrameScaler scaler;
+    SnapshotWriter *writers;    /* one per snapshot output */
+} HookWorker;
+
+static FrameQueue hook_queue;
+static HookWorker *hook_workers;
+static int nb_running_hook_workers;
+int64_t hook_queue_max_bytes = 32 * 1024 * 1024;
+
+
+static void *hook_thread_proc(void *arg)
+{
+
+    AVFrame* frame=NULL;
+    HookWorker *worker = arg;
+    int64_t seq;
+        int ret = 0, i;
+    av_log(NULL,AV_LOG_VERBOSE,"start the hook thread %d\n", worker->index);
+    while(1){
+
+        ret = frame_queue_get(&hook_queue, &frame);
+
+        if (ret == AVERROR_EOF)
+            break;
+
+        // every output is made from the same decoded planes, in one go
+        seq = atomic_fetch_add(&snapshot_seq, 1);
+        for (i = 0; i < nb_snapshot_outputs; i++)
+            snapshot_writer_write(&worker->writers[i], frame, seq);
+
+        // hands the decoder buffers back and keeps the shell for the next frame
+        frame_queue_recycle(&hook_queue, frame);
+
+
+
+
+    }
+    av_log(NULL,AV_LOG_ERROR,"end the thread\n");
+    return NULL;
+
+}
+
+static void free_hook_threads(void);
+
+static void hook_worker_free(HookWorker *worker)
+{
+    int i;
+
+    if (worker->writers)
+        for (i = 0; i < nb_snapshot_outputs; i++)
+            snapshot_writer_free(&worker->writers[i]);
+    av_freep(&worker->writers);
+    frame_scaler_free(&worker->scaler);
+}
+
+static int hook_worker_init(HookWorker *worker, int index)
+{
+    int i, ret;
+
+    worker->index = index;
+    frame_scaler_init(&worker->scaler);
+    worker->writers = av_mallocz_array(nb_snapshot_outputs, sizeof(*worker->writers));
+    if (!worker->writers)
+        return AVERROR(ENOMEM);
+
+    for (i = 0; i < nb_snapshot_outputs; i++) {
+        ret = snapshot_writer_init(&worker->writers[i], &snapshot_outputs[i], &worker->scaler);
+        if (ret < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static int init_hook_threads(void)
+{
+    int i, ret;
+
+    for (i = 0; i < nb_snapshot_output_specs; i++)
+        if ((ret = add_snapshot_output(snapshot_output_specs[i])) < 0)
+            return ret;
+    if (!nb_snapshot_outputs && (ret = add_snapshot_output(NULL)) < 0)
+        return ret;
+
+    ret = frame_queue_init(&hook_queue, hook_queue_max_bytes);
+    if (ret < 0)
+        return ret;
+
+    hook_workers = av_mallocz_array(nb_hook_workers, sizeof(*hook_workers));
+    if (!hook_workers) {
+        frame_queue_free(&hook_queue);
+        return AVERROR(ENOMEM);
+    }
+
+    for (i = 0; i < nb_hook_workers; i++) {
+        HookWorker *worker = &hook_workers[i];
+
+        ret = hook_worker_init(worker, i);
+        if (ret < 0) {
+            hook_worker_free(worker);
+            break;
+        }
+        if ((ret = pthread_create(&worker->thread, NULL, hook_thread_proc, worker))) {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed: %s. Try to increase `ulimit -v` or decrease `ulimit -s`.\n", strerror(ret));
+            hook_worker_free(worker);
+            ret = AVERROR(ret);
+            break;
+        }
+        nb_running_hook_workers++;
+    }
+
+    if (ret < 0) {
+        free_hook_threads();
+        return ret;
+    }
+
+    return 0;
+}
+
+static void free_hook_threads(void)
+{
+    int64_t nb_scalers = 0;
+    int i, j;
+
+    if (!hook_workers)
+        return;
+
+    frame_queue_finish(&hook_queue);
+    for (i = 0; i < nb_running_hook_workers; i++) {
+        HookWorker *worker = &hook_workers[i];
+
+        pthread_join(worker->thread, NULL);
+        for (j = 0; j < nb_snapshot_outputs; j++) {
+            snapshot_outputs[j].nb_snapshots += worker->writers[j].nb_snapshots;
+            snapshot_outputs[j].nb_bytes     += worker->writers[j].nb_bytes;
+            snapshot_outputs[j].encode_time  += worker->writers[j].encode_time;
+        }
+        nb_scalers += worker->scaler.nb_created;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "hook: %"PRId64" frames queued, %"PRId64" dropped, "
+           "peak %"PRId64" bytes queued, %d workers, %"PRId64" scaler contexts built\n",
+           hook_queue.nb_frames, hook_queue.nb_dropped, hook_queue.peak_bytes,
+           nb_running_hook_workers, nb_scalers);
+    for (j = 0; j < nb_snapshot_outputs; j++) {
+        SnapshotOutput *o = &snapshot_outputs[j];
+        if (!o->nb_snapshots)
+            continue;
+        av_log(NULL, AV_LOG_INFO, "hook: %s: %"PRId64" %s snapshots, %"PRId64" bytes, "
+               "%.2f ms and %"PRId64" bytes per snapshot on average\n",
+               o->name, o->nb_snapshots, o->format, o->nb_bytes,
+               o->encode_time / 1000.0 / o->nb_snapshots, o->nb_bytes / o->nb_snapshots);
+    }
+
+    for (i = 0; i < nb_running_hook_workers; i++)
+        hook_worker_free(&hook_workers[i]);
+    nb_running_hook_workers = 0;
+    av_freep(&hook_workers);
+    frame_queue_free(&hook_queue);
+    free_published_rings();
+
+    for (j = 0; j < nb_snapshot_outputs; j++)
+        av_dict_free(&snapshot_outputs[j].opts);
+    av_freep(&snapshot_outputs);
+    nb_snapshot_outputs = 0;
+    av_freep(&snapshot_output_specs);
+}
+
+
+/*
+ * in keyframe snapshot mode non-key packets never reach the decoder, and
+ * keyframes only when snapshot_interval has passed since the last one
+ */
+static int keyframe_snapshot_due(StreamSession *s, InputStream *ist, const AVPacket *pkt)
+{
+    int64_t ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    int64_t interval = s->snapshot_interval;
+
+    if (!(pkt->flags & AV_PKT_FLAG_KEY))
+        return 0;
+    if (ts == AV_NOPTS_VALUE)
+        return 1;
+
+    ts = ts_convert(&ist->ts_us, ts);
+    // a timestamp going backwards is a discontinuity, take the keyframe
+    if (ist->last_snapshot_ts != AV_NOPTS_VALUE &&
+        ts >= ist->last_snapshot_ts && ts - ist->last_snapshot_ts < interval)
+        return 0;
+
+    ist->last_snapshot_ts = ts;
+    return 1;
+}
+
+/*
+ * only used for frames that are not refcounted: the pixels are copied into a
+ * buffer from a per-stream pool so that steady state does not hit malloc
+ */
+static int hook_frame_copy(InputStream *ist, AVFrame *dst, const AVFrame *src)
+{
+    int size = av_image_get_buffer_size(src->format, src->width, src->height, 32);
+    int ret;
+
+    if (size < 0)
+        return size;
+
+    if (!ist->hook_pool || ist->hook_pool_size != size) {
+        // buffers still in flight keep the old pool alive until they come back
+        av_buffer_pool_uninit(&ist->hook_pool);
+        ist->hook_pool = av_buffer_pool_init(size, NULL);
+        if (!ist->hook_pool)
+            return AVERROR(ENOMEM);
+        ist->hook_pool_size = size;
+    }
+
+    dst->buf[0] = av_buffer_pool_get(ist->hook_pool);
+    if (!dst->buf[0])
+        return AVERROR(ENOMEM);
+    ret = av_image_fill_arrays(dst->data, dst->linesize, dst->buf[0]->data,
+                               src->format, src->width, src->height, 32);
+    if (ret < 0)
+        return ret;
+    av_image_copy(dst->data, dst->linesize, (const uint8_t **)src->data, src->linesize,
+                  src->format, src->width, src->height);
+
+    dst->format = src->format;
+    dst->width  = src->width;
+    dst->height = src->height;
+    ist->nb_hook_copies++;
+
+    return av_frame_copy_props(dst, src);
+}
+
+/*
+ * the timeline of a stream is cut into snapshot_interval long slots and the
+ * first frame of every slot is hooked, so the snapshot rate does not depend on
+ * the frame rate. ts is the frame pts in AV_TIME_BASE units. without alignment
+ * the slots start at the first frame, with it they are placed on the wall clock
+ * (the rtcp sender reports when the source has them, the arrival time else).
+ */
+static int snapshot_due(StreamSession *s, InputStream *ist, int64_t ts)
+{
+    int64_t interval = s->snapshot_interval;  // may change under us, read it once
+    int64_t slot, t;
+
+    if (interval <= 0)
+        return 1;
+
+    if (ist->snapshot_ts_offset == AV_NOPTS_VALUE) {
+        if (!snapshot_align)
+            ist->snapshot_ts_offset = -ts;
+        else if (s->ic->start_time_realtime != AV_NOPTS_VALUE && s->ic->start_time_realtime > 0)
+            ist->snapshot_ts_offset = s->ic->start_time_realtime -
+                (s->ic->start_time != AV_NOPTS_VALUE ? s->ic->start_time : 0);
+        else
+            ist->snapshot_ts_offset = av_gettime() - ts;
+        ist->last_snapshot_slot = INT64_MIN;
+    }
+
+    t    = ts + ist->snapshot_ts_offset;
+    slot = t >= 0 ? t / interval : -((interval - 1 - t) / interval);
+    // equal means the slot already has its frame, lower is a timestamp jump
+    if (slot == ist->last_snapshot_slot)
+        return 0;
+    ist->last_snapshot_slot = slot;
+    return 1;
+}
+
+/*
+ * scene change gate: a frame is reduced to SCENE_SIG_W x SCENE_SIG_H luma
+ * samples, each the mean of 16 neighbouring pixels of a row, and compared
+ * with the samples of the last snapshot by their sum of absolute
+ * differences. both steps are a few thousand bytes whatever the frame
+ * size, and happen before any conversion or copy of the frame.
+ */
+static void scene_signature_c(uint8_t *sig, const uint8_t *data, int linesize, int w, int h)
+{
+    int i, j, k;
+
+    for (j = 0; j < SCENE_SIG_H; j++) {
+        const uint8_t *row = data + (ptrdiff_t)((2 * j + 1) * h / (2 * SCENE_SIG_H)) * linesize;
+        for (i = 0; i < SCENE_SIG_W; i++) {
+            const uint8_t *p = row + i * (w - 16) / (SCENE_SIG_W - 1);
+            int sum = 0;
+            for (k = 0; k < 16; k++)
+                sum += p[k];
+            *sig++ = sum >> 4;
+        }
+    }
+}
+
+static int scene_sad_c(const uint8_t *a, const uint8_t *b)
+{
+    int i, sad = 0;
+
+    for (i = 0; i < SCENE_SIG_W * SCENE_SIG_H; i++)
+        sad += FFABS(a[i] - b[i]);
+    return sad;
+}
+
+#if HAVE_SCENE_X86
+__attribute__((target("sse2")))
+static void scene_signature_sse2(uint8_t *sig, const uint8_t *data, int linesize, int w, int h)
+{
+    const __m128i zero = _mm_setzero_si128();
+    int i, j;
+
+    for (j = 0; j < SCENE_SIG_H; j++) {
+        const uint8_t *row = data + (ptrdiff_t)((2 * j + 1) * h / (2 * SCENE_SIG_H)) * linesize;
+        for (i = 0; i < SCENE_SIG_W; i++) {
+            __m128i sum = _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(row + i * (w - 16) / (SCENE_SIG_W - 1))),
+                                       zero);
+            *sig++ = (_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8))) >> 4;
+        }
+    }
+}
+
+__attribute__((target("sse2")))
+static int scene_sad_sse2(const uint8_t *a, const uint8_t *b)
+{
+    __m128i acc = _mm_setzero_si128();
+    int i;
+
+    for (i = 0; i < SCENE_SIG_W * SCENE_SIG_H; i += 16)
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                              _mm_loadu_si128((const __m128i *)(b + i))));
+    return _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+}
+
+__attribute__((target("avx2")))
+static int scene_sad_avx2(const uint8_t *a, const uint8_t *b)
+{
+    __m256i acc = _mm256_setzero_si256();
+    __m128i sum;
+    int i;
+
+    for (i = 0; i < SCENE_SIG_W * SCENE_SIG_H; i += 32)
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                    _mm256_loadu_si256((const __m256i *)(b + i))));
+    sum = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+}
+#endif
+
+static void (*scene_signature)(uint8_t *sig, const uint8_t *data, int linesize, int w, int h) = scene_signature_c;
+static int (*scene_sad)(const uint8_t *a, const uint8_t *b) = scene_sad_c;
+
+static void scene_init(void)
+{
+#if HAVE_SCENE_X86
+    int flags = av_get_cpu_flags();
+
+    if (flags & AV_CPU_FLAG_SSE2) {
+        scene_signature = scene_signature_sse2;
+        scene_sad       = scene_sad_sse2;
+    }
+    if (flags & AV_CPU_FLAG_AVX2)
+        scene_sad       = scene_sad_avx2;
+#endif
+}
+
+/*
+ * whether frame differs enough from the last snapshot of ist to be taken,
+ * the samples of a frame that is taken become the new reference. frames
+ * without an 8 bit luma plane, and tiny ones, are always taken.
+ */
+static int scene_changed(InputStream *ist, const AVFrame *frame)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    uint8_t sig[SCENE_SIG_W * SCENE_SIG_H];
+    int64_t t = av_gettime_relative();
+    int changed;
+
+    if (!desc || desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_HWACCEL) ||
+        desc->comp[0].plane || desc->comp[0].step != 1 || desc->comp[0].depth > 8 ||
+        frame->width < SCENE_SIG_W || frame->height < SCENE_SIG_H || !frame->data[0])
+        return 1;
+
+    scene_signature(sig, frame->data[0], frame->linesize[0], frame->width, frame->height);
+    changed = !ist->has_scene_sig ||
+              scene_sad(sig, ist->scene_sig) >= scene_threshold * SCENE_SIG_W * SCENE_SIG_H;
+    if (changed) {
+        memcpy(ist->scene_sig, sig, sizeof(sig));
+        ist->has_scene_sig = 1;
+    }
+    ist->scene_time += av_gettime_relative() - t;
+    return changed;
+}
+
+/*
+ * hand a decoded frame to the hook thread without copying the pixels: the
+ * queued frame holds a reference on the decoder buffers. when the caller does
+ * not need decoded_frame any more (steal), the reference is moved instead.
+ */
+static int hook_the_frame(StreamSession *s, InputStream *ist, AVFrame *decoded_frame, int steal){
+
+    int ret = 0;
+    AVFrame *frame = decoded_frame;
+
+
+
+    // keyframe mode already decimated on the packet side, for everything
+    // else the decision is taken before touching the frame
+    if (ist->keyframes_only || snapshot_due(s, ist, ist->pts)) {
+        // the interval is used up either way, a static scene waits for the next one
+        if (scene_threshold > 0 && !scene_changed(ist, frame)) {
+            ist->nb_scene_skips++;
+            return 0;
+        }
+
+        AVFrame *clone = frame_queue_get_shell(&hook_queue);
+        if (!clone)
+            return AVERROR(ENOMEM);
+
+        if (!frame->buf[0])
+            ret = hook_frame_copy(ist, clone, frame);
+        else if (steal)
+            av_frame_move_ref(clone, frame);
+        else
+            ret = av_frame_ref(clone, frame);
+        if (ret < 0) {
+            frame_queue_recycle(&hook_queue, clone);
+            return ret;
+        }
+
+        // the hook thread only sees the frame, tell it where it comes from
+        clone->pts    = ist->pts;
+        clone->opaque = HOOK_FRAME_OPAQUE(s->index, ist->st->index);
+
+        ist->nb_hooked_frames++;
+        ret = frame_queue_put(&hook_queue, clone);
+
+    }
+
+    return ret < 0 ? ret : 0;
+
+}
+
+
+/* decode side: queue a reference to the frame for the encode task of the session */
+static int send_frame_to_encoding(StreamSession *s, OutputStream *ost, AVFrame *frame)
+{
+    OutputEncoder *e = ost->encoder;
+    AVFrame *clone = frame_queue_get_shell(&e->queue);
+    int ret;
+
+    if (!clone)
+        return AVERROR(ENOMEM);
+    ret = av_frame_ref(clone, frame);
+    if (ret < 0) {
+        frame_queue_recycle(&e->queue, clone);
+        return ret;
+    }
+
+    ret = frame_queue_put(&e->queue, clone);
+    if (ret > 0)
+        scheduler_wake(&encode_scheduler, &e->task);
+    return ret < 0 ? ret : 0;
+}
+
+/* hand the packets the encoder has ready to the mux queue */
+static int receive_encoded_packets(StreamSession *s, OutputStream *ost)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    AVPacket pkt;
+    int ret;
+
+    av_init_packet(&pkt);
+    pkt.data = NULL;
+    pkt.size = 0;
+
+    while ((ret = avcodec_receive_packet(enc, &pkt)) >= 0) {
+        // pts and dts come from the frames, the encoder only reorders them
+        av_packet_rescale_ts(&pkt, enc->time_base, ost->mux_timebase);
+        write_packet(s, &pkt, ost, 0);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* encode side, runs on the encode scheduler only */
+static int encode_frame(StreamSession *s, OutputStream *ost, AVFrame *frame)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    InputStream *ist = s->input_streams[ost->source_index];
+    AVFrame *in = frame;
+    int64_t t = av_gettime_relative();
+    int ret;
+
+    // renditions scale here, on their own encode task
+    if (frame->format != enc->pix_fmt || frame->width != enc->width || frame->height != enc->height) {
+        ost->sws = sws_getCachedContext(ost->sws, frame->width, frame->height, frame->format,
+                                        enc->width, enc->height, enc->pix_fmt,
+                                        SWS_BICUBIC, NULL, NULL, NULL);
+        if (!ost->sws)
+            return AVERROR(EINVAL);
+        if (!ost->enc_frame) {
+            if (!(ost->enc_frame = av_frame_alloc()))
+                return AVERROR(ENOMEM);
+            ost->enc_frame->format = enc->pix_fmt;
+            ost->enc_frame->width  = enc->width;
+            ost->enc_frame->height = enc->height;
+            if ((ret = av_frame_get_buffer(ost->enc_frame, 32)) < 0)
+                return ret;
+        }
+        // the encoder may still hold the previous picture
+        if ((ret = av_frame_make_writable(ost->enc_frame)) < 0)
+            return ret;
+        sws_scale(ost->sws, (const uint8_t * const *)frame->data, frame->linesize,
+                  0, frame->height, ost->enc_frame->data, ost->enc_frame->linesize);
+        av_frame_copy_props(ost->enc_frame, frame);
+        in = ost->enc_frame;
+    }
+
+    if (in->pts != AV_NOPTS_VALUE) {
+        in->pts = av_rescale_q(in->pts, ist->st->time_base, enc->time_base);
+        // encoders refuse a timestamp that does not move forward
+        if (ost->last_enc_pts != AV_NOPTS_VALUE && in->pts <= ost->last_enc_pts)
+            in->pts = ost->last_enc_pts + 1;
+        ost->last_enc_pts = in->pts;
+    }
+    in->pict_type = AV_PICTURE_TYPE_NONE;
+
+    ret = avcodec_send_frame(enc, in);
+    if (ret >= 0)
+        ret = receive_encoded_packets(s, ost);
+
+    ost->nb_encoded_frames++;
+    ost->encode_time += av_gettime_relative() - t;
+    return ret;
+}
+
+/* encode nb_samples from the audio fifo as one frame */
+static int encode_audio_samples(StreamSession *s, OutputStream *ost, int nb_samples)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    AVFrame *frame = av_frame_alloc();
+    int ret;
+
+    if (!frame)
+        return AVERROR(ENOMEM);
+    frame->format         = enc->sample_fmt;
+    frame->channel_layout = enc->channel_layout;
+    frame->sample_rate    = enc->sample_rate;
+    frame->nb_samples     = nb_samples;
+    // a frame of its own, the encoder may keep a reference to it
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret >= 0 && av_audio_fifo_read(ost->audio_fifo, (void **)frame->extended_data, nb_samples) < nb_samples)
+        ret = AVERROR_BUG;
+    if (ret >= 0) {
+        frame->pts = ost->audio_fifo_pts;
+        ost->audio_fifo_pts += nb_samples;
+        ret = avcodec_send_frame(enc, frame);
+    }
+    if (ret >= 0)
+        ret = receive_encoded_packets(s, ost);
+    ost->nb_encoded_frames++;
+
+    av_frame_free(&frame);
+    return ret;
+}
+
+/*
+ * audio side, runs on the demux task: resample a decoded frame to what the
+ * encoder takes and encode every full frame_size of samples gathered so far
+ */
+static int encode_audio_frame(StreamSession *s, OutputStream *ost, AVFrame *frame, AVRational tb)
+{
+    AVCodecContext *enc = ost->enc_ctx;
+    int frame_size = enc->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE ? 0 : enc->frame_size;
+    int64_t t = av_gettime_relative();
+    int nb_samples, ret;
+
+    if (!ost->swr) {
+        ost->swr = swr_alloc_set_opts(NULL, enc->channel_layout, enc->sample_fmt, enc->sample_rate,
+                                      frame->channel_layout ? frame->channel_layout :
+                                      av_get_default_channel_layout(frame->channels),
+                                      frame->format, frame->sample_rate, 0, NULL);
+        if (!ost->swr)
+            return AVERROR(ENOMEM);
+        if ((ret = swr_init(ost->swr)) < 0)
+            return ret;
+        ost->audio_fifo = av_audio_fifo_alloc(enc->sample_fmt, enc->channels, FFMAX(frame_size, 1024) * 2);
+        if (!ost->audio_fifo)
+            return AVERROR(ENOMEM);
+    }
+
+    // the samples are counted from the first frame on, the source clock is
+    // only followed again after a gap or a jump of more than half a second
+    if (frame->pts != AV_NOPTS_VALUE) {
+        int64_t pts = av_rescale_q(frame->pts, tb, enc->time_base);
+        int64_t expected = ost->audio_fifo_pts + av_audio_fifo_size(ost->audio_fifo);
+
+        if (ost->audio_fifo_pts == AV_NOPTS_VALUE || FFABS(pts - expected) > enc->sample_rate / 2) {
+            if (ost->audio_fifo_pts != AV_NOPTS_VALUE)
+                av_log(NULL, AV_LOG_VERBOSE, "[session %d] audio resync by %"PRId64" samples\n",
+                       s->index, pts - expected);
+            av_audio_fifo_reset(ost->audio_fifo);
+            ost->audio_fifo_pts = pts;
+        }
+    } else if (ost->audio_fifo_pts == AV_NOPTS_VALUE) {
+        ost->audio_fifo_pts = 0;
+    }
+
+    nb_samples = swr_get_out_samples(ost->swr, frame->nb_samples);
+    if (!ost->enc_frame || ost->enc_frame->nb_samples < nb_samples) {
+        av_frame_free(&ost->enc_frame);
+        if (!(ost->enc_frame = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        ost->enc_frame->format         = enc->sample_fmt;
+        ost->enc_frame->channel_layout = enc->channel_layout;
+        ost->enc_frame->nb_samples     = nb_samples;
+        if ((ret = av_frame_get_buffer(ost->enc_frame, 0)) < 0)
+            return ret;
+    }
+    nb_samples = swr_convert(ost->swr, ost->enc_frame->extended_data, ost->enc_frame->nb_samples,
+                             (const uint8_t **)frame->extended_data, frame->nb_samples);
+    if (nb_samples < 0)
+        return nb_samples;
+    ret = av_audio_fifo_write(ost->audio_fifo, (void **)ost->enc_frame->extended_data, nb_samples);
+    if (ret < 0)
+        return ret;
+
+    ret = 0;
+    while (ret >= 0 && av_audio_fifo_size(ost->audio_fifo) >= FFMAX(frame_size, 1))
+        ret = encode_audio_samples(s, ost, frame_size ? frame_size : av_audio_fifo_size(ost->audio_fifo));
+
+    ost->encode_time += av_gettime_relative() - t;
+    return ret;
+}
+
+/* drain the encoder at the end of the input so the last frames reach the output */
+static void flush_encoder(StreamSession *s, OutputStream *ost)
+{
+    int ret = 0;
+
+    if (!avcodec_is_open(ost->enc_ctx))
+        return;
+    // the samples short of a full frame, when the encoder takes a shorter last one
+    if (ost->audio_fifo && av_audio_fifo_size(ost->audio_fifo) > 0 &&
+        ost->enc_ctx->codec->capabilities & AV_CODEC_CAP_SMALL_LAST_FRAME)
+        ret = encode_audio_samples(s, ost, av_audio_fifo_size(ost->audio_fifo));
+    if (ret >= 0)
+        ret = avcodec_send_frame(ost->enc_ctx, NULL);
+    if (ret >= 0)
+        ret = receive_encoded_packets(s, ost);
+    if (ret < 0)
+        av_log(NULL, AV_LOG_ERROR, "[session %d] error flushing the encoder of %s: %s\n",
+               s->index, s->output_files[ost->file_index]->ctx->url, av_err2str(ret));
+}
+
+
+/*
+ * the graph of -vf for a video stream, set up from the probed parameters
+ * before the encoders are, they take the size and rate of its output. it is
+ * built again from the decoded frame when the camera changes its size or
+ * pixel format, see filter_video_frame().
+ */
+static int init_video_filters(StreamSession *s, InputStream *ist, const AVFrame *frame)
+{
+    AVCodecContext *dec = ist->dec_ctx;
+    AVFilterInOut *outputs = NULL, *inputs = NULL;
+    AVRational fr = ist->st->avg_frame_rate;
+    AVRational sar = frame ? frame->sample_aspect_ratio : dec->sample_aspect_ratio;
+    int width  = frame ? frame->width  : dec->width;
+    int height = frame ? frame->height : dec->height;
+    int format = frame ? frame->format : dec->pix_fmt;
+    char args[256];
+    int ret;
+
+    if (width <= 0 || height <= 0 || format == AV_PIX_FMT_NONE) {
+        av_log(NULL, AV_LOG_ERROR, "[session %d] stream #%d: size or pixel format unknown, cannot filter it\n",
+               s->index, ist->st->index);
+        return AVERROR(EINVAL);
+    }
+
+    ist->filter_graph = avfilter_graph_alloc();
+    outputs = avfilter_inout_alloc();
+    inputs  = avfilter_inout_alloc();
+    if (!ist->filter_graph || !outputs || !inputs) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    ist->filter_graph->nb_threads  = filter_threads;
+    ist->filter_graph->thread_type = AVFILTER_THREAD_SLICE;
+
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             width, height, format, ist->st->time_base.num, ist->st->time_base.den,
+             sar.num, FFMAX(sar.den, 1));
+    if (fr.num > 0 && fr.den > 0)
+        av_strlcatf(args, sizeof(args), ":frame_rate=%d/%d", fr.num, fr.den);
+    ret = avfilter_graph_create_filter(&ist->filter_in, avfilter_get_by_name("buffer"), "in",
+                                       args, NULL, ist->filter_graph);
+    if (ret >= 0)
+        ret = avfilter_graph_create_filter(&ist->filter_out, avfilter_get_by_name("buffersink"), "out",
+                                           NULL, NULL, ist->filter_graph);
+    if (ret < 0)
+        goto end;
+
+    outputs->name       = av_strdup("in");
+    outputs->filter_ctx = ist->filter_in;
+    inputs->name        = av_strdup("out");
+    inputs->filter_ctx  = ist->filter_out;
+    if (!outputs->name || !inputs->name) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+
+    ret = avfilter_graph_parse_ptr(ist->filter_graph, video_filters, &inputs, &outputs, NULL);
+    if (ret >= 0)
+        ret = avfilter_graph_config(ist->filter_graph, NULL);
+    ist->filter_width  = width;
+    ist->filter_height = height;
+    ist->filter_format = format;
+
+end:
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "[session %d] stream #%d: could not set up the filters %s: %s\n",
+               s->index, ist->st->index, video_filters, av_err2str(ret));
+        avfilter_graph_free(&ist->filter_graph);
+    }
+    return ret;
+}
+
+/* a decoded or filtered video frame to the hook and the encoders, ist->pts is its pts */
+static void consume_video_frame(StreamSession *s, InputStream *ist, AVFrame *frame)
+{
+    int i;
+
+    if (ist->decoding_needed & DECODING_FOR_HOOK) {
+        // the encoder still needs the frame, otherwise the hook can have it
+        hook_the_frame(s, ist, frame, !(ist->decoding_needed & DECODING_FOR_OST));
+    }
+
+    if (ist->decoding_needed & DECODING_FOR_OST) {
+        for (i = 0; i < s->nb_output_streams; i++) {
+            OutputStream *ost = s->output_streams[i];
+            if (ost->encoding_needed && !ost->detached && ost->source_index == ist->st->index)
+                send_frame_to_encoding(s, ost, frame);
+        }
+    }
+}
+
+/*
+ * the graph gets a reference to the decoder's frame, no copy, and whatever
+ * it gives back goes to the consumers. a NULL frame drains the graph.
+ */
+static int filter_video_frame(StreamSession *s, InputStream *ist, AVFrame *frame)
+{
+    AVFrame *filtered = ist->filter_frame;
+    AVRational tb;
+    int ret;
+
+    // gone with a failed rebuild
+    if (!ist->filter_graph)
+        return AVERROR(EINVAL);
+
+    // the buffer source only takes what it was set up for: the old graph
+    // hands out what it still holds and a new one is built, as ffmpeg does
+    if (frame && (frame->width != ist->filter_width || frame->height != ist->filter_height ||
+                  frame->format != ist->filter_format)) {
+        av_log(NULL, AV_LOG_INFO, "[session %d] stream #%d: %dx%d %s is now %dx%d %s, rebuilding the filters\n",
+               s->index, ist->st->index, ist->filter_width, ist->filter_height,
+               av_get_pix_fmt_name(ist->filter_format), frame->width, frame->height,
+               av_get_pix_fmt_name(frame->format));
+        ret = filter_video_frame(s, ist, NULL);
+        avfilter_graph_free(&ist->filter_graph);
+        if (ret < 0 || (ret = init_video_filters(s, ist, frame)) < 0)
+            return ret;
+    }
+
+    ret = av_buffersrc_add_frame_flags(ist->filter_in, frame, AV_BUFFERSRC_FLAG_KEEP_REF);
+    if (ret < 0)
+        return ret;
+
+    tb = av_buffersink_get_time_base(ist->filter_out);
+    while ((ret = av_buffersink_get_frame(ist->filter_out, filtered)) >= 0) {
+        // back to the timebase of the stream, which fps= for one changes
+        if (filtered->pts != AV_NOPTS_VALUE) {
+            filtered->pts = av_rescale_q(filtered->pts, tb, ist->st->time_base);
+            ist->pts      = ts_convert(&ist->ts_us, filtered->pts);
+        }
+        consume_video_frame(s, ist, filtered);
+        av_frame_unref(filtered);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+static int decode_video(StreamSession *s, InputStream *ist, AVPacket *pkt, int *got_output, int64_t *duration_pts, int eof,
+                        int *decode_failed)
+{
+    AVFrame *decoded_frame;
+    int ret = 0, err = 0;
+    int64_t best_effort_timestamp;
+    int64_t dts = AV_NOPTS_VALUE;
+    AVPacket avpkt;
+
+    // With fate-indeo3-2, we're getting 0-sized packets before EOF for some
+    // reason. This seems like a semi-critical bug. Don't trigger EOF, and
+    // skip the packet.
+    if (!eof && pkt && pkt->size == 0)
+        return 0;
+
+    if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (!ist->filter_frame && !(ist->filter_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    decoded_frame = ist->decoded_frame;
+    if (ist->dts != AV_NOPTS_VALUE)
+        dts = av_rescale_q(ist->dts, AV_TIME_BASE_Q, ist->st->time_base);
+    if (pkt) {
+        avpkt = *pkt;
+        avpkt.dts = dts; // ffmpeg.c probably shouldn't do this
+    }
+
+
+
+    ret = decode(ist->dec_ctx, decoded_frame, got_output, pkt ? &avpkt : NULL);
+
+    if (ret < 0)
+        *decode_failed = 1;
+
+
+
+    if (*got_output && ret >= 0) {
+        if (ist->dec_ctx->width  != decoded_frame->width ||
+            ist->dec_ctx->height != decoded_frame->height ||
+            ist->dec_ctx->pix_fmt != decoded_frame->format) {
+            av_log(NULL, AV_LOG_DEBUG, "Frame parameters mismatch context %d,%d,%d != %d,%d,%d\n",
+                decoded_frame->width,
+                decoded_frame->height,
+                decoded_frame->format,
+                ist->dec_ctx->width,
+                ist->dec_ctx->height,
+                ist->dec_ctx->pix_fmt);
+        }
+    }
+
+    if (!*got_output || ret < 0)
+        return ret;
+
+
+
+
+    best_effort_timestamp= decoded_frame->best_effort_timestamp;
+    *duration_pts = decoded_frame->pkt_duration;
+
+
+
+    if(best_effort_timestamp != AV_NOPTS_VALUE) {
+        int64_t ts = ts_convert(&ist->ts_us, decoded_frame->pts = best_effort_timestamp);
+
+        if (ts != AV_NOPTS_VALUE)
+            ist->next_pts = ist->pts = ts;
+    }
+
+
+    if (ist->decoding_needed & DECODING_FOR_FILTER) {
+        err = filter_video_frame(s, ist, decoded_frame);
+        if (err < 0)
+            av_log(NULL, AV_LOG_ERROR, "[session %d] error filtering stream #%d: %s\n",
+                   s->index, ist->st->index, av_err2str(err));
+    } else {
+        consume_video_frame(s, ist, decoded_frame);
+    }
+
+fail:
+
+    av_frame_unref(decoded_frame);
+    return err < 0 ? err : ret;
+}
+
+
+
+
+static int decode_audio(StreamSession *s, InputStream *ist, AVPacket *pkt, int *got_output,
+                        int *decode_failed)
+{
+    AVFrame *decoded_frame;
+    AVCodecContext *avctx = ist->dec_ctx;
+    int i, ret, err = 0;
+    AVRational decoded_frame_tb;
+
+    if (!ist->decoded_frame && !(ist->decoded_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+    if (!ist->filter_frame && !(ist->filter_frame = av_frame_alloc()))
+        return AVERROR(ENOMEM);
+
+    decoded_frame = ist->decoded_frame;
+
+
+    ret = decode(avctx, decoded_frame, got_output, pkt);
+
+    if (ret < 0)
+        *decode_failed = 1;
+
+    if (ret >= 0 && avctx->sample_rate <= 0) {
+        av_log(avctx, AV_LOG_ERROR, "Sample rate %d invalid\n", avctx->sample_rate);
+        ret = AVERROR_INVALIDDATA;
+    }
+
+
+    if (!*got_output || ret < 0)
+        return ret;
+
+
+
+    ist->next_pts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
+                     avctx->sample_rate;
+    ist->next_dts += ((int64_t)AV_TIME_BASE * decoded_frame->nb_samples) /
+                     avctx->sample_rate;
+
+
+    if (decoded_frame->pts != AV_NOPTS_VALUE) {
+        decoded_frame_tb   = ist->st->time_base;
+    } else if (pkt && pkt->pts != AV_NOPTS_VALUE) {
+        decoded_frame->pts = pkt->pts;
+        decoded_frame_tb   = ist->st->time_base;
+    }else {
+        decoded_frame->pts = ist->dts;
+        decoded_frame_tb   = AV_TIME_BASE_Q;
+    }
+
+    ist->nb_samples = decoded_frame->nb_samples;
+    // err = send_frame_to_filters(ist, decoded_frame);
+
+    if (ist->decoding_needed & DECODING_FOR_OST) {
+        for (i = 0; i < s->nb_output_streams && err >= 0; i++) {
+            OutputStream *ost = s->output_streams[i];
+            if (ost->encoding_needed && !ost->detached && ost->source_index == ist->st->index)
+                err = encode_audio_frame(s, ost, decoded_frame, decoded_frame_tb);
+        }
+        if (err < 0)
+            av_log(NULL, AV_LOG_ERROR, "[session %d] error encoding audio: %s\n",
+                   s->index, av_err2str(err));
+    }
+
+
+
+
+
+    av_frame_unref(decoded_frame);
+    return err < 0 ? err : ret;
+}
+
+
+/* the copied streams of output file file_index, of every file when it is -1 */
+static int init_output_streams(StreamSession *s, int file_index)
+{
+    int i;
+
+    /* open each encoder */
+    for (i = 0; i < s->nb_output_streams; i++) {
+
+        OutputStream *ost = s->output_streams[i];
+        InputStream *ist = s->input_streams[ost->source_index];
+        AVCodecParameters *par_dst = ost->st->codecpar;
+        AVCodecParameters *par_src = ost->ref_par;
+        AVRational sar;
+        int ret;
+
+        // the encoder already filled in the parameters of its stream
+        if (ost->encoding_needed || (file_index >= 0 && ost->file_index != file_index))
+            continue;
+       
+
+        ret = avcodec_parameters_to_context(ost->enc_ctx, ist->st->codecpar);
+        avcodec_parameters_from_context(par_src, ost->enc_ctx);
+        ret = avcodec_parameters_copy(par_dst, par_src);
+     
+
+        if (!ost->frame_rate.num)
+            ost->frame_rate = ist->framerate;
+        ost->st->avg_frame_rate = ost->frame_rate;
+
+        // copy timebase while removing common factors
+        if (ost->st->time_base.num <= 0 || ost->st->time_base.den <= 0)
+            ost->st->time_base = av_add_q(av_stream_get_codec_timebase(ost->st), (AVRational){0, 1});
+
+        // copy disposition
+        ost->st->disposition = ist->st->disposition;
+
+        
+
+
+        switch (par_dst->codec_type) {
+        case AVMEDIA_TYPE_AUDIO:
+
+            break;
+        case AVMEDIA_TYPE_VIDEO:
+
+            sar = par_src->sample_aspect_ratio;
+            ost->st->sample_aspect_ratio = par_dst->sample_aspect_ratio = sar;
+            ost->st->avg_frame_rate = ist->st->avg_frame_rate;
+            ost->st->r_frame_rate = ist->st->r_frame_rate;
+            break;
+        }
+
+        ost->mux_timebase = ist->st->time_base;
+
+
+
+
+    }
+
+    return 0;
+}
+
+/* once the header of the file is written, the muxer may have changed the stream timebases */
+static void init_ts_converters(StreamSession *s, int file_index)
+{
+    int i;
+
+    for (i = 0; i < s->nb_output_streams; i++) {
+        OutputStream *ost = s->output_streams[i];
+
+        if (ost->file_index != file_index)
+            continue;
+        if (ost->source_index < s->nb_input_streams)
+            ts_converter_init(&ost->ts_from_source, s->input_streams[ost->source_index]->st->time_base,
+                              ost->mux_timebase);
+        ts_converter_init(&ost->ts_us_to_mux, AV_TIME_BASE_Q, ost->mux_timebase);
+        ts_converter_init(&ost->ts_mux_to_us, ost->mux_timebase, AV_TIME_BASE_Q);
+        ts_converter_init(&ost->ts_mux_to_st, ost->mux_timebase, ost->st->time_base);
+    }
+}
+
+/* read one packet from the session input and push it through decode / copy */
+static int process_input_packet(StreamSession *s)
+{
+        InputStream *ist;
+        AVPacket pkt;
+        int ret, i, j;
+
+        ret = av_read_frame(s->ic, &pkt);
+        if (ret < 0)
+            return ret;
+
+        s->nb_packets++;
+
+        // not every demuxer honours AVDISCARD_ALL, and streams may appear mid-stream
+        if (pkt.stream_index >= s->nb_input_streams ||
+            s->input_streams[pkt.stream_index]->discard) {
+            av_packet_unref(&pkt);
+            return 0;
+        }
+
+        ist = s->input_streams[pkt.stream_index];
+        ist->data_size += pkt.size;
+        ist->nb_packets++;
+
+        if (pkt.pts != AV_NOPTS_VALUE) {
+            ist->max_pts = FFMAX(pkt.pts, ist->max_pts);
+            ist->min_pts = FFMIN(pkt.pts, ist->min_pts);
+        }
+
+        if (pkt.dts != AV_NOPTS_VALUE)
+            s->last_ts = ts_convert(&ist->ts_us, pkt.dts);
+
+        if (gop_cache)
+            gop_cache_add(s, ist, &pkt);
+
+        int repeating = 0;
+        int eof_reached = 0;
+
+
+        if (!ist->saw_first_ts) {
+            ist->dts = ist->st->avg_frame_rate.num ? - ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
+            ist->pts = 0;
+            if (pkt.pts != AV_NOPTS_VALUE) {
+                ist->dts += ts_convert(&ist->ts_us, pkt.pts);
+                ist->pts = ist->dts; //unused but better to set it to a value thats not totally wrong
+            }
+            ist->saw_first_ts = 1;
+        }
+
+        if (ist->next_dts == AV_NOPTS_VALUE)
+            ist->next_dts = ist->dts;
+        if (ist->next_pts == AV_NOPTS_VALUE)
+            ist->next_pts = ist->pts;
+
+
+        if (pkt.dts != AV_NOPTS_VALUE) {
+            ist->next_dts = ist->dts = ts_convert(&ist->ts_us, pkt.dts);
+            if (ist->dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
+                ist->next_pts = ist->pts = ist->dts;
+        }
+
+
+        AVPacket avpkt = pkt;
+        int do_decode = !!ist->decoding_needed;
+        int64_t decode_start = 0;
+
+        if (do_decode && ist->keyframes_only)
+            do_decode = keyframe_snapshot_due(s, ist, &pkt);
+        if (do_decode) {
+            decode_start = av_gettime_relative();
+            ist->nb_decoded_packets++;
+        }
+
+        while(do_decode){
+            int64_t duration_dts = 0;
+            int64_t duration_pts = 0;
+            int got_output = 0;
+            int decode_failed = 0;
+
+            ist->pts = ist->next_pts;
+            ist->dts = ist->next_dts;
+
+            
+
+            switch (ist->dec_ctx->codec_type) {
+                case AVMEDIA_TYPE_AUDIO:
+                    ret = decode_audio    (s, ist, repeating ? NULL : &avpkt, &got_output,
+                                           &decode_failed);
+                    break;
+                case AVMEDIA_TYPE_VIDEO:
+
+                    ret = decode_video (s, ist, repeating ? NULL : &avpkt, &got_output, &duration_pts, 0,
+                                           &decode_failed);
+
+
+                    if (!repeating || got_output) {
+                        if (pkt.duration) {
+                            duration_dts = ts_convert(&ist->ts_us, pkt.duration);
+                        } else if(ist->dec_ctx->framerate.num != 0 && ist->dec_ctx->framerate.den != 0) {
+                            int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict+1 : ist->dec_ctx->ticks_per_frame;
+                            duration_dts = ((int64_t)AV_TIME_BASE *
+                                            ist->dec_ctx->framerate.den * ticks) /
+                                            ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
+                        }
+
+                        if(ist->dts != AV_NOPTS_VALUE && duration_dts) {
+                            ist->next_dts += duration_dts;
+                        }else
+                            ist->next_dts = AV_NOPTS_VALUE;
+                    }
+
+                    if (got_output) {
+                        if (duration_pts > 0) {
+                            ist->next_pts += ts_convert(&ist->ts_us, duration_pts);
+                        } else {
+                            ist->next_pts += duration_dts;
+                        }
+                    }
+                    break;
+            }
+
+
+            if (got_output)
+                ist->got_output = 1;
+
+            if (!got_output)
+                break;
+
+            repeating = 1;
+        }
+
+        if (do_decode)
+            ist->decode_time += av_gettime_relative() - decode_start;
+
+
+        // streams whose frames are encoded reach the muxer through the encode task
+        if (!(ist->decoding_needed & DECODING_FOR_OST)) {
+            ist->dts = ist->next_dts;
+            switch (ist->dec_ctx->codec_type) {
+            case AVMEDIA_TYPE_AUDIO:
+                ist->next_dts += ((int64_t)AV_TIME_BASE * ist->dec_ctx->frame_size) /
+                                 ist->dec_ctx->sample_rate;
+                break;
+            case AVMEDIA_TYPE_VIDEO:
+                if (ist->framerate.num) {
+                    // TODO: Remove work-around for c99-to-c89 issue 7
+                    AVRational time_base_q = AV_TIME_BASE_Q;
+                    int64_t next_dts = av_rescale_q(ist->next_dts, time_base_q, av_inv_q(ist->framerate));
+                    ist->next_dts = av_rescale_q(next_dts + 1, av_inv_q(ist->framerate), time_base_q);
+                } else if (pkt.duration) {
+                    ist->next_dts += ts_convert(&ist->ts_us, pkt.duration);
+                } else if(ist->dec_ctx->framerate.num != 0) {
+                    int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : ist->dec_ctx->ticks_per_frame;
+                    ist->next_dts += ((int64_t)AV_TIME_BASE *
+                                      ist->dec_ctx->framerate.den * ticks) /
+                                      ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
+                }
+                break;
+            }
+            ist->pts = ist->dts;
+            ist->next_pts = ist->next_dts;
+        }
+
+        // a stream may be demuxed only to be decoded for the hook, or be
+        // copied to the session output and every rendition. the last copy
+        // takes the demuxer's packet itself, the ones before a reference each
+#define COPIES_PACKET(ost) ((ost)->source_index == pkt.stream_index && !(ost)->encoding_needed && !(ost)->detached)
+        for (i = 0, j = -1; i < s->nb_output_streams; i++)
+            if (COPIES_PACKET(s->output_streams[i]))
+                j = i;
+        for (i = 0; i <= j; i++)
+            if (COPIES_PACKET(s->output_streams[i]))
+                do_streamcopy(s, ist, s->output_streams[i], &pkt, i == j);
+#undef COPIES_PACKET
+
+        av_packet_unref(&pkt);
+        return 0;
+}
+
+
+static int open_session(StreamSession *s)
+{
+    int i, ret;
+
+    s->open_time = s->last_input_time = av_gettime_relative();
+    ret = open_input_file(s);
+    if (ret < 0)
+        return ret;
+    // avformat_find_stream_info() leaves its read-ahead with the demuxer
+    s->input_held = 1;
+    ret = map_input_streams(s);
+    if (ret < 0)
+        return ret;
+    for (i = 0; video_filters && i < s->nb_stream_map; i++) {
+        InputStream *ist = s->input_streams[s->stream_map[i]];
+        if (ist->st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && !ist->filter_graph &&
+            (ret = init_video_filters(s, ist, NULL)) < 0)
+            return ret;
+    }
+    ret = open_output_files(s);
+    if (ret < 0)
+        return ret;
+    ret = init_input_streams(s);
+    if (ret < 0)
+        return ret;
+    ret = init_output_streams(s, -1);
+    if (ret < 0)
+        return ret;
+
+    for (i = 0; i < s->nb_output_files; i++) {
+        AVFormatContext *oc = s->output_files[i]->ctx;
+
+        s->io_start_time = av_gettime_relative();
+        ret = avformat_write_header(oc, NULL);
+        s->io_start_time = 0;
+        if (ret < 0) {
+            av_log(NULL, AV_LOG_ERROR, "[session %d] could not write header to %s: %s\n",
+                   s->index, oc->url, av_err2str(ret));
+            return ret;
+        }
+
+        init_ts_converters(s, i);
+        av_dump_format(oc, i, oc->url, 1);
+    }
+
+    s->state = SESSION_STATE_RUNNING;
+    return 0;
+}
+
+static void free_output_stream(OutputStream **post)
+{
+    OutputStream *ost = *post;
+
+    if (!ost)
+        return;
+    avcodec_free_context(&ost->enc_ctx);
+    sws_freeContext(ost->sws);
+    swr_free(&ost->swr);
+    if (ost->audio_fifo)
+        av_audio_fifo_free(ost->audio_fifo);
+    av_frame_free(&ost->enc_frame);
+    avcodec_parameters_free(&ost->ref_par);
+    av_dict_free(&ost->encoder_opts);
+    av_freep(post);
+}
+
+static void close_session(StreamSession *s)
+{
+    int i;
+
+    packet_queue_free(&s->mux_queue);
+    for (i = 0; i < s->nb_encoders; i++)
+        frame_queue_free(&s->encoders[i].queue);
+
+    pthread_mutex_lock(&s->control_lock);
+    for (i = 0; i < s->nb_output_files; i++) {
+        AVFormatContext *oc = s->output_files[i]->ctx;
+
+        s->io_start_time = av_gettime_relative();
+        if (s->state == SESSION_STATE_RUNNING && !s->output_files[i]->closed)
+            av_write_trailer(oc);
+        output_io_close(s, s->output_files[i]);
+        s->io_start_time = 0;
+        avformat_free_context(oc);
+        av_freep(&s->output_files[i]);
+    }
+    s->nb_output_files = 0;
+    // outputs still waiting to be attached, and no more of them
+    s->closing = 1;
+    while (s->requests) {
+        ControlRequest *req = s->requests;
+        s->requests = req->next;
+        avio_closep(&req->pb);
+        av_free(req->url);
+        av_free(req);
+    }
+    pthread_mutex_unlock(&s->control_lock);
+
+    for (i = 0; i < s->nb_output_streams; i++)
+        free_output_stream(&s->output_streams[i]);
+    av_freep(&s->output_streams);
+    s->nb_output_streams = 0;
+
+    for (i = 0; i < s->nb_input_streams; i++) {
+        InputStream *ist = s->input_streams[i];
+        if (!ist)
+            continue;
+        av_frame_free(&ist->decoded_frame);
+        av_frame_free(&ist->filter_frame);
+        avfilter_graph_free(&ist->filter_graph);
+        av_buffer_pool_uninit(&ist->hook_pool);
+        gop_cache_trim(ist, ist->nb_gop_cache);
+        av_freep(&ist->gop_cache);
+        avcodec_free_context(&ist->dec_ctx);
+        av_freep(&s->input_streams[i]);
+    }
+    av_freep(&s->input_streams);
+    s->nb_input_streams = 0;
+
+    reactor_remove(s);
+    avformat_close_input(&s->ic);
+    av_dict_free(&s->format_opts);
+
+    s->state = SESSION_STATE_FINISHED;
+}
+
+static void free_session(StreamSession **ps)
+{
+    StreamSession *s = *ps;
+
+    if (!s)
+        return;
+    close_session(s);
+    av_freep(&s->output_files);
+    av_freep(&s->stream_map);
+    pthread_mutex_destroy(&s->control_lock);
+    av_freep(&s->input_url);
+    av_freep(&s->output_url);
+    av_freep(ps);
+}
+
+/* called by each task of a session once it is done, the last one tears it down */
+static void session_task_done(StreamSession *s)
+{
+    PacketQueue *q = &s->mux_queue;
+    int last;
+
+    pthread_mutex_lock(&q->lock);
+    last = !--s->nb_live_tasks;
+    pthread_mutex_unlock(&q->lock);
+    if (!last)
+        return;
+
+    av_log(NULL, AV_LOG_INFO, "[session %d] finished after %"PRId64" packets, "
+           "mux queue peak %d packets / %"PRId64" bytes / %.3fs, "
+           "dropped %"PRId64" on overflow and %"PRId64" waiting for a keyframe\n",
+           s->index, s->nb_packets, q->peak_packets, q->peak_bytes,
+           q->peak_duration / (double)AV_TIME_BASE, q->nb_dropped, s->nb_dropped);
+    if (s->nb_muxed)
+        av_log(NULL, AV_LOG_INFO, "[session %d] egress latency from the demuxer to the muxer: "
+               "average %.1fms, max %.1fms\n", s->index,
+               s->egress_latency / 1000.0 / s->nb_muxed, s->max_egress_latency / 1000.0);
+    for (int i = 0; i < s->nb_input_streams; i++) {
+        InputStream *ist = s->input_streams[i];
+        if (ist->nb_decoded_packets)
+            av_log(NULL, AV_LOG_INFO, "[session %d] stream #%d: decoded %d of %d packets in %.3fs%s, "
+                   "hooked %d frames, %d of them copied, %d skipped as unchanged "
+                   "(%.1fus per comparison)\n",
+                   s->index, i, ist->nb_decoded_packets, ist->nb_packets,
+                   ist->decode_time / 1000000.0, ist->keyframes_only ? " (keyframes only)" : "",
+                   ist->nb_hooked_frames, ist->nb_hook_copies, ist->nb_scene_skips,
+                   ist->nb_hooked_frames + ist->nb_scene_skips ?
+                   (double)ist->scene_time / (ist->nb_hooked_frames + ist->nb_scene_skips) : 0.0);
+    }
+    for (int i = 0; i < s->nb_output_streams; i++) {
+        OutputStream *ost = s->output_streams[i];
+        if (ost->encoding_needed)
+            av_log(NULL, AV_LOG_INFO, "[session %d] stream #%d: encoded %"PRId64" frames in %.3fs\n",
+                   s->index, i, ost->nb_encoded_frames, ost->encode_time / 1000000.0);
+    }
+    for (int i = 0; i < s->nb_encoders; i++) {
+        FrameQueue *eq = &s->encoders[i].queue;
+        if (s->encoders[i].ost)
+            av_log(NULL, AV_LOG_INFO, "[session %d] %s encode queue: %"PRId64" frames, %"PRId64" dropped, "
+                   "peak %"PRId64" bytes\n", s->index,
+                   s->output_files[s->encoders[i].ost->file_index]->ctx->url,
+                   eq->nb_frames, eq->nb_dropped, eq->peak_bytes);
+    }
+    close_session(s);
+}
+
+/* the demuxer and every encoder feed the mux queue, the last one to stop ends it */
+static void session_producer_done(StreamSession *s)
+{
+    int last;
+
+    pthread_mutex_lock(&s->mux_queue.lock);
+    last = !--s->nb_mux_producers;
+    pthread_mutex_unlock(&s->mux_queue.lock);
+
+    if (last && packet_queue_finish(&s->mux_queue))
+        scheduler_wake(&mux_scheduler, &s->mux_task);
+}
+
+/*
+ * demux task: stop feeding of, the mux task closes it once the packets
+ * already queued for it are written
+ */
+static int detach_output(StreamSession *s, OutputFile *of)
+{
+    OutputStream *marker = NULL;
+    int i, ret;
+
+    of->detached = 1;
+    for (i = 0; i < s->nb_output_streams; i++) {
+        OutputStream *ost = s->output_streams[i];
+        if (s->output_files[ost->file_index] == of) {
+            ost->detached = 1;
+            marker = ost;
+        }
+    }
+    // a file whose streams could not even be set up never had a packet queued
+    if (!marker) {
+        pthread_mutex_lock(&s->control_lock);
+        of->closed = of->released = 1;
+        pthread_mutex_unlock(&s->control_lock);
+        return 0;
+    }
+
+    ret = packet_queue_put(&s->mux_queue, NULL, marker, AV_NOPTS_VALUE);
+    if (ret > 0)
+        scheduler_wake(&mux_scheduler, &s->mux_task);
+    return ret < 0 ? ret : 0;
+}
+
+/* demux task: start an output the control thread connected on the gop cache */
+static int attach_output_file(StreamSession *s, const char *url, AVIOContext **pb)
+{
+    int file_index = -1;
+    OutputFile *of;
+    int ret;
+
+    ret = open_output_file(s, NULL, url, *pb, &file_index);
+    if (file_index < 0)
+        return ret;
+    *pb = NULL;
+    of = s->output_files[file_index];
+
+    if (ret >= 0)
+        ret = init_output_streams(s, file_index);
+    if (ret >= 0)
+        ret = avformat_write_header(of->ctx, NULL);
+    if (ret >= 0) {
+        init_ts_converters(s, file_index);
+        ret = gop_cache_prime(s, file_index);
+    }
+    if (ret < 0) {
+        // a file half set up is never fed, and never written to again. the
+        // marker still goes through the queue, after what the gop cache put
+        // there, so that the slot is freed like any other.
+        output_io_close(s, of);
+        of->closed = 1;
+        detach_output(s, of);
+        return ret;
+    }
+
+    av_log(NULL, AV_LOG_INFO, "[session %d] attached %s\n", s->index, url);
+    return 0;
+}
+
+static int detach_output_file(StreamSession *s, const char *url)
+{
+    int i;
+
+    for (i = 0; i < s->nb_output_files; i++)
+        if (!s->output_files[i]->detached && !strcmp(s->output_files[i]->ctx->url, url))
+            return detach_output(s, s->output_files[i]);
+    return AVERROR(ENOENT);
+}
+
+/* demux task: the outputs the mux task gave up on are detached like any other */
+static void detach_failed_outputs(StreamSession *s)
+{
+    int i;
+
+    pthread_mutex_lock(&s->control_lock);
+    s->nb_failed_outputs_seen = s->nb_failed_outputs;
+    pthread_mutex_unlock(&s->control_lock);
+
+    for (i = 0; i < s->nb_output_files; i++) {
+        OutputFile *of = s->output_files[i];
+        if (of->closed && !of->detached)
+            detach_output(s, of);
+    }
+}
+
+/*
+ * demux task: free the output streams of the files the mux task is done
+ * with, their slots take the next attached files. a file an encode task
+ * feeds keeps its streams, the encoder still refers to them.
+ */
+static void reap_output_files(StreamSession *s)
+{
+    int i, j, k;
+
+    for (i = 0; i < s->nb_output_files; i++) {
+        OutputFile *of = s->output_files[i];
+        int released;
+
+        pthread_mutex_lock(&s->control_lock);
+        released = of->released;
+        pthread_mutex_unlock(&s->control_lock);
+        if (!released || of->reaped)
+            continue;
+        for (j = 0; j < s->nb_output_streams; j++)
+            if (s->output_streams[j]->file_index == i && s->output_streams[j]->encoder)
+                break;
+        if (j < s->nb_output_streams)
+            continue;
+
+        for (j = k = 0; j < s->nb_output_streams; j++) {
+            if (s->output_streams[j]->file_index == i)
+                free_output_stream(&s->output_streams[j]);
+            else
+                s->output_streams[k++] = s->output_streams[j];
+        }
+        s->nb_output_streams = k;
+        pthread_mutex_lock(&s->control_lock);
+        of->reaped = 1;
+        pthread_mutex_unlock(&s->control_lock);
+    }
+}
+
+/* demux task: carry out what the control thread queued for the session */
+static void session_handle_requests(StreamSession *s)
+{
+    ControlRequest *req, *next;
+    int ret;
+
+    reap_output_files(s);
+
+    pthread_mutex_lock(&s->control_lock);
+    req = s->requests;
+    s->requests = NULL;
+    pthread_mutex_unlock(&s->control_lock);
+
+    for (; req; req = next) {
+        next = req->next;
+        if (req->type == CONTROL_ATTACH)
+            ret = attach_output_file(s, req->url, &req->pb);
+        else
+            ret = detach_output_file(s, req->url);
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "[session %d] could not %s %s: %s\n", s->index,
+                   req->type == CONTROL_ATTACH ? "attach" : "detach", req->url, av_err2str(ret));
+        avio_closep(&req->pb);
+        av_free(req->url);
+        av_free(req);
+    }
+}
+
+/*
+ * ingest task: run one time slice of reading on the calling worker. returns
+ * 0 when it wants to be scheduled again, a negative value once it is done.
+ */
+static int run_session_demux(StreamSession *s, void *opaque)
+{
+    int i, ret = 0;
+
+    if (s->state == SESSION_STATE_OPENING) {
+        ret = open_session(s);
+        if (ret < 0)
+            goto finish;
+    }
+    // an unlocked look, a request that is missed waits for the next slice
+    if (s->requests)
+        session_handle_requests(s);
+    if (s->nb_failed_outputs != s->nb_failed_outputs_seen)
+        detach_failed_outputs(s);
+
+    for (i = 0; i < session_time_slice; i++) {
+        if (s->abort_request) {
+            ret = AVERROR_EXIT;
+            goto finish;
+        }
+        if (max_packets_per_session && s->nb_packets >= max_packets_per_session) {
+            ret = AVERROR_EOF;
+            goto finish;
+        }
+
+        // caught up with the camera: wait for the reactor rather than in the read.
+        // what libavformat holds is read first, at worst that read waits for
+        // the next packet of the camera and the one after it parks
+        if (s->input_fd >= 0 && !input_buffered(s) && !input_readable(s)) {
+            if (av_gettime_relative() - s->last_input_time > input_timeout) {
+                ret = AVERROR(ETIMEDOUT);
+                av_log(NULL, AV_LOG_ERROR, "[session %d] nothing from %s for %"PRId64"s\n",
+                       s->index, s->input_url, input_timeout / AV_TIME_BASE);
+                goto finish;
+            }
+            reactor_park(s);
+            return TASK_PARKED;
+        }
+
+        s->input_network_read = 0;
+        ret = process_input_packet(s);
+        s->input_held = ret >= 0 && !s->input_network_read;
+        if (ret == AVERROR(EAGAIN)) {
+            if (s->input_fd >= 0) {
+                reactor_park(s);
+                return TASK_PARKED;
+            }
+            // nothing to read right now, let other sessions have the worker
+            s->demux_task.resume_time = av_gettime() + 10000;
+            return 0;
+        }
+        s->last_input_time = av_gettime_relative();
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                av_log(NULL, AV_LOG_ERROR, "[session %d] error reading %s: %s\n",
+                       s->index, s->input_url, av_err2str(ret));
+            goto finish;
+        }
+    }
+
+    return 0;
+
+finish:
+    // audio encoded on this task is flushed here, the video encoders on their own tasks
+    if (ret == AVERROR_EOF) {
+        for (i = 0; i < s->nb_input_streams; i++)
+            if (s->input_streams[i]->decoding_needed & DECODING_FOR_FILTER)
+                filter_video_frame(s, s->input_streams[i], NULL);
+        for (i = 0; i < s->nb_output_streams; i++) {
+            OutputStream *ost = s->output_streams[i];
+            if (ost->encoding_needed && !ost->encoder && !ost->detached)
+                flush_encoder(s, ost);
+        }
+    }
+    // the encoders end the mux queue once they are flushed
+    for (i = 0; i < s->nb_encoders; i++)
+        if (frame_queue_finish(&s->encoders[i].queue))
+            scheduler_wake(&encode_scheduler, &s->encoders[i].task);
+    session_producer_done(s);
+    return ret;
+}
+
+/*
+ * encode task: between the decoder and the mux queue so that a slow encoder
+ * never holds the demuxer up, frames are dropped in the queue instead
+ */
+static int run_session_encode(StreamSession *s, void *opaque)
+{
+    OutputEncoder *e = opaque;
+    AVFrame *frame;
+    int i, ret;
+
+    for (i = 0; i < session_time_slice; i++) {
+        if (s->abort_request) {
+            ret = AVERROR_EXIT;
+            goto finish;
+        }
+
+        ret = frame_queue_try_get(&e->queue, &frame);
+        if (ret == AVERROR(EAGAIN))
+            return TASK_PARKED;
+        if (ret == AVERROR_EOF) {
+            if (e->ost)
+                flush_encoder(s, e->ost);
+            goto finish;
+        }
+
+        ret = encode_frame(s, e->ost, frame);
+        frame_queue_recycle(&e->queue, frame);
+        if (ret < 0)
+            av_log(NULL, AV_LOG_ERROR, "[session %d] error encoding a frame: %s\n",
+                   s->index, av_err2str(ret));
+    }
+
+    return 0;
+
+finish:
+    session_producer_done(s);
+    return ret;
+}
+
+/* egress task: drain the mux queue, parks itself when the queue runs empty */
+/*
+ * mux task, the queue ran dry: nothing else would push out what the output
+ * buffers hold before the next packet comes, a frame interval later. a file
+ * no packet was muxed to yet may still be getting its header from the demux
+ * task, see attach_output_file().
+ */
+static int flush_output_files(StreamSession *s, OutputFile **failed)
+{
+    int i, flush;
+
+    for (i = 0; i < s->nb_output_files; i++) {
+        OutputFile *of;
+        AVIOContext *pb;
+
+        pthread_mutex_lock(&s->control_lock);
+        of    = s->output_files[i];
+        pb    = of->ctx->pb;
+        flush = !of->closed && of->io && of->nb_packets && pb->buf_ptr > pb->buffer;
+        pthread_mutex_unlock(&s->control_lock);
+        if (!flush)
+            continue;
+        s->io_start_time = av_gettime_relative();
+        avio_flush(pb);
+        s->io_start_time = 0;
+        if (pb->error < 0) {
+            *failed = of;
+            return pb->error;
+        }
+    }
+    return 0;
+}
+
+static int run_session_mux(StreamSession *s, void *opaque)
+{
+    OutputFile *of = NULL;
+    QueuedPacket e;
+    int64_t latency;
+    int i, ret;
+
+    for (i = 0; i < session_time_slice; i++) {
+        ret = packet_queue_get(&s->mux_queue, &e);
+        if (ret == AVERROR(EAGAIN)) {
+            ret = flush_output_files(s, &of);
+            if (ret >= 0)
+                return TASK_PARKED;
+            goto fail;
+        }
+        if (ret < 0)
+            return ret;
+
+        if (e.detach) {
+            close_output_file(s, s->output_files[e.ost->file_index]);
+            continue;
+        }
+
+        of  = s->output_files[e.ost->file_index];
+        ret = mux_packet(s, &e.pkt, e.ost);
+        if (ret < 0)
+            goto fail;
+
+        latency = av_gettime_relative() - e.put_time;
+        s->nb_muxed++;
+        s->egress_latency    += latency;
+        s->max_egress_latency = FFMAX(s->max_egress_latency, latency);
+    }
+
+    return 0;
+
+fail:
+    av_log(NULL, AV_LOG_ERROR, "[session %d] error writing to %s: %s\n",
+           s->index, of->ctx->url, av_err2str(ret));
+    // an attached output or a rendition goes alone, the others keep going
+    if (of != s->output_files[0]) {
+        fail_output_file(s, of);
+        return 0;
+    }
+    // stop the ingest side too, nothing can be delivered any more
+    s->abort_request = 1;
+    packet_queue_abort(&s->mux_queue);
+    return ret;
+}
+
+static StreamSession *new_session(int index, const char *input_url, const char *output_url)
+{
+    int i;
+    StreamSession *s = av_mallocz(sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->index         = index;
+    s->input_url     = av_strdup(input_url);
+    s->output_url    = av_strdup(output_url);
+    s->output_format = "flv";
+    s->state         = SESSION_STATE_OPENING;
+    s->gop_start_ts  = AV_NOPTS_VALUE;
+    s->input_fd      = -1;
+    s->snapshot_interval = snapshot_interval;
+    pthread_mutex_init(&s->control_lock, NULL);
+
+    s->demux_task.session = s;
+    s->demux_task.run     = run_session_demux;
+    s->mux_task.session   = s;
+    s->mux_task.run       = run_session_mux;
+
+    // one encoder for the session output when it is transcoded, one per rendition
+    s->nb_encoders = !!with_encoding + nb_renditions;
+    s->nb_live_tasks    = 2 + s->nb_encoders;
+    s->nb_mux_producers = 1 + s->nb_encoders;
+
+    s->output_files = av_mallocz_array(MAX_OUTPUT_FILES, sizeof(*s->output_files));
+    if (!s->input_url || !s->output_url || !s->output_files ||
+        packet_queue_init(&s->mux_queue, mux_queue_max_bytes, mux_queue_max_duration) < 0)
+        goto fail;
+
+    if (s->nb_encoders) {
+        s->encoders = av_mallocz_array(s->nb_encoders, sizeof(*s->encoders));
+        if (!s->encoders)
+            goto fail;
+    }
+    for (i = 0; i < s->nb_encoders; i++) {
+        OutputEncoder *e = &s->encoders[i];
+
+        e->task.session = s;
+        e->task.run     = run_session_encode;
+        e->task.opaque  = e;
+        if (frame_queue_init(&e->queue, encode_queue_max_bytes) < 0)
+            goto fail;
+    }
+
+    return s;
+
+fail:
+    for (i = 0; i < s->nb_encoders && s->encoders; i++)
+        frame_queue_free(&s->encoders[i].queue);
+    av_freep(&s->encoders);
+    packet_queue_free(&s->mux_queue);
+    av_freep(&s->output_files);
+    pthread_mutex_destroy(&s->control_lock);
+    av_freep(&s->input_url);
+    av_freep(&s->output_url);
+    av_freep(&s);
+    return NULL;
+}
+
+
+static void scheduler_init(SessionScheduler *sch)
+{
+    pthread_mutex_init(&sch->lock, NULL);
+    pthread_cond_init(&sch->cond, NULL);
+}
+
+/* keeps the workers waiting for tasks when there are none, for sessions started later */
+static void scheduler_hold(SessionScheduler *sch)
+{
+    pthread_mutex_lock(&sch->lock);
+    sch->nb_unfinished++;
+    pthread_mutex_unlock(&sch->lock);
+}
+
+static void scheduler_release(SessionScheduler *sch)
+{
+    pthread_mutex_lock(&sch->lock);
+    if (!--sch->nb_unfinished)
+        pthread_cond_broadcast(&sch->cond);
+    pthread_mutex_unlock(&sch->lock);
+}
+
+/* a task that does not start queued is parked until scheduler_wake() */
+static void scheduler_add_task(SessionScheduler *sch, SessionTask *task, int start)
+{
+    pthread_mutex_lock(&sch->lock);
+    sch->nb_unfinished++;
+    if (start)
+        scheduler_enqueue(sch, task);
+    pthread_mutex_unlock(&sch->lock);
+}
+
+static SessionTask *scheduler_dequeue(SessionScheduler *sch)
+{
+    SessionTask *task;
+
+    while (sch->nb_unfinished) {
+        int64_t now;
+
+        task = sch->run_head;
+        if (!task) {
+            pthread_cond_wait(&sch->cond, &sch->lock);
+            continue;
+        }
+
+        now = av_gettime();
+        if (task->resume_time > now) {
+            struct timespec ts;
+            ts.tv_sec  =  task->resume_time / 1000000;
+            ts.tv_nsec = (task->resume_time % 1000000) * 1000;
+            pthread_cond_timedwait(&sch->cond, &sch->lock, &ts);
+            continue;
+        }
+
+        sch->run_head = task->next;
+        if (!sch->run_head)
+            sch->run_tail = NULL;
+        task->next = NULL;
+        return task;
+    }
+
+    return NULL;
+}
+
+static void *session_worker_proc(void *arg)
+{
+    SessionScheduler *sch = arg;
+    SessionTask *task;
+    int ret;
+
+    pthread_mutex_lock(&sch->lock);
+    while ((task = scheduler_dequeue(sch))) {
+        pthread_mutex_unlock(&sch->lock);
+
+        ret = task->run(task->session, task->opaque);
+        if (ret < 0)
+            session_task_done(task->session);
+
+        pthread_mutex_lock(&sch->lock);
+        if (ret < 0) {
+            if (!--sch->nb_unfinished)
+                pthread_cond_broadcast(&sch->cond);
+        } else if (ret != TASK_PARKED) {
+            scheduler_enqueue(sch, task);
+        }
+    }
+    pthread_mutex_unlock(&sch->lock);
+
+    return NULL;
 }
 
-
-int main(int argc, char **argv)
+static int scheduler_start(SessionScheduler *sch, int nb_workers)
 {
     int i, ret;
-    int64_t ti;
-
-    char* input_file_name = argv[1];//source rtsp url
-    char* output_file_name = argv[2]; //rtmp url
-    open_input_file(input_file_name);
-    open_output_file(output_file_name,"flv");
-
-    OutputStream *ost;
-    InputStream *ist;
-    int64_t last_ts;
-
-
-    if(with_hook_frame)
-        init_hook_threads();
 
+    sch->workers = av_mallocz_array(nb_workers, sizeof(*sch->workers));
+    if (!sch->workers)
+        return AVERROR(ENOMEM);
 
+    for (i = 0; i < nb_workers; i++) {
+        if ((ret = pthread_create(&sch->workers[i], NULL, session_worker_proc, sch))) {
+            av_log(NULL, AV_LOG_ERROR, "pthread_create failed for %s worker: %s\n",
+                   sch->name, strerror(ret));
+            // with no worker at all nobody would ever drain the run queue
+            return sch->nb_workers ? 0 : AVERROR(ret);
+        }
+        sch->nb_workers++;
+    }
 
-    /* open each encoder */
-    for (i = 0; i < nb_output_streams; i++) {
+    return 0;
+}
 
-        OutputStream *ost = output_streams[i];
-        InputStream *ist = input_streams[ost->source_index];
-        AVCodecParameters *par_dst = ost->st->codecpar;
-        AVCodecParameters *par_src = ost->ref_par;
-        AVRational sar;
-        int i, ret;
-       
+static void scheduler_join(SessionScheduler *sch)
+{
+    int i;
 
-        ret = avcodec_parameters_to_context(ost->enc_ctx, ist->st->codecpar);
-        avcodec_parameters_from_context(par_src, ost->enc_ctx);
-        ret = avcodec_parameters_copy(par_dst, par_src);
-     
+    for (i = 0; i < sch->nb_workers; i++)
+        pthread_join(sch->workers[i], NULL);
+    sch->nb_workers = 0;
 
-        if (!ost->frame_rate.num)
-            ost->frame_rate = ist->framerate;
-        ost->st->avg_frame_rate = ost->frame_rate;
+    av_freep(&sch->workers);
+    pthread_cond_destroy(&sch->cond);
+    pthread_mutex_destroy(&sch->lock);
+}
 
-        // copy timebase while removing common factors
-        if (ost->st->time_base.num <= 0 || ost->st->time_base.den <= 0)
-            ost->st->time_base = av_add_q(av_stream_get_codec_timebase(ost->st), (AVRational){0, 1});
+/* hand the tasks of a new session to the schedulers, the demuxer starts right away */
+static void schedule_session(StreamSession *s)
+{
+    int i;
 
-        // copy disposition
-        ost->st->disposition = ist->st->disposition;
+    scheduler_add_task(&demux_scheduler, &s->demux_task, 1);
+    scheduler_add_task(&mux_scheduler,   &s->mux_task, 0);
+    for (i = 0; i < s->nb_encoders; i++)
+        scheduler_add_task(&encode_scheduler, &s->encoders[i].task, 0);
+}
 
-        
+static int add_session(StreamSession ***sessions, int *nb_sessions,
+                       const char *input_url, const char *output_url)
+{
+    StreamSession *s = new_session(*nb_sessions, input_url, output_url);
+    if (!s)
+        return AVERROR(ENOMEM);
 
+    GROW_ARRAY(*sessions, *nb_sessions);
+    if (!*sessions) {
+        free_session(&s);
+        return AVERROR(ENOMEM);
+    }
+    (*sessions)[*nb_sessions - 1] = s;
+    return 0;
+}
 
-        switch (par_dst->codec_type) {
-        case AVMEDIA_TYPE_AUDIO:
+/* each non empty line of the file is "<input url> <output url>" */
+static int read_session_list(const char *filename, StreamSession ***sessions, int *nb_sessions)
+{
+    char line[4096], input_url[2048], output_url[2048];
+    int ret = 0;
+    FILE *f = fopen(filename, "r");
 
-            break;
-        case AVMEDIA_TYPE_VIDEO:
+    if (!f) {
+        ret = AVERROR(errno);
+        av_log(NULL, AV_LOG_ERROR, "could not open session list %s\n", filename);
+        return ret;
+    }
 
-            sar = par_src->sample_aspect_ratio;
-            ost->st->sample_aspect_ratio = par_dst->sample_aspect_ratio = sar;
-            ost->st->avg_frame_rate = ist->st->avg_frame_rate;
-            ost->st->r_frame_rate = ist->st->r_frame_rate;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line, "%2047s %2047s", input_url, output_url) != 2)
+            continue;
+        if ((ret = add_session(sessions, nb_sessions, input_url, output_url)) < 0)
             break;
-        }
-
-        ost->mux_timebase = ist->st->time_base;
-
+    }
 
+    fclose(f);
+    return ret;
+}
 
+/*
+ * control socket: one command per line, one line back, "ok ..." or
+ * "error ..." and a json object or array for stats. a single client at a
+ * time, the sessions keep running whatever it does.
+ *
+ *     start <input url> <output url>      ok <session>
+ *     stop <session>
+ *     attach <session> <output url>       push a copy of the session there too
+ *     detach <session> <output url>
+ *     snapshot_interval <session> <ms>
+ *     stats [<session>]
+ *     quit                                stop every session and exit
+ *
+ * ok to an attach means the output is connected and queued for its session,
+ * a failure to write its header or the cached gop later is only logged, and
+ * stats then show the output as detached.
+ */
+static StreamSession **sessions;    /* only grows, from main and then the control thread */
+static int nb_sessions;
+static int control_fd = -1;
+static pthread_t control_thread;
+static int64_t control_open_time;   /* of the attach the control thread is connecting */
 
+static void json_string(AVBPrint *bp, const char *str)
+{
+    av_bprint_chars(bp, '"', 1);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            av_bprint_chars(bp, '\\', 1);
+        if ((unsigned char)*str >= 0x20)
+            av_bprint_chars(bp, *str, 1);
     }
+    av_bprint_chars(bp, '"', 1);
+}
 
+static void session_stats(AVBPrint *bp, StreamSession *s)
+{
+    static const char *const state_names[] = { "opening", "running", "finished" };
+    int i;
 
-    avformat_write_header(oc, NULL);
-
+    // the counters are read on the fly, only the output files need the lock
+    pthread_mutex_lock(&s->control_lock);
+    av_bprintf(bp, "{\"session\":%d,\"state\":\"%s\",\"input\":", s->index, state_names[s->state]);
+    json_string(bp, s->input_url);
+    av_bprintf(bp, ",\"packets\":%"PRId64",\"muxed\":%"PRId64",\"dropped\":%"PRId64
+               ",\"queue_bytes\":%"PRId64",\"snapshot_interval\":%"PRId64",\"parked\":%"PRId64
+               ",\"outputs\":[",
+               s->nb_packets, s->nb_muxed, s->mux_queue.nb_dropped + s->nb_dropped,
+               s->mux_queue.bytes, s->snapshot_interval / 1000, s->nb_parks);
+    for (i = 0; i < s->nb_output_files; i++) {
+        OutputFile *of = s->output_files[i];
+
+        av_bprintf(bp, "%s{\"url\":", i ? "," : "");
+        json_string(bp, of->ctx->url);
+        av_bprintf(bp, ",\"packets\":%"PRId64",\"writes\":%"PRId64",\"write_bytes\":%"PRId64",\"detached\":%d}",
+                   of->nb_packets, of->nb_writes, of->write_bytes, of->detached);
+    }
+    av_bprintf(bp, "]}");
+    pthread_mutex_unlock(&s->control_lock);
+}
 
-    av_dump_format(oc ,0, oc->url, 1);
+/*
+ * the connection of an attached output: on the control thread an open that
+ * takes longer than -write_timeout is given up, so that a dead host does
+ * not hang the control socket. the session's tasks write to it later like
+ * to any other output.
+ */
+static int attach_interrupt_cb(void *ctx)
+{
+    StreamSession *s = ctx;
 
+    if (pthread_equal(pthread_self(), control_thread))
+        return s->abort_request || av_gettime_relative() - control_open_time > mux_write_timeout;
+    return output_interrupt_cb(ctx);
+}
 
-    int frame_cnt = 0;
-    while (frame_cnt<20000) {
+/* queue an attach or detach for the demux task of s */
+static int control_request(StreamSession *s, int type, const char *url)
+{
+    AVIOInterruptCB cb = { attach_interrupt_cb, s };
+    ControlRequest *req = av_mallocz(sizeof(*req)), **p;
+    int ret = 0;
 
-        frame_cnt++;
+    if (!req || !(req->url = av_strdup(url))) {
+        av_free(req);
+        return AVERROR(ENOMEM);
+    }
+    req->type = type;
 
-        InputStream *ist;
-        AVPacket pkt;
-        int ret, i, j;
-        int64_t duration;
-        int64_t pkt_dts;
+    // the slow part, the rtmp handshake, happens here and not on the demux task
+    if (type == CONTROL_ATTACH) {
+        control_open_time = av_gettime_relative();
+        ret = avio_open2(&req->pb, url, AVIO_FLAG_WRITE, &cb, NULL);
+    }
 
-        av_read_frame(ic, &pkt);
-      
+    pthread_mutex_lock(&s->control_lock);
+    if (ret >= 0 && s->closing)
+        ret = AVERROR_EOF;
+    if (ret >= 0) {
+        for (p = &s->requests; *p; p = &(*p)->next)
+            ;
+        *p  = req;
+        req = NULL;
+    }
+    pthread_mutex_unlock(&s->control_lock);
 
+    if (req) {
+        avio_closep(&req->pb);
+        av_free(req->url);
+        av_free(req);
+    }
+    return ret;
+}
 
-        ist = input_streams[pkt.stream_index];
-        ist->data_size += pkt.size;
-        ist->nb_packets++;
+static StreamSession *control_session(const char *arg)
+{
+    char *end;
+    long index;
 
+    if (!arg)
+        return NULL;
+    index = strtol(arg, &end, 10);
+    return *end || index < 0 || index >= nb_sessions ? NULL : sessions[index];
+}
 
-        if (pkt.dts != AV_NOPTS_VALUE)
-            pkt.dts += av_rescale_q(0, AV_TIME_BASE_Q, ist->st->time_base);
-        if (pkt.pts != AV_NOPTS_VALUE)
-            pkt.pts += av_rescale_q(0, AV_TIME_BASE_Q, ist->st->time_base);
+/* returns 1 once the client asked to quit */
+static int control_command(int fd, char *line)
+{
+    char *save = NULL;
+    char *cmd  = strtok_r(line, " \t\r\n", &save);
+    char *arg1 = cmd  ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    char *arg2 = arg1 ? strtok_r(NULL, " \t\r\n", &save) : NULL;
+    StreamSession *s = control_session(arg1);
+    AVBPrint bp;
+    int i, ret = 0, quit = 0;
+
+    if (!cmd)
+        return 0;
+    av_bprint_init(&bp, 0, AV_BPRINT_SIZE_UNLIMITED);
 
+    if (!strcmp(cmd, "start") && arg2) {
+        ret = add_session(&sessions, &nb_sessions, arg1, arg2);
+        if (ret >= 0) {
+            schedule_session(sessions[nb_sessions - 1]);
+            av_bprintf(&bp, "ok %d", nb_sessions - 1);
+        }
+    } else if (!strcmp(cmd, "stop") && s) {
+        s->abort_request = 1;
+        av_bprintf(&bp, "ok");
+    } else if ((!strcmp(cmd, "attach") || !strcmp(cmd, "detach")) && s && arg2) {
+        ret = control_request(s, !strcmp(cmd, "attach") ? CONTROL_ATTACH : CONTROL_DETACH, arg2);
+        av_bprintf(&bp, "ok");
+    } else if (!strcmp(cmd, "snapshot_interval") && s && arg2) {
+        s->snapshot_interval = strtoll(arg2, NULL, 10) * 1000;
+        av_bprintf(&bp, "ok");
+    } else if (!strcmp(cmd, "stats") && (s || !arg1)) {
+        if (s) {
+            session_stats(&bp, s);
+        } else {
+            av_bprintf(&bp, "[");
+            for (i = 0; i < nb_sessions; i++) {
+                av_bprintf(&bp, i ? "," : "");
+                session_stats(&bp, sessions[i]);
+            }
+            av_bprintf(&bp, "]");
+        }
+    } else if (!strcmp(cmd, "quit")) {
+        for (i = 0; i < nb_sessions; i++)
+            sessions[i]->abort_request = 1;
+        av_bprintf(&bp, "ok");
+        quit = 1;
+    } else {
+        av_bprintf(&bp, "error bad command, argument or session");
+    }
+    if (ret < 0) {
+        av_bprint_clear(&bp);
+        av_bprintf(&bp, "error %s", av_err2str(ret));
+    }
+    av_bprintf(&bp, "\n");
 
+    if (write(fd, bp.str, bp.len) < 0)
+        av_log(NULL, AV_LOG_VERBOSE, "control client went away: %s\n", strerror(errno));
+    av_bprint_finalize(&bp, NULL);
+    return quit;
+}
 
+static void *control_thread_proc(void *arg)
+{
+    char line[4096];
+    int quit = 0;
 
-        pkt_dts = av_rescale_q_rnd(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
+    while (!quit) {
+        int fd = accept(control_fd, NULL, NULL);
+        FILE *f;
 
-        duration = av_rescale_q(0, (AVRational){ 1, 1 }, ist->st->time_base);
-        if (pkt.pts != AV_NOPTS_VALUE) {
-            pkt.pts += duration;
-            ist->max_pts = FFMAX(pkt.pts, ist->max_pts);
-            ist->min_pts = FFMIN(pkt.pts, ist->min_pts);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            av_log(NULL, AV_LOG_ERROR, "control socket: %s\n", strerror(errno));
+            break;
         }
+        f = fdopen(fd, "r");
+        if (!f) {
+            close(fd);
+            continue;
+        }
+        while (!quit && fgets(line, sizeof(line), f))
+            quit = control_command(fd, line);
+        fclose(f);
+    }
 
-        if (pkt.dts != AV_NOPTS_VALUE)
-            pkt.dts += duration;
-
-        pkt_dts = av_rescale_q_rnd(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q, AV_ROUND_NEAR_INF|AV_ROUND_PASS_MINMAX);
-        
-
-        if (pkt.dts != AV_NOPTS_VALUE)
-            last_ts = av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q);
+    // from now on the workers end with the last session
+    scheduler_release(&demux_scheduler);
+    scheduler_release(&mux_scheduler);
+    scheduler_release(&encode_scheduler);
+    return NULL;
+}
 
-        int repeating = 0;
-        int eof_reached = 0;
+static int start_control_thread(const char *path)
+{
+    struct sockaddr_un addr = { AF_UNIX };
+    int ret;
 
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return AVERROR(ENAMETOOLONG);
+    strcpy(addr.sun_path, path);
+
+    control_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (control_fd < 0)
+        return AVERROR(errno);
+    unlink(path);
+    // whoever can connect can push the cameras anywhere
+    if (bind(control_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(control_fd, 4) < 0) {
+        ret = AVERROR(errno);
+        close(control_fd);
+        return ret;
+    }
 
-        if (!ist->saw_first_ts) {
-            ist->dts = ist->st->avg_frame_rate.num ? - ist->dec_ctx->has_b_frames * AV_TIME_BASE / av_q2d(ist->st->avg_frame_rate) : 0;
-            ist->pts = 0;
-            if (pkt.pts != AV_NOPTS_VALUE) {
-                ist->dts += av_rescale_q(pkt.pts, ist->st->time_base, AV_TIME_BASE_Q);
-                ist->pts = ist->dts; //unused but better to set it to a value thats not totally wrong
-            }
-            ist->saw_first_ts = 1;
-        }
+    // released by the control thread when it ends
+    scheduler_hold(&demux_scheduler);
+    scheduler_hold(&mux_scheduler);
+    scheduler_hold(&encode_scheduler);
+    if ((ret = pthread_create(&control_thread, NULL, control_thread_proc, NULL))) {
+        scheduler_release(&demux_scheduler);
+        scheduler_release(&mux_scheduler);
+        scheduler_release(&encode_scheduler);
+        close(control_fd);
+        return AVERROR(ret);
+    }
+    return 0;
+}
 
-        if (ist->next_dts == AV_NOPTS_VALUE)
-            ist->next_dts = ist->dts;
-        if (ist->next_pts == AV_NOPTS_VALUE)
-            ist->next_pts = ist->pts;
+static int add_stream_spec(const char *arg)
+{
+    StreamSpec *spec;
+    char buf[64], *end;
+    size_t len = strlen(arg);
 
+    GROW_ARRAY(stream_specs, nb_stream_specs);
+    if (!stream_specs)
+        return AVERROR(ENOMEM);
+    spec = &stream_specs[nb_stream_specs - 1];
+    spec->arg   = arg;
+    spec->index = -1;
 
-        if (pkt.dts != AV_NOPTS_VALUE) {
-            ist->next_dts = ist->dts = av_rescale_q(pkt.dts, ist->st->time_base, AV_TIME_BASE_Q);
-            if (ist->dec_ctx->codec_type != AVMEDIA_TYPE_VIDEO)
-                ist->next_pts = ist->pts = ist->dts;
-        }
+    if (len && arg[len - 1] == '?') {
+        spec->optional = 1;
+        len--;
+    }
+    if (!len || len >= sizeof(buf))
+        goto fail;
+    memcpy(buf, arg, len);
+    buf[len] = 0;
+
+    if (av_isdigit(buf[0])) {
+        spec->index = strtol(buf, &end, 10);
+        if (*end)
+            goto fail;
+        return 0;
+    }
 
+    switch (buf[0]) {
+    case 'v': spec->type = AVMEDIA_TYPE_VIDEO;    break;
+    case 'a': spec->type = AVMEDIA_TYPE_AUDIO;    break;
+    case 's': spec->type = AVMEDIA_TYPE_SUBTITLE; break;
+    case 'd': spec->type = AVMEDIA_TYPE_DATA;     break;
+    default: goto fail;
+    }
+    if (!buf[1])
+        return 0;
+    if (buf[1] != ':' || !buf[2])
+        goto fail;
+    if (av_isdigit(buf[2])) {
+        spec->nth = strtol(buf + 2, &end, 10);
+        if (*end)
+            goto fail;
+    } else if (strlen(buf + 2) < sizeof(spec->language)) {
+        strcpy(spec->language, buf + 2);
+    } else {
+        goto fail;
+    }
+    return 0;
 
-        AVPacket avpkt = pkt;
+fail:
+    av_log(NULL, AV_LOG_ERROR, "invalid stream map %s\n", arg);
+    nb_stream_specs--;
+    return AVERROR(EINVAL);
+}
 
-        while(with_decoding){
-            int64_t duration_dts = 0;
-            int64_t duration_pts = 0;
-            int got_output = 0;
-            int decode_failed = 0;
+static int add_rendition(const char *spec)
+{
+    AVDictionaryEntry *e = NULL;
+    Rendition *r;
+    int ret;
 
-            ist->pts = ist->next_pts;
-            ist->dts = ist->next_dts;
+    GROW_ARRAY(renditions, nb_renditions);
+    r = &renditions[nb_renditions - 1];
+    if ((ret = av_dict_parse_string(&r->opts, spec, "=", ":", 0)) < 0)
+        goto fail;
+
+    while ((e = av_dict_get(r->opts, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        if (!strcmp(e->key, "name"))
+            r->name = e->value;
+        else if (!strcmp(e->key, "size"))
+            ret = parse_snapshot_size(e->value, &r->width, &r->height);
+        else
+            ret = av_dict_set(&r->encoder_opts, e->key, e->value, 0);
+        if (ret < 0)
+            goto fail;
+    }
+    if (!r->name) {
+        av_log(NULL, AV_LOG_ERROR, "rendition %s has no name\n", spec);
+        ret = AVERROR(EINVAL);
+        goto fail;
+    }
+    return 0;
 
-            
+fail:
+    av_log(NULL, AV_LOG_ERROR, "invalid rendition %s\n", spec);
+    av_dict_free(&r->opts);
+    av_dict_free(&r->encoder_opts);
+    nb_renditions--;
+    return ret;
+}
 
-            switch (ist->dec_ctx->codec_type) {
-                case AVMEDIA_TYPE_AUDIO:
-                    ret = decode_audio    (ist, repeating ? NULL : &avpkt, &got_output,
-                                           &decode_failed);
-                    break;
-                case AVMEDIA_TYPE_VIDEO:
+static void show_usage(void)
+{
+    printf("usage: stream_push [options] [input_url output_url ...]\n"
+           "  -workers n         number of demux threads shared by all sessions (default %d)\n"
+           "  -mux_workers n     number of mux threads shared by all sessions (default %d)\n"
+           "  -sessions file     read \"input_url output_url\" pairs from file, one per line\n"
+           "  -max_packets n     stop a session after n packets, 0 for no limit (default %d)\n"
+           "  -queue_size n      bytes buffered between demuxer and muxer per session (default %"PRId64")\n"
+           "  -queue_duration n  milliseconds buffered between demuxer and muxer per session (default %"PRId64")\n"
+           "  -input_timeout n   milliseconds without data after which a session ends (default %"PRId64")\n"
+           "  -write_timeout n   milliseconds after which a blocked write aborts its output (default %"PRId64")\n"
+           "  -low_latency 0|1   write packets already in dts order without interleaving, flush each\n"
+           "                     one and wait at most 100ms for a late stream\n"
+           "  -max_interleave_delta n  milliseconds the muxer waits for a late stream (default 10000)\n"
+           "  -flush_packets 0|1  flush the output after every packet (default on with -low_latency)\n"
+           "  -output_buffer_size n  bytes sent to an output in one write at most, 0 for no buffer (default %d)\n"
+           "  -output_flush_interval n  milliseconds the output buffer holds data at most (default %"PRId64")\n"
+           "  -gop_cache 0|1     keep the packets since the last keyframe so that outputs attached\n"
+           "                     later start right away on a full gop\n"
+           "  -gop_cache_size n  bytes a stream may cache, a longer gop is not cached (default %"PRId64")\n"
+           "  -control path      unix socket taking commands while running: start, stop, attach, detach,\n"
+           "                     snapshot_interval, stats and quit, one per line\n"
+           "  -probe_cache dir   keep the probed codec parameters of every source in dir and only\n"
+           "                     probe a source again when it no longer matches them\n"
+           "  -encode 0|1               re-encode the video instead of copying it (default %d)\n"
+           "  -map spec                 push this input stream to every output, repeat for more: an index, v, a, s or d\n"
+           "                            for the first stream of a type, a:1 for the second, a:eng for the first in a\n"
+           "                            language, a trailing ? when a source may lack it (default v and a?)\n"
+           "  -vf filters               filter the decoded video before the snapshot hook and the encoders,\n"
+           "                            e.g. fps=5,scale=640:-2, copied video is not filtered\n"
+           "  -filter_threads n         slice threads of every filter graph, 0 for automatic (default %d)\n"
+           "  -acodec c                 copy the audio, auto to encode it to aac unless it is aac or mp3 already,\n"
+           "                            or the name of the audio encoder to use (default %s)\n"
+           "  -encode_workers n         threads running the encoders of all sessions (default %d)\n"
+           "  -encode_queue_size n      bytes of decoded frames waiting for the encoder per session (default %"PRId64")\n"
+           "  -rendition spec           also push the video encoded as name=720p:size=1280x720:b=2500k to output_url_720p,\n"
+           "                            keys other than name and size are encoder options, can be repeated\n"
+           "  -enc_threads n            threads of every encoder, 0 for automatic (default %d)\n"
+           "  -enc_thread_type t        frame, slice or frame+slice (default %s)\n"
+           "  -snapshot_interval n      milliseconds of stream time between snapshots, 0 for every frame (default %"PRId64")\n"
+           "  -snapshot_align 0|1       align the snapshot intervals on the wall clock\n"
+           "  -scene_threshold n        skip a snapshot whose luma differs from the last one by less than n\n"
+           "                            on average, 0-255, 0 takes every snapshot (default 0)\n"
+           "  -keyframe_snapshots 0|1  without encoding, decode only keyframes for the snapshot hook\n"
+           "  -hook_queue_size n        bytes of frames waiting for the hook thread, oldest dropped first (default %"PRId64")\n"
+           "  -snapshot_format f        bmp, jpeg, png or webp (default %s)\n"
+           "  -snapshot_quality n       jpeg qscale 2-31, webp quality 0-100, png compression 0-9\n"
+           "  -snapshot_name pattern    %%S session, %%I stream, %%T pts in ms, %%N sequence, %%E extension (default %s)\n"
+           "  -snapshot_size WxH        size of the snapshots, -1 for one side keeps the aspect ratio (default source size)\n"
+           "  -snapshot_scale alg       fast_bilinear, bilinear, bicubic, area, point or lanczos (default %s)\n"
+           "  -snapshot_output spec     one more image per snapshot, e.g. format=jpeg:size=320x180:scale=area:name=thumb_%%N.%%E,\n"
+           "                            unset keys come from the -snapshot_* options, %%W and %%H in names give the size\n"
+           "                            format=shm:name=/cam_%%S_%%I publishes frames in a shared memory ring of slots=n frames\n"
+           "                            (default 4, name /stream_push_%%S_%%I) instead, in pix_fmt (default the decoder's), see frame_ring.h\n"
+           "  -hook_workers n           threads writing snapshots, give -snapshot_name a %%S, %%I or %%N with more than one (default %d)\n"
+           "  -hook_slices n            threads converting one frame larger than 1080p (default %d)\n"
+           "  -loglevel n               av_log level, 40 for verbose, 48 for debug\n",
+           nb_session_workers, nb_mux_workers, max_packets_per_session, mux_queue_max_bytes,
+           mux_queue_max_duration / 1000, input_timeout / 1000, mux_write_timeout / 1000,
+           output_buffer_size, output_flush_interval / 1000, gop_cache_max_bytes,
+           with_encoding, filter_threads, audio_codec, nb_encode_workers, encode_queue_max_bytes, enc_thread_count, enc_thread_type,
+           snapshot_interval / 1000,
+           hook_queue_max_bytes, snapshot_format, snapshot_name,
+           snapshot_scale, nb_hook_workers, hook_slices);
+}
 
-                    ret = decode_video (ist, repeating ? NULL : &avpkt, &got_output, &duration_pts, 0,
-                                           &decode_failed);
 
+int main(int argc, char **argv)
+{
+    int i, ret;
+    const char **session_urls = NULL;
+    int nb_session_urls = 0;
+    const char *session_list = NULL;
+
+    for (i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+
+        if (opt[0] == '-' && i + 1 < argc) {
+            const char *arg = argv[++i];
+
+            if (!strcmp(opt, "-workers")) {
+                nb_session_workers = atoi(arg);
+            } else if (!strcmp(opt, "-mux_workers")) {
+                nb_mux_workers = atoi(arg);
+            } else if (!strcmp(opt, "-max_packets")) {
+                max_packets_per_session = atoi(arg);
+            } else if (!strcmp(opt, "-sessions")) {
+                session_list = arg;
+            } else if (!strcmp(opt, "-queue_size")) {
+                mux_queue_max_bytes = strtoll(arg, NULL, 10);
+            } else if (!strcmp(opt, "-queue_duration")) {
+                mux_queue_max_duration = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-input_timeout")) {
+                input_timeout = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-write_timeout")) {
+                mux_write_timeout = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-low_latency")) {
+                low_latency = atoi(arg);
+            } else if (!strcmp(opt, "-max_interleave_delta")) {
+                max_interleave_delta = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-flush_packets")) {
+                flush_packets = atoi(arg);
+            } else if (!strcmp(opt, "-output_buffer_size")) {
+                output_buffer_size = atoi(arg);
+            } else if (!strcmp(opt, "-output_flush_interval")) {
+                output_flush_interval = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-gop_cache")) {
+                gop_cache = atoi(arg);
+            } else if (!strcmp(opt, "-gop_cache_size")) {
+                gop_cache_max_bytes = strtoll(arg, NULL, 10);
+            } else if (!strcmp(opt, "-control")) {
+                control_path = arg;
+            } else if (!strcmp(opt, "-probe_cache")) {
+                probe_cache_dir = arg;
+            } else if (!strcmp(opt, "-keyframe_snapshots")) {
+                keyframe_snapshots = atoi(arg);
+            } else if (!strcmp(opt, "-snapshot_interval")) {
+                snapshot_interval = strtoll(arg, NULL, 10) * 1000;
+            } else if (!strcmp(opt, "-scene_threshold")) {
+                scene_threshold = strtod(arg, NULL);
+            } else if (!strcmp(opt, "-snapshot_align")) {
+                snapshot_align = atoi(arg);
+            } else if (!strcmp(opt, "-hook_queue_size")) {
+                hook_queue_max_bytes = strtoll(arg, NULL, 10);
+            } else if (!strcmp(opt, "-encode")) {
+                with_encoding = !!atoi(arg);
+            } else if (!strcmp(opt, "-acodec")) {
+                audio_codec = arg;
+            } else if (!strcmp(opt, "-encode_workers")) {
+                nb_encode_workers = atoi(arg);
+            } else if (!strcmp(opt, "-encode_queue_size")) {
+                encode_queue_max_bytes = strtoll(arg, NULL, 10);
+            } else if (!strcmp(opt, "-map")) {
+                if (add_stream_spec(arg) < 0)
+                    return 1;
+            } else if (!strcmp(opt, "-vf")) {
+                video_filters = arg;
+            } else if (!strcmp(opt, "-filter_threads")) {
+                filter_threads = FFMAX(atoi(arg), 0);
+            } else if (!strcmp(opt, "-rendition")) {
+                if (add_rendition(arg) < 0)
+                    return 1;
+            } else if (!strcmp(opt, "-enc_threads")) {
+                enc_thread_count = FFMAX(atoi(arg), 0);
+            } else if (!strcmp(opt, "-enc_thread_type")) {
+                enc_thread_type = arg;
+            } else if (!strcmp(opt, "-snapshot_format")) {
+                snapshot_format = arg;
+            } else if (!strcmp(opt, "-snapshot_quality")) {
+                snapshot_quality = atoi(arg);
+            } else if (!strcmp(opt, "-snapshot_name")) {
+                snapshot_name = arg;
+            } else if (!strcmp(opt, "-snapshot_size")) {
+                snapshot_size = arg;
+            } else if (!strcmp(opt, "-snapshot_scale")) {
+                snapshot_scale = arg;
+            } else if (!strcmp(opt, "-snapshot_output")) {
+                GROW_ARRAY(snapshot_output_specs, nb_snapshot_output_specs);
+                snapshot_output_specs[nb_snapshot_output_specs - 1] = arg;
+            } else if (!strcmp(opt, "-hook_workers")) {
+                nb_hook_workers = av_clip(atoi(arg), 1, 64);
+            } else if (!strcmp(opt, "-hook_slices")) {
+                hook_slices = av_clip(atoi(arg), 1, MAX_HOOK_SLICES);
+            } else if (!strcmp(opt, "-loglevel")) {
+                av_log_set_level(atoi(arg));
+            } else {
+                av_log(NULL, AV_LOG_ERROR, "unknown option %s\n", opt);
+                show_usage();
+                return 1;
+            }
+        } else if (opt[0] != '-') {
+            GROW_ARRAY(session_urls, nb_session_urls);
+            if (!session_urls)
+                return 1;
+            session_urls[nb_session_urls - 1] = opt;
+        } else {
+            show_usage();
+            return 1;
+        }
+    }
 
-                    if (!repeating || got_output) {
-                        if (pkt.duration) {
-                            duration_dts = av_rescale_q(pkt.duration, ist->st->time_base, AV_TIME_BASE_Q);
-                        } else if(ist->dec_ctx->framerate.num != 0 && ist->dec_ctx->framerate.den != 0) {
-                            int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict+1 : ist->dec_ctx->ticks_per_frame;
-                            duration_dts = ((int64_t)AV_TIME_BASE *
-                                            ist->dec_ctx->framerate.den * ticks) /
-                                            ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
-                        }
+    if (!nb_stream_specs && (add_stream_spec("v") < 0 || add_stream_spec("a?") < 0))
+        return 1;
 
-                        if(ist->dts != AV_NOPTS_VALUE && duration_dts) {
-                            ist->next_dts += duration_dts;
-                        }else
-                            ist->next_dts = AV_NOPTS_VALUE;
-                    }
+    // filters need every frame, a keyframe only decoder gives them one per gop
+    if (keyframe_snapshots && video_filters) {
+        av_log(NULL, AV_LOG_ERROR, "-keyframe_snapshots 1 cannot be used with -vf\n");
+        return 1;
+    }
 
-                    if (got_output) {
-                        if (duration_pts > 0) {
-                            ist->next_pts += av_rescale_q(duration_pts, ist->st->time_base, AV_TIME_BASE_Q);
-                        } else {
-                            ist->next_pts += duration_dts;
-                        }
-                    }
-                    break;
-            }
+    // sessions are created once all options are known, whatever their position
+    if (nb_session_urls % 2) {
+        show_usage();
+        return 1;
+    }
+    for (i = 0; i < nb_session_urls; i += 2)
+        if (add_session(&sessions, &nb_sessions, session_urls[i], session_urls[i + 1]) < 0)
+            return 1;
+    av_freep(&session_urls);
+    if (session_list && read_session_list(session_list, &sessions, &nb_sessions) < 0)
+        return 1;
+
+    if (!nb_sessions && !control_path) {
+        show_usage();
+        return 1;
+    }
 
+    // workers beyond the number of sessions would only sit idle, unless
+    // more sessions can come through the control socket
+    if (!control_path) {
+        nb_session_workers = av_clip(nb_session_workers, 1, nb_sessions);
+        nb_mux_workers     = av_clip(nb_mux_workers, 1, nb_sessions);
+        nb_encode_workers  = av_clip(nb_encode_workers, 1, FFMAX(1, nb_sessions * (!!with_encoding + nb_renditions)));
+    }
 
-            if (got_output)
-                ist->got_output = 1;
+    avformat_network_init();
 
-            if (!got_output)
-                break;
+    if(with_hook_frame && init_hook_threads() < 0)
+        return 1;
+    scene_init();
 
-            repeating = 1;
-        }
+    scheduler_init(&demux_scheduler);
+    scheduler_init(&mux_scheduler);
+    scheduler_init(&encode_scheduler);
+    for (i = 0; i < nb_sessions; i++)
+        schedule_session(sessions[i]);
 
+    // without it every input is polled, which works, only with more threads busy
+    if ((ret = reactor_start()) < 0)
+        av_log(NULL, AV_LOG_WARNING, "could not start the input reactor: %s\n", av_err2str(ret));
 
+    if (control_path && (ret = start_control_thread(control_path)) < 0) {
+        av_log(NULL, AV_LOG_ERROR, "could not open the control socket %s: %s\n",
+               control_path, av_err2str(ret));
+        return 1;
+    }
 
-        if(!with_encoding){
-            ist->dts = ist->next_dts;
-            switch (ist->dec_ctx->codec_type) {
-            case AVMEDIA_TYPE_AUDIO:
-                ist->next_dts += ((int64_t)AV_TIME_BASE * ist->dec_ctx->frame_size) /
-                                 ist->dec_ctx->sample_rate;
-                break;
-            case AVMEDIA_TYPE_VIDEO:
-                if (ist->framerate.num) {
-                    // TODO: Remove work-around for c99-to-c89 issue 7
-                    AVRational time_base_q = AV_TIME_BASE_Q;
-                    int64_t next_dts = av_rescale_q(ist->next_dts, time_base_q, av_inv_q(ist->framerate));
-                    ist->next_dts = av_rescale_q(next_dts + 1, av_inv_q(ist->framerate), time_base_q);
-                } else if (pkt.duration) {
-                    ist->next_dts += av_rescale_q(pkt.duration, ist->st->time_base, AV_TIME_BASE_Q);
-                } else if(ist->dec_ctx->framerate.num != 0) {
-                    int ticks= av_stream_get_parser(ist->st) ? av_stream_get_parser(ist->st)->repeat_pict + 1 : ist->dec_ctx->ticks_per_frame;
-                    ist->next_dts += ((int64_t)AV_TIME_BASE *
-                                      ist->dec_ctx->framerate.den * ticks) /
-                                      ist->dec_ctx->framerate.num / ist->dec_ctx->ticks_per_frame;
-                }
-                break;
-            }
-            ist->pts = ist->dts;
-            ist->next_pts = ist->next_dts;
-            OutputStream *ost = output_streams[pkt.stream_index];
-            do_streamcopy(ist, ost, &pkt);   
-        }
+    if ((ret = scheduler_start(&mux_scheduler, nb_mux_workers)) < 0 ||
+        ((with_encoding || nb_renditions) && (ret = scheduler_start(&encode_scheduler, nb_encode_workers)) < 0) ||
+        (ret = scheduler_start(&demux_scheduler, nb_session_workers)) < 0)
+        return 1;
 
+    scheduler_join(&demux_scheduler);
+    scheduler_join(&encode_scheduler);
+    scheduler_join(&mux_scheduler);
+    reactor_stop();
 
+    if (control_fd >= 0) {
+        pthread_join(control_thread, NULL);
+        close(control_fd);
+        unlink(control_path);
+    }
 
-       
+    if(with_hook_frame)
+        free_hook_threads();
 
-        
+    for (i = 0; i < nb_sessions; i++)
+        free_session(&sessions[i]);
+    av_freep(&sessions);
 
+    {
+        struct rusage usage;
+        // compare with the sum over separate processes when weighing renditions
+        if (!getrusage(RUSAGE_SELF, &usage))
+            av_log(NULL, AV_LOG_INFO, "peak rss %ld kB, cpu %.2fs user %.2fs system\n", usage.ru_maxrss,
+                   usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1000000.0,
+                   usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1000000.0);
+    }
 
+    for (i = 0; i < nb_renditions; i++) {
+        av_dict_free(&renditions[i].opts);
+        av_dict_free(&renditions[i].encoder_opts);
     }
+    av_freep(&renditions);
+    av_freep(&stream_specs);
+
+    avformat_network_deinit();
    
     return 0;
 }
-
-
@@ -0,0 +1,229 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * frame ring writer and reader in two processes
+ *
+ *     cc -O2 -Wall -Wextra -I. -o frame_ring_test tests/frame_ring_test.c frame_ring.c -lrt
+ *     ./frame_ring_test
+ *
+ * the parent pushes frames as fast as it can, every byte of a frame set to
+ * its frame number, and aborts every seventh one half written. the child
+ * attaches once the pusher is running and checks that every frame it finds
+ * valid is whole and newer than the one before. halfway through the pusher
+ * replaces the ring with a larger one, which the reader has to notice and
+ * map again. exits 0 when both sides agree.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "frame_ring.h"
+
+#define NB_SLOTS     4
+#define WIDTH        64
+#define HEIGHT       48
+#define NB_FRAMES    200000     /* per ring */
+#define TIMEOUT_SECS 30
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void push_frame(FrameRing *ring, int width, int height, int abort)
+{
+    FrameRingSlotHeader *slot;
+    uint64_t number = ring->header->latest + 1;
+    uint8_t *data = frame_ring_write_begin(ring, &slot);
+    size_t size = (size_t)width * height;
+
+    if (abort) {
+        // what a failed conversion leaves behind must never show up
+        memset(data, 0xff, size / 2);
+        frame_ring_write_abort(slot);
+        return;
+    }
+
+    memset(data, number & 0xfe, size);
+    slot->nb_planes   = 1;
+    slot->linesize[0] = width;
+    slot->offset[0]   = 0;
+    slot->width       = width;
+    slot->height      = height;
+    slot->format      = 0;
+    slot->pts         = number * 1000;
+    slot->data_size   = size;
+    frame_ring_write_end(ring, slot);
+}
+
+static int run_writer(const char *name, pid_t reader)
+{
+    FrameRing ring;
+    int64_t deadline = now_us() + TIMEOUT_SECS * 1000000LL;
+    int round, i, ret, status;
+
+    for (round = 0; round < 2; round++) {
+        int width = WIDTH << round, height = HEIGHT << round;
+
+        if ((ret = frame_ring_create(&ring, name, NB_SLOTS, (size_t)width * height)) < 0) {
+            fprintf(stderr, "writer: could not create %s: %s\n", name, strerror(-ret));
+            return 1;
+        }
+        for (i = 0; i < NB_FRAMES; i++)
+            push_frame(&ring, width, height, i % 7 == 6);
+        // the reader learns of the new ring from the closed flag of this one
+        if (round == 0)
+            frame_ring_destroy(&ring);
+    }
+
+    // keep the second ring alive, pushing, until the reader has seen it
+    while (waitpid(reader, &status, WNOHANG) == 0) {
+        if (now_us() > deadline) {
+            fprintf(stderr, "writer: reader did not finish in %d s\n", TIMEOUT_SECS);
+            kill(reader, SIGKILL);
+            waitpid(reader, &status, 0);
+            frame_ring_destroy(&ring);
+            return 1;
+        }
+        push_frame(&ring, WIDTH << 1, HEIGHT << 1, 0);
+    }
+    frame_ring_destroy(&ring);
+
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+static int check_frame(const FrameRingFrame *f, int width, int height)
+{
+    uint8_t expected = f->frame_number & 0xfe;
+    int x, y;
+
+    if (f->width != width || f->height != height || f->linesize[0] != width ||
+        f->pts != (int64_t)f->frame_number * 1000)
+        return 0;
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+            if (f->data[0][y * f->linesize[0] + x] != expected)
+                return 0;
+    return 1;
+}
+
+static int run_reader(const char *name)
+{
+    FrameRing ring;
+    FrameRingFrame f;
+    uint64_t last = 0;
+    int64_t deadline = now_us() + TIMEOUT_SECS * 1000000LL;
+    int64_t nb_valid = 0, nb_torn = 0;
+    int round = 0, whole, ret;
+
+    ring.header = NULL;
+    while (now_us() < deadline) {
+        if (!ring.header) {
+            ret = frame_ring_open(&ring, name);
+            if (ret == -ENOENT || ret == -EAGAIN)
+                continue;   // the pusher has not created it yet
+            if (ret < 0) {
+                fprintf(stderr, "reader: could not open %s: %s\n", name, strerror(-ret));
+                return 1;
+            }
+            // the first ring may already be gone again, take whichever is mapped
+            round = ring.header->slot_data_size >= (uint64_t)(WIDTH << 1) * (HEIGHT << 1);
+            last  = 0;
+        }
+
+        ret = frame_ring_latest(&ring, &f);
+        if (ret == -ESTALE) {
+            frame_ring_close(&ring);
+            continue;
+        }
+        if (ret == -EAGAIN)
+            continue;
+        if (ret < 0) {
+            fprintf(stderr, "reader: %s\n", strerror(-ret));
+            return 1;
+        }
+
+        whole = check_frame(&f, WIDTH << round, HEIGHT << round);
+        if (!frame_ring_frame_valid(&f)) {
+            nb_torn++;
+            continue;
+        }
+        if (!whole) {
+            fprintf(stderr, "reader: frame %"PRIu64" is valid but not what was written\n",
+                    f.frame_number);
+            return 1;
+        }
+        if (f.frame_number < last) {
+            fprintf(stderr, "reader: frame %"PRIu64" after %"PRIu64"\n", f.frame_number, last);
+            return 1;
+        }
+        last = f.frame_number;
+        nb_valid++;
+
+        if (round == 1 && last > NB_FRAMES) {
+            printf("reader: %"PRId64" frames checked, %"PRId64" overwritten while read\n",
+                   nb_valid, nb_torn);
+            fflush(stdout);
+            frame_ring_close(&ring);
+            return 0;
+        }
+    }
+
+    fprintf(stderr, "reader: timed out after frame %"PRIu64" of ring %d\n", last, round);
+    return 1;
+}
+
+int main(void)
+{
+    char name[64];
+    pid_t pid;
+
+    snprintf(name, sizeof(name), "/frame_ring_test_%d", (int)getpid());
+    shm_unlink(name);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 1;
+    }
+    if (!pid)
+        _exit(run_reader(name));
+
+    if (run_writer(name, pid)) {
+        fprintf(stderr, "frame ring test failed\n");
+        return 1;
+    }
+    printf("frame ring test passed\n");
+    return 0;
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * heap allocations on the packet path of the mux queue
+ *
+ *     cc -O2 -I. -o packet_queue_test tests/packet_queue_test.c packet_queue.c \
+ *         $(pkg-config --cflags --libs libavcodec libavutil) -lpthread
+ *     ./packet_queue_test
+ *
+ * malloc and friends are replaced by counting versions, which libavutil
+ * picks up as long as it is linked dynamically against glibc. refcounted
+ * packets made up front go through packet_queue_put(), packet_queue_get()
+ * and back into their pool with av_packet_move_ref(), the way the demuxer
+ * hands them to the mux task:
+ *
+ *  - the first fill deeper than the 64 packets the fifo starts with has to
+ *    allocate, av_fifo_realloc2() doubles the fifo
+ *  - every later round to the same depth allocates nothing
+ *  - a deeper round grows the fifo again, after which it is warm again
+ *  - a packet that is not refcounted is copied by av_packet_make_refcounted(),
+ *    which allocates for every packet
+ *
+ * exits 1 when a warm round allocates or a cold one does not.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+
+#include "packet_queue.h"
+
+#define NB_POOL_PACKETS 1024
+#define PACKET_SIZE     1500
+#define NB_WARM_ROUNDS  100
+
+/* glibc's own allocator, under the names it exports for this purpose */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static int64_t nb_allocs;
+
+void *malloc(size_t size)
+{
+    nb_allocs++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    nb_allocs++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    nb_allocs++;
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    nb_allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    nb_allocs++;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+    void *p;
+
+    nb_allocs++;
+    p = __libc_memalign(alignment, size);
+    if (!p)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+static AVPacket pool[NB_POOL_PACKETS];
+
+/* puts depth packets from the pool, takes them out again and returns the allocations */
+static int64_t run_round(PacketQueue *q, int depth)
+{
+    int64_t before = nb_allocs;
+    QueuedPacket e;
+    int i, ret;
+
+    for (i = 0; i < depth; i++) {
+        if ((ret = packet_queue_put(q, &pool[i], NULL, i * (int64_t)40000)) < 0) {
+            fprintf(stderr, "put %d of %d: %s\n", i, depth, av_err2str(ret));
+            exit(1);
+        }
+    }
+    for (i = 0; i < depth; i++) {
+        if ((ret = packet_queue_get(q, &e)) < 0) {
+            fprintf(stderr, "get %d of %d: %s\n", i, depth, av_err2str(ret));
+            exit(1);
+        }
+        // the consumer is done with it, the buffer goes back to the pool
+        av_packet_move_ref(&pool[i], &e.pkt);
+    }
+    if (packet_queue_get(q, &e) != AVERROR(EAGAIN)) {
+        fprintf(stderr, "queue not empty after %d packets\n", depth);
+        exit(1);
+    }
+
+    return nb_allocs - before;
+}
+
+/* grows tells whether the first round has to grow the fifo */
+static int check_rounds(PacketQueue *q, int depth, int grows, const char *what)
+{
+    int64_t cold, warm = 0;
+    int i;
+
+    cold = run_round(q, depth);
+    for (i = 0; i < NB_WARM_ROUNDS; i++)
+        warm += run_round(q, depth);
+
+    printf("%-28s depth %4d: %2"PRId64" allocations the first round, %"PRId64" in %d more\n",
+           what, depth, cold, warm, NB_WARM_ROUNDS);
+    if (!cold != !grows) {
+        fprintf(stderr, grows ? "growing the fifo did not allocate\n" :
+                                "the fifo had room but the queue allocated\n");
+        return 1;
+    }
+    if (warm) {
+        fprintf(stderr, "a warm queue allocated\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+    PacketQueue q = { 0 };
+    AVPacket pkt;
+    uint8_t data[PACKET_SIZE] = { 0 };
+    int64_t before;
+    int i, ret, failed = 0;
+
+    for (i = 0; i < NB_POOL_PACKETS; i++) {
+        if (av_new_packet(&pool[i], PACKET_SIZE) < 0)
+            return 1;
+    }
+    if (packet_queue_init(&q, INT64_MAX, INT64_MAX) < 0)
+        return 1;
+
+    failed |= check_rounds(&q, 32,              0, "refcounted, initial fifo");
+    failed |= check_rounds(&q, 256,             1, "refcounted, fifo grown");
+    failed |= check_rounds(&q, 256,             0, "refcounted, warm");
+    failed |= check_rounds(&q, NB_POOL_PACKETS, 1, "refcounted, fifo grown again");
+
+    // what a demuxer without refcounted buffers costs, for comparison
+    before = nb_allocs;
+    for (i = 0; i < 64; i++) {
+        QueuedPacket e;
+
+        av_init_packet(&pkt);
+        pkt.data = data;
+        pkt.size = sizeof(data);
+        if ((ret = packet_queue_put(&q, &pkt, NULL, AV_NOPTS_VALUE)) < 0 ||
+            (ret = packet_queue_get(&q, &e)) < 0) {
+            fprintf(stderr, "non refcounted packet: %s\n", av_err2str(ret));
+            return 1;
+        }
+        av_packet_unref(&e.pkt);
+    }
+    printf("%-28s %"PRId64" allocations for 64 packets\n", "not refcounted, copied", nb_allocs - before);
+    if (nb_allocs == before) {
+        fprintf(stderr, "copying packets did not allocate\n");
+        failed = 1;
+    }
+
+    packet_queue_free(&q);
+    for (i = 0; i < NB_POOL_PACKETS; i++)
+        av_packet_unref(&pool[i]);
+
+    printf(failed ? "packet queue test failed\n" : "packet queue test passed\n");
+    return failed;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * TsConverter against av_rescale_q_rnd(), then packets per second of
+ * ts_convert_packet() and av_packet_rescale_ts()
+ *
+ *     cc -O2 -I. -o ts_converter_test tests/ts_converter_test.c \
+ *         $(pkg-config --cflags --libs libavcodec libavutil)
+ *     ./ts_converter_test [seed]
+ *
+ * every pair of timebases, the usual ones and random ones up to 2^31, is
+ * tried with the timestamps the fast path gets wrong first if at all: 0,
+ * small values with halfway cases, both sides of the overflow limit, the
+ * extremes and AV_NOPTS_VALUE, then random values of every magnitude.
+ * exits 1 on the first mismatches, 0 otherwise.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/time.h>
+
+#include "ts_converter.h"
+
+#define NB_TIMEBASE_PAIRS 20000
+#define NB_RANDOM_TS      200
+#define MAX_REPORTED      10
+
+#define NB_BENCH_PACKETS  4096
+#define NB_BENCH_ROUNDS   2000
+
+static const AVRational common_timebases[] = {
+    { 1, 1000 }, { 1, 90000 }, { 1, 1000000 }, { 1, 48000 }, { 1, 44100 },
+    { 1, 8000 }, { 1, 16000 }, { 1, 25 }, { 1, 30 }, { 1001, 30000 },
+    { 1001, 60000 }, { 1, 1 }, { 1, 1 << 30 }, { 0x7fffffff, 1 },
+};
+
+#define NB_COMMON_TIMEBASES ((int)(sizeof(common_timebases) / sizeof(common_timebases[0])))
+
+static uint64_t rand_state;
+
+/* xorshift64*, so that a seed gives the same run everywhere */
+static uint64_t rand64(void)
+{
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * UINT64_C(2685821657736338717);
+}
+
+static int rand_int(int max)
+{
+    return 1 + rand64() % max;
+}
+
+static AVRational rand_timebase(void)
+{
+    switch (rand64() % 3) {
+    case 0:  return common_timebases[rand64() % NB_COMMON_TIMEBASES];
+    case 1:  return (AVRational){ rand_int(1001), rand_int(1000000) };
+    default: return (AVRational){ rand_int(INT32_MAX), rand_int(INT32_MAX) };
+    }
+}
+
+/* a value of 1 to 63 bits, either sign */
+static int64_t rand_ts(void)
+{
+    int bits = rand_int(63);
+    int64_t ts = rand64() >> (64 - bits);
+
+    return rand64() & 1 ? -ts : ts;
+}
+
+static int nb_failures;
+
+static void check(const TsConverter *c, int64_t ts)
+{
+    int64_t expected = av_rescale_q_rnd(ts, c->from, c->to, AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+    int64_t got      = ts_convert(c, ts);
+
+    if (got == expected)
+        return;
+    if (nb_failures++ < MAX_REPORTED)
+        fprintf(stderr, "%d/%d to %d/%d: %"PRId64" gives %"PRId64" instead of %"PRId64"\n",
+                c->from.num, c->from.den, c->to.num, c->to.den, ts, got, expected);
+}
+
+static void check_pair(AVRational from, AVRational to)
+{
+    static const int64_t edges[] = {
+        0, 1, -1, 2, -2, AV_NOPTS_VALUE, INT64_MAX, INT64_MIN + 1, INT64_MAX - 1,
+    };
+    TsConverter c;
+    int64_t ts;
+    int i;
+
+    ts_converter_init(&c, from, to);
+
+    for (i = 0; i < (int)(sizeof(edges) / sizeof(edges[0])); i++)
+        check(&c, edges[i]);
+    // halfway cases show up among the first multiples of the divisor
+    for (ts = -1000; ts <= 1000; ts++)
+        check(&c, ts);
+    if (c.max >= 0) {
+        for (ts = c.max - 2; ts <= c.max + 2 && ts >= c.max - 2; ts++) {
+            check(&c, ts);
+            check(&c, -ts);
+        }
+    }
+    for (i = 0; i < NB_RANDOM_TS; i++)
+        check(&c, rand_ts());
+}
+
+static void bench(AVRational from, AVRational to)
+{
+    AVPacket *pkts = av_malloc_array(NB_BENCH_PACKETS, sizeof(*pkts));
+    TsConverter c;
+    int64_t t, sum = 0, elapsed[2];
+    int round, i, pass;
+
+    if (!pkts)
+        exit(1);
+    ts_converter_init(&c, from, to);
+
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < NB_BENCH_PACKETS; i++) {
+            av_init_packet(&pkts[i]);
+            pkts[i].dts      = i * (int64_t)3600;
+            pkts[i].pts      = pkts[i].dts + 7200;
+            pkts[i].duration = 3600;
+        }
+
+        t = av_gettime_relative();
+        for (round = 0; round < NB_BENCH_ROUNDS; round++) {
+            for (i = 0; i < NB_BENCH_PACKETS; i++) {
+                // converted from the same timestamps every round, like fresh packets
+                AVPacket pkt = pkts[i];
+
+                if (pass)
+                    ts_convert_packet(&c, &pkt);
+                else
+                    av_packet_rescale_ts(&pkt, from, to);
+                sum += pkt.pts + pkt.dts + pkt.duration;
+            }
+        }
+        elapsed[pass] = FFMAX(av_gettime_relative() - t, 1);
+    }
+
+    printf("%7d/%-7d to %7d/%-7d %12.0f %12.0f packets/s  x%.1f  (%"PRId64")\n",
+           from.num, from.den, to.num, to.den,
+           (double)NB_BENCH_PACKETS * NB_BENCH_ROUNDS * 1000000 / elapsed[0],
+           (double)NB_BENCH_PACKETS * NB_BENCH_ROUNDS * 1000000 / elapsed[1],
+           (double)elapsed[0] / elapsed[1], sum);
+    av_free(pkts);
+}
+
+int main(int argc, char **argv)
+{
+    int i, j;
+
+    rand_state = argc > 1 ? strtoull(argv[1], NULL, 0) : 1;
+    if (!rand_state)
+        rand_state = 1;
+
+    for (i = 0; i < NB_COMMON_TIMEBASES; i++)
+        for (j = 0; j < NB_COMMON_TIMEBASES; j++)
+            check_pair(common_timebases[i], common_timebases[j]);
+    for (i = 0; i < NB_TIMEBASE_PAIRS; i++)
+        check_pair(rand_timebase(), rand_timebase());
+
+    if (nb_failures) {
+        fprintf(stderr, "%d timestamps differ from av_rescale_q_rnd()\n", nb_failures);
+        return 1;
+    }
+    printf("ts converter matches av_rescale_q_rnd()\n\n");
+
+    printf("%-34s %12s %12s\n", "", "rescale_ts", "converter");
+    bench((AVRational){ 1, 90000 },   (AVRational){ 1, 1000 });
+    bench((AVRational){ 1, 1000 },    (AVRational){ 1, 1000000 });
+    bench((AVRational){ 1, 90000 },   (AVRational){ 1, 1000000 });
+    bench((AVRational){ 1001, 30000 }, (AVRational){ 1, 90000 });
+    bench((AVRational){ 1, 48000 },   (AVRational){ 1, 44100 });
+    return 0;
+}
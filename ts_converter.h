@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 xiaowang yang
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * av_rescale_q() between two timebases fixed for the life of a stream, with
+ * the ratio reduced once: 1/1000 to 1/1000000 is a multiplication by 1000,
+ * 1/90000 to 1/1000000 one by 100 and a division by 9. same results as
+ * av_rescale_q_rnd(ts, from, to, AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX),
+ * so AV_NOPTS_VALUE stays AV_NOPTS_VALUE.
+ *
+ * header only so that stream_push inlines ts_convert() on the packet path;
+ * tests/ts_converter_test.c checks it against av_rescale_q_rnd().
+ */
+
+#ifndef TS_CONVERTER_H
+#define TS_CONVERTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/rational.h>
+
+typedef struct TsConverter {
+    AVRational from, to;
+    int64_t mul, div;
+    int64_t max;            /* larger timestamps take the generic path, -1 for all of them */
+    int shift;              /* div is 1 << shift, -1 if it is not a power of 2 */
+} TsConverter;
+
+static inline void ts_converter_init(TsConverter *c, AVRational from, AVRational to)
+{
+    int64_t b = from.num * (int64_t)to.den, d = to.num * (int64_t)from.den, g;
+
+    memset(c, 0, sizeof(*c));
+    c->from = from;
+    c->to   = to;
+    c->max  = -1;
+    c->shift = -1;
+    if (b <= 0 || d <= 0)
+        return;
+
+    g = av_gcd(b, d);
+    c->mul = b / g;
+    c->div = d / g;
+    // ts * mul + div / 2 must not overflow
+    c->max = (INT64_MAX - c->div / 2) / c->mul;
+    if (!(c->div & (c->div - 1)))
+        for (c->shift = 0; (INT64_C(1) << c->shift) < c->div; c->shift++)
+            ;
+}
+
+static inline int64_t ts_convert(const TsConverter *c, int64_t ts)
+{
+    int64_t x;
+
+    // also INT64_MIN, which cannot be negated
+    if (ts > c->max || ts < -c->max)
+        return av_rescale_q_rnd(ts, c->from, c->to, AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX);
+
+    // nearest, halfway cases away from 0 like av_rescale_rnd() does
+    x = (ts < 0 ? -ts : ts) * c->mul + c->div / 2;
+    x = c->shift >= 0 ? x >> c->shift : x / c->div;
+    return ts < 0 ? -x : x;
+}
+
+/* av_packet_rescale_ts() with a converter */
+static inline void ts_convert_packet(const TsConverter *c, AVPacket *pkt)
+{
+    pkt->pts = ts_convert(c, pkt->pts);
+    pkt->dts = ts_convert(c, pkt->dts);
+    if (pkt->duration > 0)
+        pkt->duration = ts_convert(c, pkt->duration);
+}
+
+#endif /* TS_CONVERTER_H */